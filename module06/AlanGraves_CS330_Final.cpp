@@ -1,5 +1,22 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <cmath>            // sin, cos, sqrt
+#include <vector>           // Mesh pool and generated mesh storage
+#include <string>           // Asset paths and JSON strings
+#include <cstring>          // memcpy, strcmp
+#include <cstdint>          // Fixed width integers for binary formats
+#include <cstdio>           // Binary cache files
+#include <thread>           // Parallel mesh parsing
+#include <chrono>           // Import benchmark timing
+#include <unordered_map>    // Vertex de-duplication
+#include <algorithm>        // sort, min, max
+#include <atomic>           // Job deques and counters
+#include <mutex>
+#include <condition_variable>
+#include <cfloat>           // FLT_MAX
+#if __cplusplus >= 201703L
+#include <memory_resource>  // Frame arena as a std::pmr::memory_resource
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
@@ -9,9 +26,30 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
+#include <glm/gtc/matrix_inverse.hpp>
+
+#include <glm/gtc/quaternion.hpp>
 
 #include <learnOpengl/camera.h> // Camera class
 
+// Platform headers for memory mapped files
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Asset change notifications
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
 using namespace std; // Standard namespace
 
 /*Shader program Macro*/
@@ -19,6 +57,15 @@ using namespace std; // Standard namespace
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+// Shader code shared between programs, appended after a GLSL() block or GLSL_VERSION() that holds the #version line
+#ifndef GLSL_CHUNK
+#define GLSL_CHUNK(Source) #Source
+#endif
+
+#ifndef GLSL_VERSION
+#define GLSL_VERSION(Version) "#version " #Version " core \n"
+#endif
+
 // Unnamed namespace
 namespace
 {
@@ -28,735 +75,3315 @@ namespace
     const int WINDOW_WIDTH = 1200;
     const int WINDOW_HEIGHT = 1000;
 
-    // Stores the GL data relative to a given mesh
+    // Mesh pool indices of the hand-built meshes
     struct GLMesh
     {
-        GLuint tissueBoxVAO, planeVAO, tissueVAO, wristPadVAO, chargerProngVAO;         // Handle for the vertex array object
-        GLuint tissueBoxVBO, planeVBO, tissueVBO, wristPadVBO, chargerProngVBO;         // Handle for the vertex buffer object
-        GLuint tissueBoxVertices, planeVertices, tissueVertices, wristPadVertices, chargerProngVertices;    // Number of indices of the mesh
+        GLuint tissueBox, plane, tissue, wristPad, chargerProng;
     };
 
-    // Main GLFW window
-    GLFWwindow* gWindow = nullptr;
-    // Triangle mesh data
-    GLMesh gMesh;
-    // Texture
-    GLuint gTissueBoxTextureId;
-    glm::vec2 gUVScale(5.0f, 5.0f);
-    GLint gTexWrapMode = GL_REPEAT;
-    GLuint gPlaneTextureId;
-    GLuint gTissueTextureId;
-    GLuint gGlassTextureId;
-    GLuint gWristPadTextureId;
-    GLuint gChargerBrickTextureId;
-    GLuint gChargerProngTextureId;
-    GLuint gGlassTopTextureId;
+    // Stores the GL data for one indexed mesh in the mesh pool
+    struct GLIndexedMesh
+    {
+        GLuint vao;         // Handle for the vertex array object
+        GLuint vbo;         // Handle for the vertex buffer object
+        GLuint ebo;         // Handle for the element (index) buffer object
+        GLuint lightmapVbo; // Lightmap coordinates (attribute 3), only for baked object meshes
+        GLsizei indices;    // Number of indices of the mesh
+        glm::vec3 boundsMin, boundsMax; // Object space bounding box
+    };
 
-    // Shader programs
-    GLuint gCubeProgramId;
-    GLuint gLampProgramId;
+    // CPU side output of the procedural mesh generators, in the same interleaved layout as UCreateMesh
+    // (position, normal, texture coordinates). Reusing one instance across regenerations means the
+    // storage only grows when the tessellation does.
+    struct UMeshData
+    {
+        std::vector<GLfloat> vertices;
+        std::vector<GLuint> indices;
+    };
 
-    // camera
-    Camera gCamera(glm::vec3(1.0f, 1.0f, 8.0f));
-    float gLastX = WINDOW_WIDTH / 2.0f;
-    float gLastY = WINDOW_HEIGHT / 2.0f;
-    bool gFirstMouse = true;
+    /* Header of the binary mesh cache. All fields are little-endian, and the arrays it points to start on
+     * 16 byte boundaries, so a mapped cache file can be handed to the GL as-is.
+     */
+    struct UMeshCacheHeader
+    {
+        char magic[4];          // "UMSH"
+        uint32_t version;
+        uint64_t contentHash;   // Hash of the source file the cache was built from
+        uint64_t sourceSize;    // Size and modification time of the source when it was last hashed; while both
+        int64_t sourceTime;     // match, a warm start doesn't read the source at all
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        uint32_t floatsPerVertex;
+        uint32_t lodCount;
+        float boundsMin[3];
+        float boundsMax[3];
+        uint64_t lodOffset;     // Byte offsets from the start of the file
+        uint64_t vertexOffset;
+        uint64_t indexOffset;
+    };
 
-    // timing
-    float gDeltaTime = 0.0f; // time between current frame and last frame
-    float gLastFrame = 0.0f;
+    // One level of detail as stored in the cache: a range of whole triangles in the index array
+    struct UMeshCacheLod
+    {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        float distance;         // Camera distance up to which this level is used
+        uint32_t reserved;
+    };
 
-    // Subject position and scale
-    glm::vec3 gCubePosition(0.0f, 0.0f, 0.0f);
-    glm::vec3 gCubeScale(2.0f);
+    const uint32_t MESH_CACHE_VERSION = 3;
 
-    // Cube and light color
-    //m::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
-    glm::vec3 gObjectColor(1.f, 0.2f, 0.0f);
-    glm::vec3 gLightColor(1.0f, 1.0f, 1.0f);
+    // Identifies a version of a file without reading it
+    struct UFileStamp
+    {
+        uint64_t size;
+        int64_t time;           // Modification time, in the platform's units
+    };
 
-    // Light position and scale
-    glm::vec3 gLightPosition(3.5f, 0.0f, 10.0f);
-    glm::vec3 gLightScale(0.1f);
+    // Floats per interleaved vertex (3 position, 3 normal, 2 uv)
+    const GLuint FLOATS_PER_VERTEX = 8;
 
-    // Plane position
-    glm::vec3 gPlanePosition(0.0f, 0.0f, 0.0f);
-    glm::vec3 gPlaneScale(5.0f);
+    // Read-only view of a whole file, mapped into memory so importers can read it in place
+    struct UMappedFile
+    {
+        const unsigned char* data;
+        size_t size;
+#ifdef _WIN32
+        HANDLE file;
+        HANDLE mapping;
+#endif
+    };
 
-    // Tissue position
-    glm::vec3 gTissuePosition(0.0f, 1.0f, 0.0f);
-    glm::vec3 gTissueScale(1.0f);
+    // Minimal JSON document tree, enough for glTF and the renderer's own data files
+    struct UJsonValue
+    {
+        enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
 
-    // Glass position
-    glm::vec3 gGlassPosition(3.0f, -0.6f, 0.0f);
-    glm::vec3 gGlassScale(0.8f);
+        Type type;
+        double number;                  // Numbers, and booleans as 0 or 1
+        std::string string;
+        std::vector<UJsonValue> items;  // Array elements, or object values
+        std::vector<std::string> keys;  // Object keys, parallel to items
 
-    // Glass top position
-    glm::vec3 gGlassTopPosition(3.0f, -0.0f, 0.0f);
-    glm::vec3 gGlassTopScale(0.4f);
+        UJsonValue() : type(NUL), number(0.0) {}
+    };
 
-    // Wrist Pad Location
-    glm::vec3 gWristPadPosition(0.5f, -1.0f, 2.5f);
-    glm::vec3 gWristPadScale(1.0f);
+    // Tessellation levels of the curved props, from closest to farthest
+    const int NUM_LODS = 3;
+    const GLuint LOD_SLICES[NUM_LODS] = { 48, 24, 12 };
+    const float LOD_DISTANCES[NUM_LODS - 1] = { 6.0f, 14.0f };  // Camera distance at which the next level kicks in
 
-    // Charger brick position
-    glm::vec3 gChargerBrickPosition(0.8f, -0.15f, 2.5f);
-    glm::vec3 gChargerBrickScale(0.7);
+    // Kinds of mesh a scene can reference
+    enum USceneMeshKind
+    {
+        MESH_BUILTIN,       // One of the hand-built meshes in UCreateMesh
+        MESH_FILE,          // OBJ or glTF file
+        MESH_CYLINDER,      // params: radius, height
+        MESH_CAPSULE,       // params: radius, height
+        MESH_SPHERE,        // params: radius
+        MESH_TORUS,         // params: major radius, minor radius
+        MESH_ROUNDED_BOX,   // params: half extents x, y, z, corner radius
+        MESH_EXTRUSION      // params: height; profile points from the scene's profile array
+    };
 
-    // Charger prong 1 position
-    glm::vec3 gChargerProng1Position(1.0f, 0.2f, 2.5f);
-    glm::vec3 gChargerProng1Scale(0.2f);
+    /* Scene description records. They are plain data, so a compiled scene file is just these arrays written
+     * one after the other. Names and paths live in one string table and are referenced by byte offset.
+     */
+    struct USceneMeshDesc
+    {
+        uint32_t kind;              // USceneMeshKind
+        uint32_t name;
+        uint32_t source;            // Built-in mesh name or file path (relative to the scene file)
+        uint32_t firstProfilePoint;
+        uint32_t profilePointCount;
+        float params[4];
+    };
 
-    // Charger prong 2 position
-    glm::vec3 gChargerProng2Position(0.6f, 0.2f, 2.5f);
-    glm::vec3 gChargerProng2Scale(0.2f);
+    struct USceneTextureDesc
+    {
+        uint32_t name;
+        uint32_t file;              // Relative to the scene file
+    };
 
-    // Lamp animation
-    bool gIsLampOrbiting = true;
-}
+    struct USceneMaterialDesc
+    {
+        uint32_t name;
+        int32_t texture;            // Index into the textures, or -1
+        float specularIntensity;
+        float highlightSize;
+    };
 
-/* User-defined Function prototypes to:
- * initialize the program, set the window size,
- * redraw graphics on the window when resized,
- * and render graphics on the screen
- */
-bool UInitialize(int, char* [], GLFWwindow** window);
-void UResizeWindow(GLFWwindow* window, int width, int height);
-void UProcessInput(GLFWwindow* window);
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void UCreateMesh(GLMesh& mesh);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
-void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
+    struct USceneObjectDesc
+    {
+        uint32_t name;
+        uint32_t mesh;
+        uint32_t material;
+        int32_t parent;             // Index into the objects, or -1. The transform below is relative to it
+        float position[3];
+        float scale[3];
+        float rotationAxis[3];
+        float rotationAngle;        // Radians
+    };
 
+    struct USceneLightDesc
+    {
+        float position[3];
+        float color[3];
+        float scale;                // Size of the lamp cube drawn at the light
+        uint32_t orbit;             // Non-zero if the light orbits the origin
+        float radius;               // Range of the light; 0 lights the whole scene without falloff
+        uint32_t shadow;            // Non-zero if the light casts shadows (only the first such light does)
+    };
 
-/* Cube Vertex Shader Source Code*/
-const GLchar* cubeVertexShaderSource = GLSL(440,
+    struct USceneDesc
+    {
+        std::string strings;
+        std::vector<USceneMeshDesc> meshes;
+        std::vector<USceneTextureDesc> textures;
+        std::vector<USceneMaterialDesc> materials;
+        std::vector<USceneObjectDesc> objects;
+        std::vector<USceneLightDesc> lights;
+        std::vector<glm::vec2> profilePoints;
+        float cameraPosition[3];
+        float ambientStrength;
+    };
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-    layout(location = 1) in vec3 normal; // VAP position 1 for normals
-    layout(location = 2) in vec2 textureCoordinate;
+    // Header of a compiled scene file, followed by the record arrays in USceneDesc order and the string table
+    struct USceneFileHeader
+    {
+        char magic[4];              // "USCN"
+        uint32_t version;
+        uint32_t meshCount, textureCount, materialCount, objectCount, lightCount, profilePointCount, stringBytes;
+        float cameraPosition[3];
+        float ambientStrength;
+    };
 
-    out vec3 vertexNormal; // For outgoing normals to fragment shader
-    out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-    out vec2 vertexTextureCoordinate;
+    const uint32_t SCENE_FILE_VERSION = 4;
 
-    //Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    // Loaded scene: GL resources plus the flat arrays the renderer walks every frame
+    struct USceneMesh
+    {
+        GLuint lods[NUM_LODS];      // Mesh pool ids per level of detail (repeated for meshes without levels)
+    };
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    struct USceneMaterial
+    {
+        GLuint texture;
+        GLuint sampler;             // From the sampler cache; bound with the texture on unit 0
+        float specularIntensity;
+        float highlightSize;
+    };
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    const GLuint NO_MESH = 0xFFFFFFFFu;
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-}
-);
+    struct USceneObject
+    {
+        GLuint mesh;
+        GLuint material;
+        GLuint entity;      // Index into the scene's transform store
+        GLuint lightmapMesh;    // Pool mesh with lightmap coordinates, NO_MESH if the object isn't baked
+    };
 
+    struct USceneLight
+    {
+        glm::vec3 position;
+        glm::vec3 color;
+        float scale;
+        bool orbit;
+        float radius;
+        bool shadow;
+    };
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* cubeFragmentShaderSource = GLSL(440,
+    /* Entity transforms as a structure of arrays: each component is its own tightly packed array indexed by
+     * entity, so the transform system streams through exactly the data it needs. World matrices are only
+     * rebuilt for subtrees that were marked dirty.
+     *
+     * Entities form a hierarchy stored in depth-first order: a parent always comes before its children and
+     * every subtree occupies the contiguous range [entity, subtreeEnd[entity]). Position, rotation and scale
+     * are local to the parent.
+     */
+    const GLuint NO_PARENT = 0xFFFFFFFFu;
+
+    struct UTransformStore
+    {
+        std::vector<glm::vec3> position;
+        std::vector<glm::quat> rotation;
+        std::vector<glm::vec3> scale;
+        std::vector<glm::mat4> world;
+        std::vector<GLuint> parent;         // NO_PARENT for roots
+        std::vector<GLuint> subtreeEnd;     // One past the last descendant
+        std::vector<GLuint> roots;
+        std::vector<GLuint> dirty;          // Entities whose subtree needs its world matrices rebuilt
+        uint64_t version;                   // Bumped on every change, for caches built from the transforms
+    };
 
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
+    struct UScene
+    {
+        UTransformStore transforms;
+        std::vector<USceneMesh> meshes;
+        std::vector<GLuint> textures;
+        std::vector<std::string> textureNames;
+        std::vector<std::string> textureFiles;
+        std::vector<std::string> meshFiles;     // Path of each mesh loaded from a file, empty for the rest
+        std::vector<USceneMaterial> materials;
+        std::vector<USceneObject> objects;  // Sorted by material, then mesh, to minimize state changes
+        std::vector<USceneLight> lights;
+        float ambientStrength;
+    };
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    /* Job system. Every thread that submits jobs owns a Chase-Lev deque: the owner pushes and pops its
+     * newest jobs at the bottom without locking, and idle threads steal the oldest from the top of another
+     * thread's deque. A job over a range splits itself in halves down to its grain as it runs, so a thief
+     * takes the largest remaining piece.
+     */
+    typedef void (*UJobFunction)(void* context, size_t begin, size_t end);
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTissueBoxTexture; // Useful when working with multiple textures
-uniform sampler2D uPlaneTexture;
-uniform sampler2D uTissueTexture;
-uniform sampler2D uGlassTexture;
-uniform sampler2D uWristPadTexture;
-uniform sampler2D uChargerBrickTexture;
-uniform sampler2D uChargerProngTexture;
-uniform vec2 uvScale;
+    // Counts the unfinished jobs of a group. Waiting on it runs other jobs in the meantime.
+    struct UJobCounter
+    {
+        std::atomic<size_t> pending;
 
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+        UJobCounter() : pending(0) {}
+    };
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.5f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 1.0f; // Set specular light strength
-    float highlightSize = 30.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
+    struct UJob
+    {
+        UJobFunction function;
+        void* context;
+        size_t begin, end;
+        size_t grain;               // Ranges larger than this are split before running
+        UJobCounter* counter;       // Decremented once the job has run
+    };
 
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTissueBoxTexture, vertexTextureCoordinate * uvScale);
+    const int64_t JOB_DEQUE_SIZE = 1024;           // Power of two; a full deque runs new jobs inline
+    const unsigned MAX_JOB_THREADS = 64;            // Workers plus the outside threads that submit jobs
 
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    struct UJobDeque
+    {
+        // The fields are atomic because a thief may still read a slot that its owner is reusing; the thief's
+        // claim on 'top' fails in that case and the torn copy is dropped
+        struct Slot
+        {
+            std::atomic<UJobFunction> function;
+            std::atomic<void*> context;
+            std::atomic<size_t> begin, end, grain;
+            std::atomic<UJobCounter*> counter;
+        };
+
+        std::atomic<int64_t> top;                   // Thieves take from here
+        char padding[64];                           // Keeps the owner's end off the thieves' cache line
+        std::atomic<int64_t> bottom;                // The owner pushes and pops here
+        Slot slots[JOB_DEQUE_SIZE];
+    };
 
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
+    struct UJobSystem
+    {
+        std::atomic<UJobDeque*> deques[MAX_JOB_THREADS];   // Workers first, then other threads as they submit
+        std::atomic<unsigned> dequeCount;
+        std::atomic<unsigned> generation;           // Bumped on every start, so threads register again
+        std::vector<std::thread> threads;
+
+        // Idle workers sleep until something is queued
+        std::atomic<int> queued;                    // Jobs pushed and not taken yet
+        std::atomic<int> sleeping;
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::atomic<bool> quit;
+    };
 
+    // The deque a thread pushes to, valid for one generation of the job system
+    struct UJobThread
+    {
+        unsigned generation;
+        int index;                                  // -1 if every deque is taken; the thread then runs jobs inline
+    };
 
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
+    /* Frame arenas: a bump allocator per thread for transient data (see UThreadArena). Allocating moves
+     * an offset and nothing is freed on its own. The render and simulation threads reset their arena at
+     * the start of each frame; jobs and functions with scratch space rewind it with a UArenaScope instead.
+     * A frame that outgrows its block chains another one, and the next reset folds them into one block as
+     * large as the peak, so steady state frames never reach malloc.
+     *
+     * With --arena-debug, released memory is filled with ARENA_POISON, containers using UArenaAllocator
+     * abort when they are touched after their frame was reset (an escaped pointer), and arenas report
+     * their peak whenever they grow.
+     */
+    const size_t ARENA_BLOCK_SIZE = 256 * 1024;
+    const unsigned char ARENA_POISON = 0xCD;
+
+    struct UFrameArena
+    {
+        std::vector<std::vector<unsigned char> > blocks;   // Freed with the thread
+        size_t block;               // Block being allocated from
+        size_t offset;              // Into that block
+        size_t used;                // Bytes handed out since the reset, alignment included
+        size_t peak;
+        uint64_t frame;             // Bumped by every reset
+        int thread;                 // Arenas are numbered in order of first use, 0 until then
+    };
 
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    // Position of an arena to rewind it to
+    struct UArenaMark
+    {
+        size_t block, offset, used;
+    };
 
-        //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    /* Profiler. Scopes (see UPROFILE_SCOPE) record when they start and how long they take into a ring that
+     * any thread appends to with a single atomic increment, overwriting the oldest events once it is full.
+     * GPU scopes also bracket their GL commands with timestamp queries, read back a few frames later onto
+     * the GPU track. T writes the ring out as Chrome trace event JSON, for chrome://tracing or Perfetto, and
+     * --trace FILE picks the file and writes it again at exit.
+     */
+    const uint64_t PROFILE_RING_SIZE = 65536;       // Events
+    const int PROFILE_MAX_THREADS = 64;             // Named tracks
+    const int PROFILE_GPU_SPANS = 256;              // GPU scopes waiting for their queries
+    const int PROFILE_GPU_TRACK = 1 << 20;
+    const int PROFILE_SHADER_TRACK = PROFILE_GPU_TRACK + 1;    // Shader programs, from submission until found ready
+    const double PROFILE_CALIBRATION_PERIOD = 1.0;  // Seconds between measuring the GPU clock against the CPU's
+
+    // Fields are atomics so the ring can be written out while other threads record; 'sequence' works as a seqlock
+    struct UProfileEvent
+    {
+        std::atomic<uint64_t> sequence;         // Ring index + 1 once written, 0 while being written
+        std::atomic<const char*> name;
+        std::atomic<uint64_t> start, duration;  // Nanoseconds on UProfileClock
+        std::atomic<int> track;                 // Thread, PROFILE_GPU_TRACK or PROFILE_SHADER_TRACK
+    };
 
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-}
-);
+    struct UGpuProfileSpan
+    {
+        const char* name;
+        GLuint queries[2];          // GL_TIMESTAMP at the start and the end of the scope
+        bool isEnded;
+    };
 
+    struct UProfiler
+    {
+        UProfileEvent events[PROFILE_RING_SIZE];
+        std::atomic<uint64_t> next;             // Ring index of the next event
+        uint64_t epoch;                         // Time 0 of the trace
+        std::atomic<int> threadCount;
+        char threadNames[PROFILE_MAX_THREADS][32];
+        std::atomic<bool> isThreadNamed[PROFILE_MAX_THREADS];
+        std::string traceFile;
+        bool isTracingAtExit;
+
+        // GPU timing, on the main thread only
+        bool hasGpuTimers;
+        UGpuProfileSpan gpuSpans[PROFILE_GPU_SPANS];    // Ring of spans whose queries aren't read yet
+        int firstGpuSpan, gpuSpanCount;
+        int64_t gpuClockOffset;                 // UProfileClock minus GL_TIMESTAMP, in nanoseconds
+        uint64_t lastCalibration;
+    };
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+    /* Video memory by category, kept up to date as textures and buffers are created, resized and deleted, so
+     * reading it costs nothing. Sizes come from the dimensions and formats resources are created with.
+     * Drivers pad and align allocations, and the window's own framebuffer isn't counted, so the real use is
+     * somewhat higher.
+     */
+    enum UVideoMemoryCategory
+    {
+        VRAM_TEXTURES,          // Scene textures and the HUD's font
+        VRAM_MESHES,            // Mesh pool vertex, index and lightmap coordinate buffers
+        VRAM_RENDER_TARGETS,    // G-buffer and shadow cube maps
+        VRAM_LIGHTING,          // Lightmap, probe grid and cluster light lists
+        VRAM_BUFFERS,           // Per draw data, deferred materials and the HUD's quads
+        VRAM_CATEGORIES
+    };
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+    struct UVideoMemoryEntry
+    {
+        int category;
+        GLsizeiptr bytes;
+    };
 
-void main()
-{
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
+    struct UVideoMemory
+    {
+        std::unordered_map<GLuint, UVideoMemoryEntry> textures, buffers;   // By GL name
+        GLsizeiptr bytes[VRAM_CATEGORIES];
+    };
 
+    /* Performance HUD, toggled with H: frame rate, a graph of the last HUD_HISTORY frame times, CPU and GPU
+     * time, the draw and state counters of the last frame and video memory by category.
+     * Every character, bar and panel is one instanced quad from a font atlas, so the overlay is one draw.
+     */
+    const int FONT_FIRST = 32;                      // The font covers printable ASCII
+    const int FONT_COUNT = 95;
+    const int FONT_WIDTH = 5;                       // Pixels per glyph
+    const int FONT_HEIGHT = 7;
+    const int FONT_SOLID = FONT_COUNT;              // Fully set atlas cell after the glyphs, for panels and bars
+    const int HUD_SCALE = 2;                        // Window pixels per font pixel
+    const int HUD_HISTORY = 120;                    // Frames in the graph
+    const int HUD_GRAPH_HEIGHT = 24;                // Font pixels
+    const float HUD_GRAPH_MS = 50.0f;               // Frame time at the top of the graph
+    const size_t HUD_MAX_QUADS = 2048;
+    const double HUD_TEXT_PERIOD = 0.25;            // Seconds the numbers are averaged over, so they stay readable
+    const int HUD_GPU_FRAMES = 4;                   // Frames of timestamp queries in flight
+
+    // Counted by the main thread while it renders a frame
+    struct UFrameStats
+    {
+        GLuint draws, triangles;
+        GLuint textureBinds, programBinds, uniformUploads;
+        GLuint objects, visibleObjects;     // Draw list before and after frustum culling
+    };
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
+    // Instance data of one HUD quad
+    struct UHudQuad
     {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+        float x, y, width, height;  // Window pixels from the top left
+        GLuint glyph;               // Atlas cell
+        GLuint color;               // RGBA8, red in the lowest byte
+    };
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
-    }
-}
+    struct UHud
+    {
+        bool isVisible;
+        GLuint vao, instanceBuffer, atlas;
+        std::vector<UHudQuad> quads;        // Panel and text, rebuilt every HUD_TEXT_PERIOD, then the graph
+        size_t textQuads;
+        float graphTop;                     // Window pixels
+
+        float frameTimes[HUD_HISTORY];      // Milliseconds, oldest first from nextFrameTime
+        int nextFrameTime;
+        double lastFrame, lastText;         // glfwGetTime
+        uint64_t frameStart;                // UProfileClock when URender started
+
+        // Sums over the current text period
+        double frameSum, cpuSum, gpuSum;
+        int frameCount, cpuCount, gpuCount;
+
+        // GL_TIMESTAMP at the start of a frame and before the HUD, read back once the GPU is done
+        GLuint gpuQueries[HUD_GPU_FRAMES][2];
+        int firstGpuFrame, gpuFrameCount;
+        bool isTimingGpu;                   // The current frame's start was queried
+    };
 
+    /* Clustered forward lighting: the view frustum is split into a grid of clusters, CLUSTER_X by CLUSTER_Y
+     * screen tiles and CLUSTER_Z depth slices spaced exponentially between the near and far planes. Every
+     * frame each cluster gets the list of lights that can reach it, and a fragment only loops over the lights
+     * of its own cluster.
+     */
+    const GLuint CLUSTER_X = 16;
+    const GLuint CLUSTER_Y = 9;
+    const GLuint CLUSTER_Z = 24;
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+    struct UClusteredLights
+    {
+        // Shader storage buffers, bound to the indices used by the cube shader
+        GLuint lightBuffer;                 // Binding 0: per light world position + radius, color
+        GLuint clusterBuffer;               // Binding 1: per cluster offset and count into the index list
+        GLuint indexBuffer;                 // Binding 2: light indices, cluster after cluster
+        GLsizeiptr lightBytes, indexBytes;  // Current buffer sizes
+
+        std::vector<glm::vec4> lights;
+        std::vector<GLuint> clusters;
+        std::vector<GLuint> indices;
+
+        // Light indices per depth slice, kept between frames to avoid reallocating
+        std::vector<std::vector<GLuint> > sliceLists;
+    };
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+    /* G-buffer of the deferred renderer, 16 bytes per pixel:
+     * - albedo: RGBA8, texture color and the material index in alpha
+     * - normal: RG16 signed, octahedral encoded world space normal
+     * - ambient: R11G11B10 float, baked ambient lighting (1 without a lightmap)
+     * - depth: 32 bit float, the world position is rebuilt from it
+     */
+    struct UGBuffer
+    {
+        GLuint framebuffer;
+        GLuint albedo, normal, ambient, depth;
+        GLuint materialBuffer;          // Binding 3: specular intensity and highlight size per material
+        GLsizeiptr materialBytes;
+        GLuint emptyVao;                // The full screen triangle is generated from gl_VertexID
+        int width, height;
+    };
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(cubeVertexShaderSource, cubeFragmentShaderSource, gCubeProgramId))
-        return EXIT_FAILURE;
+    /* Sampler objects, one per distinct filter/wrap/anisotropy/border combination. Textures keep their own
+     * parameters untouched; how a draw samples its texture is picked by binding a sampler to the unit.
+     */
+    struct USamplerKey
+    {
+        GLenum minFilter;
+        GLenum magFilter;
+        GLenum wrap;                // Both S and T
+        GLfloat anisotropy;         // 1 for none
+        glm::vec4 borderColor;      // Only part of the key with GL_CLAMP_TO_BORDER
+    };
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
+    struct USamplerCache
+    {
+        std::vector<USamplerKey> keys;
+        std::vector<GLuint> samplers;   // Parallel to keys
+        GLfloat maxAnisotropy;          // 1 without anisotropic filtering support
+        GLfloat anisotropy;             // Applied to the material samplers; --anisotropy N
+    };
 
-    // Load textures
-    const char* tissueBoxFile = "../../resources/textures/tissue_box.jpg";
-    UCreateTexture(tissueBoxFile, gTissueBoxTextureId);    
-    const char* planeFile = "../../resources/textures/leather2.jpg";
-    UCreateTexture(planeFile, gPlaneTextureId);
-    const char* tissueFile = "../../resources/textures/tissue_paper.jpg";
-    UCreateTexture(tissueFile, gTissueTextureId);
-    const char* glassFile = "../../resources/textures/glass.jpg";
-    UCreateTexture(glassFile, gGlassTextureId);
-    const char* wristPadFile = "../../resources/textures/leather.jpg";
-    UCreateTexture(wristPadFile, gWristPadTextureId);
-    const char* chargerBrickFile = "../../resources/textures/charger.jpg";
-    UCreateTexture(chargerBrickFile, gChargerBrickTextureId);
-    const char* chargerProngFile = "../../resources/textures/brass.jpg";
-    UCreateTexture(chargerProngFile, gChargerProngTextureId);
-    const char* glassTopFile = "../../resources/textures/leather.jpg";
-    UCreateTexture(glassTopFile, gGlassTopTextureId);
-
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gCubeProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTissueBoxTexture"), 0);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uPlaneTexture"), 1);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTissueTexture"), 2);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uGlassTexture"), 3);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uWristPadTexture"), 4);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uChargerBrickTexture"), 5);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uChargerProngTexture"), 6);
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uGlassTopTexture"), 7);
+    /* Per draw data of the scene objects: a persistently mapped, coherent buffer split into regions that
+     * the CPU fills in turn, so writing a frame's draws is a plain store into memory the GPU reads. A fence
+     * after the draws of a region keeps it from being overwritten before the GPU is done with it. Draws
+     * pass their record's index as an instance attribute (baseInstance into drawIndexBuffer, which holds
+     * 0, 1, 2, ...) and the vertex shader reads the record from the DrawBuffer SSBO.
+     */
+    const int DRAW_RING_REGIONS = 3;
+    const GLuint DRAW_DATA_BINDING = 4;             // Shader storage binding of DrawBuffer
+    const GLuint DRAW_INDEX_ATTRIBUTE = 4;
+    const GLuint DRAW_INDEX_BINDING = 2;            // Vertex buffer binding of the draw indices (direct state access)
+    const GLuint DRAW_RING_MIN_CAPACITY = 1024;     // Records per region
+
+    // std430 layout of DrawData in the cube vertex shader
+    struct UDrawData
+    {
+        glm::mat4 model;
+        glm::vec4 normalMatrix[3];  // Columns of the inverse transpose of the model's upper 3x3
+        GLuint material;            // Index into the scene materials
+        GLuint padding[3];
+    };
 
+    struct UDrawRing
+    {
+        GLuint buffer;
+        UDrawData* records;         // Mapped for as long as the buffer lives
+        GLuint capacity;            // Records per region
+        int region;                 // Last region handed out
+        GLsync fences[DRAW_RING_REGIONS];
+        GLuint drawIndexBuffer;     // DRAW_RING_REGIONS * capacity consecutive indices
+    };
 
+    /* Omnidirectional shadows for one point light: a depth cube map holding the distance to the light.
+     * The casters are rendered into a back cube a few faces per frame, and only once the light has moved
+     * past a threshold (or an object moved); when all six faces are done the cubes swap. Shadow cost per
+     * frame is bounded by the face budget and the lit cube always matches one light position.
+     */
+    const GLsizei SHADOW_MAP_SIZE = 1024;
+    const float SHADOW_NEAR_PLANE = 0.05f;
+    const float SHADOW_FAR_PLANE = 50.0f;
+    const float SHADOW_MOVE_THRESHOLD = 0.05f;      // World units the light may move before the cache is rebuilt
+    const int SHADOW_FACES_PER_FRAME = 2;
+    const int SHADOW_PCF_LEVELS = 3;                // Samples per lookup: 1 (hardware 2x2), 8 and 20
+    const GLint SHADOW_TEXTURE_UNIT = 8;            // Above every texture unit the other samplers use
+
+    struct UShadowMap
+    {
+        GLuint framebuffer;
+        GLuint cubes[2];
+        int front;                      // Cube that is sampled; the other one is being rendered
+        bool valid;                     // The front cube is complete
+        glm::vec3 frontPosition;        // Light position each cube was rendered from
+        glm::vec3 backPosition;
+        int nextFace;                   // Next face of the back cube to render, 6 when idle
+        uint64_t transformVersion;      // Transform store version the back cube was started at
+        int light;                      // Index of the shadowed scene light, -1 if none
+        int pcf;                        // Filter quality, 0 to SHADOW_PCF_LEVELS - 1
+    };
 
+    /* Baked ambient lighting. Every triangle of the scene objects gets its own square cell in one lightmap
+     * atlas, sized by its area; the triangle covers the lower left half and each texel of the cell stores the
+     * light at the nearest point of the triangle, so bilinear filtering never reads another triangle. A
+     * background path tracer fills the atlas with the ambient light that reaches each point, including
+     * bounces off other objects, and the shaders scale the ambient term by it.
+     */
+    const GLsizei LIGHTMAP_WIDTH = 1024;
+    const float LIGHTMAP_TEXELS_PER_UNIT = 8.0f;
+    const GLsizei LIGHTMAP_MIN_CELL = 4;
+    const GLsizei LIGHTMAP_MAX_CELL = 128;
+    const int LIGHTMAP_BOUNCES = 3;
+    const int LIGHTMAP_SAMPLES_PER_PASS = 4;        // Paths per texel between two progressive updates
+    const uint32_t LIGHTMAP_FILE_VERSION = 1;
+    const GLint LIGHTMAP_TEXTURE_UNIT = 9;
+
+    // World space triangle, kept in the form the intersection test wants
+    struct UBakeTriangle
+    {
+        glm::vec3 v0, edge1, edge2;
+        glm::vec3 normal;           // Facing of the surface, zero for degenerate triangles
+        GLuint material;
+    };
 
+    // Bounding volume hierarchy node: inner nodes have count 0 and their children at first and first + 1
+    struct UBvhNode
+    {
+        glm::vec3 boundsMin;
+        GLuint first;
+        glm::vec3 boundsMax;
+        GLuint count;
+    };
 
+    // Surface point a lightmap texel stands for; a zero normal marks texels outside every cell
+    struct ULightmapTexel
+    {
+        glm::vec3 position;
+        glm::vec3 normal;
+    };
 
-    // Sets the background color of the window to black (it will be implicitely used by glClear)
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    struct ULightmapFileHeader
+    {
+        char magic[4];              // "ULMP"
+        uint32_t version;
+        uint64_t layoutHash;        // Hash of the texels, so a lightmap is only used with the geometry it was baked for
+        uint32_t width, height;
+        uint32_t samples;
+        uint32_t reserved;
+    };
 
-    // render loop
-    // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    /* Irradiance probes light whatever has no lightmap. Probes sit at the cell centers of a grid over the
+     * scene bounds; each stores the ambient light arriving from every direction as L2 spherical harmonics
+     * (9 RGB coefficients), already convolved with the cosine lobe so the shaders turn it into irradiance
+     * with one multiply-add per coefficient. The 27 floats of a probe are spread over PROBE_SLABS RGBA
+     * slabs of one 3D texture, stacked along z, so hardware trilinear filtering blends neighbouring probes.
+     */
+    const float PROBE_SPACING = 1.0f;
+    const int PROBE_MAX_COUNT = 16;                 // Per axis; the spacing grows for larger scenes
+    const int PROBE_RAYS = 512;
+    const int PROBE_SLABS = 7;                      // 27 coefficient floats, 4 per texel
+    const GLint PROBE_TEXTURE_UNIT = 10;
+
+    struct UProbeGrid
     {
-        // per-frame timing
-        // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        GLuint texture;             // 0 when there is no grid
+        glm::vec3 origin;           // Position of probe (0, 0, 0)
+        glm::vec3 spacing;
+        glm::ivec3 counts;
+        std::vector<glm::vec3> coefficients;    // 9 per probe, x fastest
+    };
 
-        // input
-        // -----
-        UProcessInput(gWindow);
+    struct ULightmap
+    {
+        GLuint texture;             // RGBA16F, 0 when the scene has no lightmap
+        GLsizei width, height;
+        std::string file;
+        uint64_t layoutHash;
+
+        // Scene snapshot the baker traces against
+        std::vector<UBakeTriangle> triangles;
+        std::vector<UBvhNode> nodes;
+        std::vector<glm::vec3> albedo;          // Average texture color per material
+        std::vector<ULightmapTexel> texels;
+
+        // Progressive bake, running on its own threads
+        std::thread thread;
+        std::atomic<bool> quit;
+        std::atomic<bool> baking;
+        int targetSamples;
+        std::vector<glm::vec3> accumulated;     // Sum of all paths per texel
+        std::mutex displayMutex;
+        std::vector<glm::vec4> display;         // Latest average, waiting to be uploaded
+        bool isDisplayReady;
+    };
 
-        // Render this frame
-        URender();
+    /* Shader permutations. The scene shaders come in families (forward cube shader, G-buffer pass, deferred
+     * lighting), and each family is compiled once per combination of features its draws need. The features
+     * are injected as #define lines after the #version line and tested as constants in the GLSL, so the
+     * compiler strips whatever a variant doesn't use. Variants are handed to the driver the first time they
+     * are drawn (or up front, see UWarmShaderVariants) and draw with the family's fallback until they finish.
+     */
+    const uint32_t SHADER_TEXTURED = 1u << 0;       // Samples the material texture, otherwise uses objectColor
+    const uint32_t SHADER_SPECULAR = 1u << 1;       // Material has a specular highlight
+    const uint32_t SHADER_SHADOWED = 1u << 2;       // A light casts shadows
+    const uint32_t SHADER_LIGHTMAPPED = 1u << 3;    // Ambient light from the lightmap
+    const uint32_t SHADER_PROBES = 1u << 4;         // Ambient light from the probe grid
+    const uint32_t SHADER_DIRECT_LIGHTS = 0xFu << 8;    // Lights looped over directly, skipping the clusters (0 = clustered)
+    const int SHADER_DIRECT_LIGHTS_SHIFT = 8;
+    const int MAX_DIRECT_LIGHTS = 4;
+
+    // Progress of a program handed to the driver (see USubmitShaderProgram)
+    const int BUILD_PENDING = 0;
+    const int BUILD_READY = 1;
+    const int BUILD_FAILED = 2;
+
+    struct UShaderBuild
+    {
+        GLuint program;
+        GLuint vertexShader, fragmentShader;    // Deleted once the program is finished
+        int status;
+        uint64_t submitted;                     // UProfileClock
+    };
 
-        glfwPollEvents();
-    }
+    struct UShaderFamily
+    {
+        const char* name;
+        const char* vertexSources;      // Names of the shader sources each stage is put together from
+        const char* fragmentSources;
+        std::string vertexSource;
+        std::string fragmentSource;     // Starts with the #version line
+        uint32_t featureMask;           // Features the family's shaders test; the rest are left out of the key
+        uint32_t fixedFeatures;         // Features every variant has
+        std::vector<uint32_t> keys;     // Submitted variants; the first is the fallback
+        std::vector<UShaderBuild> builds;
+    };
 
-    // Release mesh data
-    UDestroyMesh(gMesh);
+    // Per frame values each scene shader variant is given the first time a frame uses it
+    struct UFrameUniforms
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec3 cameraPosition;
+        int width, height;
+        float nearPlane, farPlane;
+        glm::vec3 ambientColor;
+    };
 
-    // Release texture
-    UDestroyTexture(gTissueBoxTextureId);
+    /* Input events. The GLFW callbacks stamp every key, mouse and scroll event and append it to a ring; the
+     * simulation takes the events that fall inside each step, in order, and maps keys to actions through
+     * KEY_BINDINGS. Held actions count how long within the step they were held, and the rest fire once per
+     * press (or key repeat, if the binding wants it).
+     */
+    enum UInputEventType
+    {
+        INPUT_KEY,
+        INPUT_MOUSE_MOVE,
+        INPUT_SCROLL
+    };
 
-    // Release shader programs
-    UDestroyShaderProgram(gCubeProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    struct UInputEvent
+    {
+        double time;                // glfwGetTime when the callback ran
+        UInputEventType type;
+        int key, action;            // INPUT_KEY: GLFW key, and GLFW_PRESS, GLFW_REPEAT or GLFW_RELEASE
+        glm::vec2 offset;           // INPUT_MOUSE_MOVE and INPUT_SCROLL
+    };
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
-}
+    // Written only by the main thread's callbacks and read only by the simulation, so it needs no lock
+    const uint64_t INPUT_RING_SIZE = 1024;
+    struct UInputRing
+    {
+        UInputEvent events[INPUT_RING_SIZE];
+        std::atomic<uint64_t> head;         // Next event to take
+        std::atomic<uint64_t> tail;         // Next slot to fill
+    };
 
+    enum UAction
+    {
+        // Held
+        ACTION_MOVE_FORWARD,
+        ACTION_MOVE_BACKWARD,
+        ACTION_MOVE_LEFT,
+        ACTION_MOVE_RIGHT,
+        // Carried out by the simulation
+        ACTION_ORBIT_LAMPS,
+        ACTION_STOP_LAMPS,
+        // Handed to the main thread in the frame packet
+        ACTION_WRAP_REPEAT,
+        ACTION_WRAP_MIRRORED_REPEAT,
+        ACTION_WRAP_CLAMP_TO_EDGE,
+        ACTION_WRAP_CLAMP_TO_BORDER,
+        ACTION_UV_SCALE_UP,
+        ACTION_UV_SCALE_DOWN,
+        ACTION_FORWARD_RENDERER,
+        ACTION_DEFERRED_RENDERER,
+        ACTION_CYCLE_SHADOW_FILTER,
+        ACTION_WRITE_TRACE,
+        ACTION_TOGGLE_HUD,
+        ACTION_QUIT,
+        ACTION_COUNT
+    };
 
-// Initialize GLFW, GLEW, and create a window
-bool UInitialize(int argc, char* argv[], GLFWwindow** window)
-{
-    // GLFW: initialize and configure
-    // ------------------------------
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
+    struct UKeyBinding
+    {
+        int key;
+        UAction action;
+        bool isRepeating;           // Fires again on key repeat while held
+    };
 
-    // GLFW: window creation
-    // ---------------------
-    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
-    if (*window == NULL)
+    const UKeyBinding KEY_BINDINGS[] =
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
-        glfwTerminate();
-        return false;
-    }
-    glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+        { GLFW_KEY_W, ACTION_MOVE_FORWARD, false },
+        { GLFW_KEY_S, ACTION_MOVE_BACKWARD, false },
+        { GLFW_KEY_A, ACTION_MOVE_LEFT, false },
+        { GLFW_KEY_D, ACTION_MOVE_RIGHT, false },
+        { GLFW_KEY_L, ACTION_ORBIT_LAMPS, false },
+        { GLFW_KEY_K, ACTION_STOP_LAMPS, false },
+        { GLFW_KEY_1, ACTION_WRAP_REPEAT, false },
+        { GLFW_KEY_2, ACTION_WRAP_MIRRORED_REPEAT, false },
+        { GLFW_KEY_3, ACTION_WRAP_CLAMP_TO_EDGE, false },
+        { GLFW_KEY_4, ACTION_WRAP_CLAMP_TO_BORDER, false },
+        { GLFW_KEY_RIGHT_BRACKET, ACTION_UV_SCALE_UP, true },
+        { GLFW_KEY_LEFT_BRACKET, ACTION_UV_SCALE_DOWN, true },
+        { GLFW_KEY_F, ACTION_FORWARD_RENDERER, false },
+        { GLFW_KEY_G, ACTION_DEFERRED_RENDERER, false },
+        { GLFW_KEY_P, ACTION_CYCLE_SHADOW_FILTER, false },
+        { GLFW_KEY_T, ACTION_WRITE_TRACE, false },
+        { GLFW_KEY_H, ACTION_TOGGLE_HUD, false },
+        { GLFW_KEY_ESCAPE, ACTION_QUIT, false }
+    };
+    const int KEY_BINDING_COUNT = int(sizeof(KEY_BINDINGS) / sizeof(KEY_BINDINGS[0]));
+
+    /* Frame pipeline. A simulation thread moves the camera and lights, rebuilds the world matrices, sorts
+     * the lights into clusters and picks each object's level of detail, and writes all of it into a frame
+     * packet. The main thread, which owns the window and the GL context, draws from the packet and nothing
+     * else the simulation touches. Packets are triple buffered (one written, one waiting, one drawn), and
+     * the simulation starts on frame N + 1 as soon as the main thread picks up frame N.
+     */
+    struct UDrawItem
+    {
+        GLuint object;          // Index into the scene's objects
+        GLuint mesh;            // Pool mesh of the level of detail picked for the camera
+        glm::mat4 model;
+    };
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    struct UFramePacket
+    {
+        uint64_t sequence;
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec3 cameraPosition;
+        float nearPlane, farPlane;
+        std::vector<USceneLight> lights;
+        UClusteredLights clusters;      // Only the CPU side lists, uploaded by the main thread
+        std::vector<UDrawItem> draws;
+        uint64_t transformVersion;      // Of the scene's transform store, for the cached shadow casters
+        double inputTime;               // Of the oldest mouse event the frame shows, 0 if none
+        std::vector<UAction> actions;   // For the main thread to carry out, in the order they happened
+    };
 
-    // GLEW: initialize
-    // ----------------
-    // Note: if using GLEW version 1.13 or earlier
-    glewExperimental = GL_TRUE;
-    GLenum GlewInitResult = glewInit();
+    /* Fixed timestep simulation. The simulation thread runs as many SIMULATION_STEP steps as fit the time
+     * that passed, and each frame packet shows the state interpolated between the last two steps, so the
+     * simulation gives the same results at any frame rate.
+     */
+    const double SIMULATION_STEP = 1.0 / 120.0;    // Seconds
+    const int MAX_STEPS_PER_FRAME = 12;
 
-    if (GLEW_OK != GlewInitResult)
+    struct USimulationState
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
-        return false;
-    }
+        uint64_t steps;
+        uint64_t orbitSteps;                // Steps taken with the lamps orbiting; their angle follows from it
+        uint64_t previousOrbitSteps;        // Before the last step, for interpolation
+        glm::vec3 previousCameraPosition;
+        double accumulator;                 // Time passed that no step has simulated yet
+        double lastTime;
+        double simulatedTime;               // glfwGetTime the steps have simulated up to
+        bool isHeld[ACTION_COUNT];
+        double heldSince[ACTION_COUNT];
+    };
 
-    // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    struct UFramePipeline
+    {
+        UFramePacket packets[3];
+        int writing, waiting, drawing;  // Roles of the three packets
+        bool isWaitingFresh;            // The waiting packet hasn't been drawn yet
+        std::mutex mutex;
+        std::condition_variable published;  // Signals the main thread that a packet is waiting
+        std::condition_variable taken;      // Signals the simulation that the main thread took it
+        std::thread thread;
+        bool quit;                          // Guarded by mutex
+    };
 
-    return true;
-}
+    /* Frame pacing. The swap interval picks vsync (1), no vsync (0) or adaptive vsync (-1), which tears
+     * instead of waiting a whole refresh when a frame is late. A fence after every frame lets the main loop
+     * bound how many frames the driver queues, and an optional cap spaces frames out by sleeping.
+     */
+    const int MAX_PENDING_FRAMES = 8;
+    const double FRAME_STATS_PERIOD = 5.0;         // Seconds
 
+    struct UPendingFrame
+    {
+        GLsync fence;
+        double inputTime;
+    };
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
-{
-    static const float cameraSpeed = 2.5f;
+    struct UFramePacing
+    {
+        int swapInterval;
+        int maxFramesInFlight;          // 0 leaves the queue depth to the driver
+        double frameCap;                // Frames per second, 0 for uncapped
+        bool isReporting;               // Prints the statistics below every FRAME_STATS_PERIOD
+        UPendingFrame pending[MAX_PENDING_FRAMES];  // Ring of frames the GPU hasn't finished yet
+        int firstPending, pendingCount;
+        double nextFrameTime;           // When the cap lets the next frame start
+
+        // Statistics of the current period
+        double periodStart, lastPresent;
+        int frames, latencyCount;
+        double intervalSum, intervalSquares, intervalMax;
+        double latencySum, latencyMax;
+    };
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
+    /* Hot reloading. A watcher thread waits on inotify for the shader sources, scene textures and mesh files
+     * to change, and reads and decodes each changed file itself. The main thread swaps the results in between
+     * frames: textures and meshes are re-uploaded in place, and shader families are rebuilt beside the live
+     * ones and replace them once their programs are ready, so a broken edit leaves the old shaders drawing.
+     */
+    const int ASSET_SHADER = 0;
+    const int ASSET_TEXTURE = 1;
+    const int ASSET_MESH = 2;
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+    struct UAssetFile
+    {
+        int kind;
+        size_t index;               // Into SHADER_SOURCES, the scene's textures or the scene's meshes
+        int watch;                  // inotify watch of the file's directory
+        std::string name;           // File name within that directory
+        std::string path;
+    };
 
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+    // A changed file, loaded and ready to be applied
+    struct UAssetReload
     {
-        glBindTexture(GL_TEXTURE_2D, gTissueBoxTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        int kind;
+        size_t index;
+        std::string text;                   // ASSET_SHADER
+        int width, height, channels;        // ASSET_TEXTURE, flipped for GL
+        std::vector<unsigned char> pixels;
+        UMeshData mesh;                     // ASSET_MESH
+    };
 
-        gTexWrapMode = GL_REPEAT;
+    // A shader family being rebuilt from changed sources
+    struct UShaderReplacement
+    {
+        UShaderFamily* family;
+        UShaderFamily replacement;
+    };
 
-        cout << "Current Texture Wrapping Mode: REPEAT" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+    struct UAssetWatcher
     {
-        glBindTexture(GL_TEXTURE_2D, gTissueBoxTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        int inotify;                        // -1 when nothing is watched
+        std::vector<UAssetFile> files;
+        std::thread thread;
+        std::atomic<bool> quit;
+        std::mutex mutex;
+        std::vector<UAssetReload> loaded;   // Guarded by mutex
+        std::vector<UShaderReplacement> shaders;    // Main thread only
+    };
+
+    // Main GLFW window
+    GLFWwindow* gWindow = nullptr;
+    // Triangle mesh data
+    GLMesh gMesh;
+    // Indexed meshes (generated or loaded), referenced by their position in the pool
+    std::vector<GLIndexedMesh> gMeshPool;
+    // GL 4.5 or ARB_direct_state_access: meshes and textures are created with immutable storage, without binding
+    bool gHasDirectStateAccess = false;
+    // Texture whose wrap mode is changed with keys 1-4
+    GLuint gTissueBoxTextureId;
+    USamplerCache gSamplers;
+    glm::vec2 gUVScale(5.0f, 5.0f);
+    GLint gTexWrapMode = GL_REPEAT;
 
-        gTexWrapMode = GL_MIRRORED_REPEAT;
+    // Shader programs
+    bool gHasParallelShaderCompile = false;     // GL_KHR/ARB_parallel_shader_compile: programs can be polled
+    UShaderFamily gCubeShaders;
+    UShaderFamily gLampShaders;
+    UShaderFamily gGBufferShaders;
+    UShaderFamily gDeferredShaders;
+    UShaderFamily gShadowShaders;
+    UShaderFamily gHudShaders;
+    std::string gShaderDirectory;               // --shader-dir: shader sources are read from here, and reloaded
+    std::vector<std::string> gShaderOverrides;  // Text of each SHADER_SOURCES entry read from gShaderDirectory
+
+    // Model matrices, normal matrices and material indices of the drawn objects
+    UDrawRing gDrawRing;
+
+    // Renderer: forward (cube shader) or deferred (G-buffer plus a lighting pass)
+    bool gIsDeferred = false;
+    UGBuffer gGBuffer;
+
+    // Cube shadow map of the first shadow casting light
+    UShadowMap gShadowMap;
+
+    // Baked ambient lighting of the scene objects
+    ULightmap gLightmap;
+    UProbeGrid gProbes;
 
-        cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
-    {
-        glBindTexture(GL_TEXTURE_2D, gTissueBoxTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    // camera
+    Camera gCamera(glm::vec3(1.0f, 1.0f, 8.0f));
+    float gLastX = WINDOW_WIDTH / 2.0f;
+    float gLastY = WINDOW_HEIGHT / 2.0f;
+    bool gFirstMouse = true;
 
-        gTexWrapMode = GL_CLAMP_TO_EDGE;
+    // timing: the simulation thread advances in fixed steps
+    USimulationState gSimulation;
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
-    {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
+    // Cube color
+    //m::vec3 gObjectColor(0.6f, 0.5f, 0.75f);
+    glm::vec3 gObjectColor(1.f, 0.2f, 0.0f);
 
-        glBindTexture(GL_TEXTURE_2D, gTissueBoxTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    // Lamp animation, for the scene lights that orbit. The simulation thread owns it once it starts.
+    bool gIsLampOrbiting = true;
 
-        gTexWrapMode = GL_CLAMP_TO_BORDER;
+    // Per cluster light lists for the cube shader
+    UClusteredLights gClusteredLights;
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
-    }
+    // Scene loaded at startup, unless another one is given with --scene
+    const char* const DEFAULT_SCENE_FILE = "../../resources/scenes/desk.json";
+    UScene gScene;
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
-    {
-        gUVScale += 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
-    {
-        gUVScale -= 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-    }
+    // Worker threads shared by all CPU side jobs and parallel loops
+    UJobSystem gJobs;
+    thread_local UJobThread gJobThread = { 0, -1 };
 
-    // Pause and resume lamp orbiting
-    static bool isLKeyDown = false;
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
-        gIsLampOrbiting = false;
+    // Reloads changed assets while the program runs
+    UAssetWatcher gAssetWatcher;
 
-}
+    // Simulation thread and the frame packets it hands to the main thread
+    UFramePipeline gFramePipeline;
 
+    // Input events on their way from the GLFW callbacks to the simulation
+    UInputRing gInputRing;
 
-// glfw: whenever the window size changed (by OS or user resize) this callback function executes
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
+    // Swap interval, frames in flight and frame rate cap, set from the command line
+    UFramePacing gFramePacing;
 
+    // Transient data of each thread, reset every frame
+    thread_local UFrameArena gThreadArena;
+    std::atomic<int> gArenaThreads(0);
+    bool gIsArenaDebug = false;             // --arena-debug
 
-// glfw: whenever the mouse moves, this callback is called
-// -------------------------------------------------------
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+    // CPU and GPU timings of the last PROFILE_RING_SIZE scopes, and each thread's track
+    UProfiler gProfiler;
+    thread_local int gProfileThread = -1;
+
+    // On-screen timings and counters, and the counters of the frame being rendered
+    UHud gHud;
+    UFrameStats gFrameStats;
+
+    // Bytes of every texture and buffer the renderer created
+    UVideoMemory gVideoMemory;
+}
+/* User-defined Function prototypes to:
+ * initialize the program, set the window size,
+ * redraw graphics on the window when resized,
+ * and render graphics on the screen
+ */
+bool UInitialize(int, char* [], GLFWwindow** window);
+int UAbortStartup();
+void UResizeWindow(GLFWwindow* window, int width, int height);
+void UProcessInput(GLFWwindow* window, const UFramePacket& packet);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void UCreateMesh(GLMesh& mesh);
+void UDestroyMesh(GLMesh& mesh);
+bool UCreateTexture(const char* filename, GLuint& textureId);
+void UDestroyTexture(GLuint textureId);
+void UInitializeSamplers(USamplerCache& cache, float anisotropy);
+GLuint UGetSampler(USamplerCache& cache, const USamplerKey& key);
+USamplerKey UMaterialSamplerKey(const USamplerCache& cache, GLenum wrap);
+void USetTextureWrap(UScene& scene, GLuint textureId, GLenum wrap);
+void UDestroySamplers(USamplerCache& cache);
+void UCreateDrawRing(UDrawRing& ring);
+void UDestroyDrawRing(UDrawRing& ring);
+void URender(const UFramePacket& packet);
+void UDestroyShaderProgram(GLuint programId);
+void UInitializeShaderCompiler();
+void USubmitShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, UShaderBuild& build);
+int UPollShaderProgram(UShaderBuild& build, bool wait);
+void UCreateShaderFamily(UShaderFamily& family, const char* name, const char* vertexSources, const char* fragmentSources, uint32_t featureMask, uint32_t fixedFeatures);
+GLuint UGetShaderVariant(UShaderFamily& family, uint32_t features);
+bool UFinishShaderFallback(UShaderFamily& family);
+void UWarmShaderVariants();
+void UDestroyShaderFamily(UShaderFamily& family);
+
+// Procedural mesh generators. All meshes are centered on the origin and tessellated by the given parameters.
+void UGenerateCylinder(float radius, float height, GLuint slices, GLuint stacks, bool caps, UMeshData& out);
+void UGenerateCapsule(float radius, float height, GLuint slices, GLuint stacks, UMeshData& out);
+void UGenerateSphere(float radius, GLuint slices, GLuint stacks, UMeshData& out);
+void UGenerateTorus(float majorRadius, float minorRadius, GLuint slices, GLuint sides, UMeshData& out);
+void UGenerateRoundedBox(const glm::vec3& halfExtents, float radius, GLuint segments, UMeshData& out);
+bool UGenerateExtrusion(const glm::vec2* profile, GLuint profileCount, float height, bool caps, UMeshData& out);
+GLuint UAddToMeshPool(const UMeshData& data);
+GLuint UCreatePoolMesh();
+void UUpdatePoolMesh(GLuint meshId, const UMeshData& data);
+void UUploadPoolMesh(GLuint meshId, const GLfloat* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+void UComputeBounds(const UMeshData& data, glm::vec3& boundsMin, glm::vec3& boundsMax);
+GLuint USelectLod(const glm::vec3& position);
+GLuint UAddArraysToMeshPool(const GLfloat* vertices, size_t floatCount);
+
+// Mesh importers. Both produce the renderer's interleaved vertex layout.
+bool UMapFile(const char* filename, UMappedFile& file);
+void UUnmapFile(UMappedFile& file);
+bool UParseJson(const char* text, size_t length, UJsonValue& root);
+const UJsonValue* UJsonFind(const UJsonValue& object, const char* key);
+bool UImportObj(const char* filename, UMeshData& out);
+bool UImportGltf(const char* filename, UMeshData& out);
+bool UImportMesh(const char* filename, UMeshData& out);
+void UBenchmarkImport(const char* filename);
+
+// Binary mesh cache, written next to the source file after the first import
+uint64_t UHashBytes(const unsigned char* data, size_t size);
+bool UHashFile(const char* filename, uint64_t& hash);
+bool UStatFile(const char* filename, UFileStamp& stamp);
+bool UWriteMeshCache(const char* filename, const UFileStamp& source, uint64_t contentHash, const UMeshData& data);
+bool UOpenMeshCache(const char* filename, const char* sourceFilename, const UFileStamp& source, UMappedFile& file, const UMeshCacheHeader*& header);
+bool ULoadMesh(const char* filename, GLuint& meshId);
+
+// Scene files: JSON for authoring, compiled to a binary form with --compile-scene
+bool ULoadSceneDesc(const char* filename, USceneDesc& desc);
+bool UParseSceneJson(const UJsonValue& root, USceneDesc& desc);
+bool UWriteSceneBinary(const char* filename, const USceneDesc& desc);
+bool UInstantiateScene(const USceneDesc& desc, const char* sceneFile, UScene& scene);
+void UDestroyScene(UScene& scene);
+GLuint UFindSceneTexture(const UScene& scene, const char* name);
+
+// CPU jobs and the entity transform system
+void UStartWorkers();
+void UStopWorkers();
+void USubmitJob(UJobFunction function, void* context, size_t begin, size_t end, size_t grain, UJobCounter& counter);
+void UWaitForJobs(UJobCounter& counter);
+void URunParallelFor(size_t count, size_t grain, UJobFunction body, void* context);
+template <typename Body> void UParallelFor(size_t count, size_t grain, const Body& body);
+template <typename Body> void USubmitTask(UJobCounter& counter, const Body& body);
+void UBenchmarkJobs(size_t count, unsigned maxThreads);
+GLuint UCreateEntity(UTransformStore& store, GLuint parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void USetEntityTransform(UTransformStore& store, GLuint entity, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale);
+void UUpdateTransforms(UTransformStore& store);
+void UBenchmarkTransforms(size_t count);
+
+// Clustered forward lighting
+void UCreateClusteredLights(UClusteredLights& clustered);
+void UDestroyClusteredLights(UClusteredLights& clustered);
+void UAssignLights(UClusteredLights& clustered, const std::vector<USceneLight>& lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane);
+void UUploadClusteredLights(UClusteredLights& clustered, const UClusteredLights& assigned);
+void UBenchmarkLights(size_t count);
+
+// Deferred renderer
+bool UCreateGBuffer(UGBuffer& gbuffer, int width, int height);
+void UDestroyGBuffer(UGBuffer& gbuffer);
+void UBenchmarkRenderers();
+
+// Point light shadows
+void UCreateShadowMap(UShadowMap& shadow);
+void UDestroyShadowMap(UShadowMap& shadow);
+void UUpdateShadowMap(UShadowMap& shadow, const UScene& scene, const UFramePacket& packet);
+void USetShadowUniforms(GLuint programId, const UShadowMap& shadow);
+
+// Lightmap baking
+bool UPrepareLightmap(UScene& scene, const char* sceneFile, ULightmap& lightmap, int bakeSamples);
+void UBuildBvh(const std::vector<UBakeTriangle>& triangles, std::vector<GLuint>& order, std::vector<UBvhNode>& nodes);
+bool UTraceRay(const ULightmap& lightmap, const glm::vec3& origin, const glm::vec3& direction, GLuint& triangle, float& distance);
+void UStartLightmapBake(ULightmap& lightmap, int samples);
+void UUpdateLightmap(ULightmap& lightmap);
+void UDestroyLightmap(ULightmap& lightmap);
+
+// Irradiance probes
+bool UBakeProbes(const ULightmap& scene, UProbeGrid& probes);
+void USetProbeUniforms(GLuint programId, const UProbeGrid& probes);
+void UDestroyProbes(UProbeGrid& probes);
+
+// Simulation thread and frame packets
+void UStartFramePipeline(UFramePipeline& pipeline);
+void UStepSimulation(USimulationState& state, UFramePacket& packet);
+void USimulate(UFramePacket& packet, double deltaTime);
+const UFramePacket& UAcquireFramePacket(UFramePipeline& pipeline);
+void UStopFramePipeline(UFramePipeline& pipeline);
+
+// Frame pacing and latency statistics
+void UInitializeFramePacing(UFramePacing& pacing);
+void UBeginFrame(UFramePacing& pacing);
+void UEndFrame(UFramePacing& pacing, double inputTime);
+void UDestroyFramePacing(UFramePacing& pacing);
+
+// Hot reloading of changed shader sources, textures and meshes
+bool ULoadShaderOverrides(const char* directory);
+void UStartAssetWatcher(UAssetWatcher& watcher, const UScene& scene);
+void UApplyAssetReloads(UAssetWatcher& watcher, UScene& scene);
+void UStopAssetWatcher(UAssetWatcher& watcher);
+
+// Frame arenas
+UFrameArena& UThreadArena();
+void* UArenaAllocate(UFrameArena& arena, size_t bytes, size_t alignment);
+void UResetFrameArena(UFrameArena& arena);
+UArenaMark UGetArenaMark(const UFrameArena& arena);
+void URewindArena(UFrameArena& arena, const UArenaMark& mark);
+void UCheckArenaUse(const UFrameArena& arena, uint64_t frame);
+
+// Profiler
+uint64_t UProfileClock();
+void UInitializeProfiler(UProfiler& profiler);
+void UInitializeGpuProfiler(UProfiler& profiler);
+int UProfileThread();
+void UNameProfileThread(UProfiler& profiler, const char* name);
+void URecordProfileEvent(UProfiler& profiler, const char* name, uint64_t start, uint64_t end, int track);
+int UBeginGpuProfileSpan(UProfiler& profiler, const char* name);
+void UEndGpuProfileSpan(UProfiler& profiler, int span);
+void UCollectGpuProfile(UProfiler& profiler);
+bool UWriteTrace(const UProfiler& profiler, const char* filename);
+void UDestroyProfiler(UProfiler& profiler);
+
+// Video memory accounting
+GLsizeiptr UMipmappedBytes(GLsizei width, GLsizei height, GLsizeiptr texelBytes);
+void UTrackTexture(GLuint texture, int category, GLsizeiptr bytes);
+void UTrackBuffer(GLuint buffer, int category, GLsizeiptr bytes);
+void UDeleteTextures(GLsizei count, const GLuint* textures);
+void UDeleteBuffers(GLsizei count, const GLuint* buffers);
+
+// Performance HUD
+void UCreateHud(UHud& hud);
+void USetHudVisible(UHud& hud, bool isVisible);
+void UBeginHudFrame(UHud& hud);
+void UDrawHud(UHud& hud, const UFrameStats& stats);
+void UDestroyHud(UHud& hud);
+
+
+/* Standard allocator over a frame arena, for containers that only live through the current frame.
+ * Freeing does nothing; the memory comes back when the arena is reset or rewound.
+ */
+template <typename T>
+struct UArenaAllocator
 {
-    if (gFirstMouse)
+    typedef T value_type;
+
+    explicit UArenaAllocator(UFrameArena& arena) : arena(&arena), frame(arena.frame) {}
+    template <typename U> UArenaAllocator(const UArenaAllocator<U>& other) : arena(other.arena), frame(other.frame) {}
+
+    T* allocate(size_t count)
     {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
+        UCheckArenaUse(*arena, frame);
+        return static_cast<T*>(UArenaAllocate(*arena, count * sizeof(T), alignof(T)));
     }
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+    void deallocate(T*, size_t)
+    {
+        UCheckArenaUse(*arena, frame);
+    }
 
-    gLastX = xpos;
-    gLastY = ypos;
+    UFrameArena* arena;
+    uint64_t frame;         // Frame of the arena the allocator was made in
+};
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
-}
+template <typename T, typename U>
+bool operator==(const UArenaAllocator<T>& a, const UArenaAllocator<U>& b) { return a.arena == b.arena; }
+template <typename T, typename U>
+bool operator!=(const UArenaAllocator<T>& a, const UArenaAllocator<U>& b) { return a.arena != b.arena; }
 
+template <typename T>
+using UArenaVector = std::vector<T, UArenaAllocator<T> >;
 
-// glfw: whenever the mouse scroll wheel scrolls, this callback is called
-// ----------------------------------------------------------------------
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+// Rewinds an arena to where it was when the scope began, e.g. around the scratch space of a job
+struct UArenaScope
 {
-    gCamera.ProcessMouseScroll(yoffset);
-}
+    explicit UArenaScope(UFrameArena& arena) : arena(arena), mark(UGetArenaMark(arena)) {}
+    ~UArenaScope() { URewindArena(arena, mark); }
 
-// glfw: handle mouse button events
-// --------------------------------
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+    UFrameArena& arena;
+    UArenaMark mark;
+};
+
+#if __cplusplus >= 201703L
+// The same for std::pmr containers: std::pmr::vector<T> v(&resource)
+class UArenaResource : public std::pmr::memory_resource
 {
-    switch (button)
-    {
-    case GLFW_MOUSE_BUTTON_LEFT:
+public:
+    explicit UArenaResource(UFrameArena& arena) : arena(arena), frame(arena.frame) {}
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override
     {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
+        UCheckArenaUse(arena, frame);
+        return UArenaAllocate(arena, bytes, alignment);
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
+    void do_deallocate(void*, size_t, size_t) override
     {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
+        UCheckArenaUse(arena, frame);
     }
-    break;
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
+        return this == &other;
     }
-    break;
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
-}
+    UFrameArena& arena;
+    uint64_t frame;
+};
+#endif
 
 
-// Functioned called to render a frame
-void URender()
+/* Profiler scopes. UPROFILE_SCOPE("name") times the rest of the enclosing block on the calling thread's
+ * track. UPROFILE_GPU_SCOPE("name") also times the GL commands issued in the block, so it can only be used
+ * on the main thread. Names must be string literals, since only the pointer is kept. Building with
+ * UPROFILE_DISABLED defined compiles the scopes out.
+ */
+struct UProfileScope
 {
-    // Lamp orbits around the origin
-    const float angularVelocity = glm::radians(45.0f);
-    if (gIsLampOrbiting)
-    {
-        glm::vec4 newPosition = glm::rotate(angularVelocity * gDeltaTime, glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(gLightPosition, 1.0f);
-        gLightPosition.x = newPosition.x;
-        gLightPosition.y = newPosition.y;
-        gLightPosition.z = newPosition.z;
-    }
+    explicit UProfileScope(const char* name) : name(name), start(UProfileClock()) {}
+    ~UProfileScope() { URecordProfileEvent(gProfiler, name, start, UProfileClock(), UProfileThread()); }
 
-    // Enable z-depth
-    glEnable(GL_DEPTH_TEST);
+    const char* name;
+    uint64_t start;
+};
 
-    // Clear the frame and z buffers
-    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+struct UGpuProfileScope
+{
+    explicit UGpuProfileScope(const char* name) : cpu(name), span(UBeginGpuProfileSpan(gProfiler, name)) {}
+    ~UGpuProfileScope() { UEndGpuProfileSpan(gProfiler, span); }
+
+    UProfileScope cpu;
+    int span;               // -1 without timer queries, or with every span in use
+};
+
+#define UPROFILE_JOIN_(a, b) a##b
+#define UPROFILE_JOIN(a, b) UPROFILE_JOIN_(a, b)
+#ifndef UPROFILE_DISABLED
+#define UPROFILE_SCOPE(name) UProfileScope UPROFILE_JOIN(profileScope, __LINE__)(name)
+#define UPROFILE_GPU_SCOPE(name) UGpuProfileScope UPROFILE_JOIN(gpuProfileScope, __LINE__)(name)
+#else
+#define UPROFILE_SCOPE(name)
+#define UPROFILE_GPU_SCOPE(name)
+#endif
 
-    // Activate the cube VAO (used by cube and lamp)
-    glBindVertexArray(gMesh.tissueBoxVAO);
 
-    // CUBE: draw cube
-    //----------------
-    // Set the shader to be used
-    glUseProgram(gCubeProgramId);
+/* Cube Vertex Shader Source Code*/
+const GLchar* cubeVertexShaderSource = GLSL(440,
 
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = glm::translate(gCubePosition) * glm::scale(gCubeScale) * glm::rotate(15.0f, glm::vec3(0.0f, 1.0f, 0.0f));
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+    layout(location = 1) in vec3 normal; // VAP position 1 for normals
+    layout(location = 2) in vec2 textureCoordinate;
+    layout(location = 3) in vec2 lightmapCoordinate; // Only baked object meshes have it
+    layout(location = 4) in uint drawIndex; // Per instance: the draw's record in DrawBuffer (see UDrawRing)
 
-    // camera/view transformation
-    glm::mat4 view = gCamera.GetViewMatrix();
+    out vec3 vertexNormal; // For outgoing normals to fragment shader
+    out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+    out vec2 vertexTextureCoordinate;
+    out vec2 vertexLightmapCoordinate;
+    flat out uint vertexMaterialIndex;
 
-    // Creates a perspective projection
-    glm::mat4 projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gCubeProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gCubeProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gCubeProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Cube Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gCubeProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gCubeProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gCubeProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gCubeProgramId, "viewPosition");
-
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    GLint UVScaleLoc = glGetUniformLocation(gCubeProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-    // bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTissueBoxTextureId);
+    // Per draw transforms and material, written by the CPU into a persistently mapped buffer
+    struct DrawData
+    {
+        mat4 model;
+        mat3 normalMatrix;
+        uint material;
+    };
+    layout(std430, binding = 4) readonly buffer DrawBuffer { DrawData draws[]; };
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueBoxVertices);
+    //Uniform / Global variables for the  transform matrices
+    uniform mat4 view;
+    uniform mat4 projection;
 
+void main()
+{
+    mat4 model = draws[drawIndex].model;
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
 
-    // LAMP: draw lamp
-    //----------------
-    glUseProgram(gLampProgramId);
+    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
 
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
+    vertexNormal = draws[drawIndex].normalMatrix * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexTextureCoordinate = textureCoordinate;
+    vertexLightmapCoordinate = lightmapCoordinate;
+    vertexMaterialIndex = draws[drawIndex].material;
+}
+);
 
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
 
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+/* Clustered lighting, shared by the forward cube shader and the deferred lighting pass. The fragment
+ * shader bodies below are appended to it.
+ */
+const GLchar* clusteredLightingSource = GLSL(440,
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueBoxVertices);
+// Scene lights and the per cluster lists of the lights reaching each cluster (see UAssignLights)
+struct PointLight
+{
+    vec4 positionRadius; // World position, and range (0 for an unbounded light)
+    vec4 color;
+};
+layout(std430, binding = 0) readonly buffer LightBuffer { PointLight lights[]; };
+layout(std430, binding = 1) readonly buffer ClusterBuffer { uvec2 clusters[]; }; // Offset and count into lightIndices
+layout(std430, binding = 2) readonly buffer LightIndexBuffer { uint lightIndices[]; };
 
-    // Deactivate the Vertex Array Object and shader program
-    glBindVertexArray(0);
-    glUseProgram(0);
+uniform vec3 viewPosition;
+uniform mat4 view;
+uniform uvec3 clusterCount;
+uniform vec2 clusterTileScale; // Clusters per pixel
+uniform vec2 clusterDepthScale; // Maps log(view depth) to a depth slice
+
+// Cube shadow map of one light (see UUpdateShadowMap), storing the distance to the light over shadowFar
+uniform samplerCubeShadow shadowMap;
+uniform int shadowLight; // Index of the shadowed light, -1 for none
+uniform vec3 shadowPosition; // Light position the shadow map was rendered from
+uniform float shadowFar;
+uniform int shadowSamples; // 1, 8 or 20
+
+const vec3 shadowOffsets[20] = vec3[](
+    vec3(1, 1, 1), vec3(1, -1, 1), vec3(-1, -1, 1), vec3(-1, 1, 1),
+    vec3(1, 1, -1), vec3(1, -1, -1), vec3(-1, -1, -1), vec3(-1, 1, -1),
+    vec3(1, 1, 0), vec3(1, -1, 0), vec3(-1, -1, 0), vec3(-1, 1, 0),
+    vec3(1, 0, 1), vec3(-1, 0, 1), vec3(1, 0, -1), vec3(-1, 0, -1),
+    vec3(0, 1, 1), vec3(0, -1, 1), vec3(0, -1, -1), vec3(0, 1, -1));
+
+// Fraction of the shadowed light reaching a point, percentage closer filtered
+float shadowFactor(vec3 position, vec3 norm)
+{
+    // Offsetting along the normal keeps lit surfaces from shadowing themselves
+    vec3 toPoint = position + norm * 0.02 - shadowPosition;
+    float reference = length(toPoint) / shadowFar - 0.0005;
+    if (shadowSamples <= 1)
+        return texture(shadowMap, vec4(toPoint, reference));
+
+    // Each tap is about a texel and a half apart at any distance
+    float spread = length(toPoint) * 0.0025;
+    float lit = 0.0;
+    for (int i = 0; i < shadowSamples; ++i)
+        lit += texture(shadowMap, vec4(toPoint + shadowOffsets[i] * spread, reference));
+    return lit / float(shadowSamples);
+}
 
+// Sums the diffuse and specular light reaching a surface point from the lights of its cluster, or from every
+// light when the variant has DIRECT_LIGHTS of them
+void shadeClusteredLights(vec3 position, vec3 norm, float specularIntensity, float highlightSize, out vec3 diffuse, out vec3 specular)
+{
+    uvec2 cluster = uvec2(0u, uint(DIRECT_LIGHTS));
+    if (DIRECT_LIGHTS == 0)
+    {
+        // Find the cluster this fragment falls in
+        float depth = -(view * vec4(position, 1.0)).z;
+        uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterTileScale), clusterCount.xy - 1u);
+        uint slice = uint(clamp(log(depth) * clusterDepthScale.x + clusterDepthScale.y, 0.0, float(clusterCount.z - 1u)));
+        cluster = clusters[(slice * clusterCount.y + tile.y) * clusterCount.x + tile.x];
+    }
 
-    /* Draw Plane */
-    glBindVertexArray(gMesh.planeVAO);
-    glUseProgram(gCubeProgramId);
+    vec3 viewDir = normalize(viewPosition - position); // Calculate view direction
+    diffuse = vec3(0.0);
+    specular = vec3(0.0);
+    for (uint i = 0u; i < cluster.y; ++i)
+    {
+        uint index = DIRECT_LIGHTS == 0 ? lightIndices[cluster.x + i] : i;
+        PointLight light = lights[index];
+        vec3 toLight = light.positionRadius.xyz - position;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gPlaneTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.planeVertices);
-    glBindVertexArray(0);
-    glUseProgram(0);
+        // Bounded lights fade out smoothly at their radius
+        float attenuation = 1.0;
+        if (light.positionRadius.w > 0.0)
+        {
+            float falloff = clamp(1.0 - dot(toLight, toLight) / (light.positionRadius.w * light.positionRadius.w), 0.0, 1.0);
+            attenuation = falloff * falloff;
+        }
+        if (FEATURE_SHADOWED == 1 && int(index) == shadowLight)
+            attenuation *= shadowFactor(position, norm);
 
-    /* Draw Tissue */
-    glBindVertexArray(gMesh.tissueVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gTissuePosition) * glm::scale(gTissueScale) * glm::rotate(15.0f, glm::vec3(0.0f, 1.0f, 0.0f));
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    
+        //Calculate Diffuse lighting*/
+        vec3 lightDirection = normalize(toLight); // Calculate distance (light direction) between light source and fragments/pixels on cube
+        float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+        diffuse += impact * attenuation * light.color.rgb; // Generate diffuse light color
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTissueTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueVertices);
+        //Calculate Specular lighting*/
+        if (FEATURE_SPECULAR == 1)
+        {
+            vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+            float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+            specular += specularIntensity * specularComponent * attenuation * light.color.rgb;
+        }
+    }
+}
+);
 
-    /* Draw Glass */
-    glBindVertexArray(gMesh.tissueBoxVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gGlassPosition) * glm::scale(gGlassScale);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
+/* Irradiance probe grid (see UBakeProbes), shared by the forward cube shader and the G-buffer pass. Also
+ * picks a surface's ambient light from the variant's features.
+ */
+const GLchar* probeLightingSource = GLSL_CHUNK(
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gGlassTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueBoxVertices);
+uniform sampler3D uProbes; // PROBE_SLABS slabs of coefficients stacked along z
+uniform vec3 probeOrigin;
+uniform vec3 probeSpacing;
+uniform ivec3 probeCounts;
 
-    /* Draw Glass Top */
-    glBindVertexArray(gMesh.tissueBoxVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gGlassTopPosition) * glm::scale(gGlassTopScale);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+// Irradiance (over pi) arriving at a surface, blended between the eight surrounding probes
+vec3 probeIrradiance(vec3 position, vec3 norm)
+{
+    vec3 counts = vec3(probeCounts);
+    vec3 texel = clamp((position - probeOrigin) / probeSpacing + 0.5, vec3(0.5), counts - 0.5);
+    float c[28];
+    for (int slab = 0; slab < 7; ++slab)
+    {
+        vec4 v = texture(uProbes, vec3(texel.xy / counts.xy, (texel.z + float(slab) * counts.z) / (7.0 * counts.z)));
+        c[slab * 4] = v.x;
+        c[slab * 4 + 1] = v.y;
+        c[slab * 4 + 2] = v.z;
+        c[slab * 4 + 3] = v.w;
+    }
+    vec3 sh[9];
+    for (int i = 0; i < 9; ++i)
+        sh[i] = vec3(c[i * 3], c[i * 3 + 1], c[i * 3 + 2]);
+
+    // Surfaces without a usable normal (zero or NaN) get the average light around the probe
+    if (!(dot(norm, norm) > 0.5))
+        return max(vec3(0.0), sh[0] * 0.282095);
+    return max(vec3(0.0), sh[0] * 0.282095
+        + (sh[1] * norm.y + sh[2] * norm.z + sh[3] * norm.x) * 0.488603
+        + (sh[4] * (norm.x * norm.y) + sh[5] * (norm.y * norm.z) + sh[7] * (norm.x * norm.z)) * 1.092548
+        + sh[6] * (0.315392 * (3.0 * norm.z * norm.z - 1.0))
+        + sh[8] * (0.546274 * (norm.x * norm.x - norm.y * norm.y)));
+}
 
+uniform sampler2D uLightmap; // Baked ambient occlusion and bounced ambient light
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gGlassTopTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueBoxVertices);
+// Ambient light reaching a surface, as a factor of the scene's ambient color
+vec3 bakedAmbient(vec3 position, vec3 norm, vec2 lightmapCoordinate)
+{
+    if (FEATURE_LIGHTMAPPED == 1)
+        return texture(uLightmap, lightmapCoordinate).rgb;
+    if (FEATURE_PROBES == 1)
+        return probeIrradiance(position, norm);
+    return vec3(1.0);
+}
+);
 
-    /* Draw Wrist Pad */
-    glBindVertexArray(gMesh.wristPadVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gWristPadPosition) * glm::scale(gWristPadScale);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
 
+/* Cube Fragment Shader Source Code, appended to clusteredLightingSource and probeLightingSource*/
+const GLchar* cubeFragmentShaderSource = GLSL_CHUNK(
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gWristPadTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.wristPadVertices);
+    in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+in vec2 vertexTextureCoordinate;
+in vec2 vertexLightmapCoordinate;
 
-    /* Draw Charger Brick */
-    glBindVertexArray(gMesh.tissueBoxVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gChargerBrickPosition) * glm::scale(gChargerBrickScale);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    //model = glm::rotate(15.0f, glm::vec3(1.0f, 0.0f, 0.0f));
+out vec4 fragmentColor; // For outgoing cube color to the GPU
 
+// Uniform / Global variables for object color, ambient light and material
+uniform vec3 objectColor; // Color of untextured materials
+uniform vec3 ambientColor; // Ambient strength from the scene file times the color of the unbounded lights
+uniform float specularIntensity;
+uniform float highlightSize;
+uniform sampler2D uTexture; // Material texture, on unit 0
+uniform vec2 uvScale;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gChargerBrickTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.tissueBoxVertices);
+void main()
+{
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
 
-    /* Draw Charger Prong One */
-    glBindVertexArray(gMesh.chargerProngVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gChargerProng1Position) * glm::scale(gChargerProng1Scale);
-    
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    //Calculate Ambient lighting, shaped by the lightmap when the object has one and by the probes otherwise*/
+    vec3 norm = normalize(vertexNormal);
+    vec3 ambient = ambientColor * bakedAmbient(vertexFragmentPos, norm, vertexLightmapCoordinate);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gChargerProngTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.chargerProngVertices);
+    //Calculate Diffuse and Specular lighting from every light of this cluster*/
+    vec3 diffuse;
+    vec3 specular;
+    shadeClusteredLights(vertexFragmentPos, norm, specularIntensity, highlightSize, diffuse, specular);
 
-    /* Draw Charger Prong Two */
-    glBindVertexArray(gMesh.chargerProngVAO);
-    glUseProgram(gCubeProgramId);
-    model = glm::translate(gChargerProng2Position) * glm::scale(gChargerProng2Scale);
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+    // Texture holds the color to be used for all three components
+    vec3 color = FEATURE_TEXTURED == 1 ? texture(uTexture, vertexTextureCoordinate * uvScale).rgb : objectColor;
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gChargerProngTextureId);
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.chargerProngVertices);
+    // Calculate phong result
+    vec3 phong = (ambient + diffuse + specular) * color;
 
-    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
 }
+);
 
 
-// Implements the UCreateMesh function
-void UCreateMesh(GLMesh& mesh)
+/* G-buffer Fragment Shader Source Code, used with the cube vertex shader and appended to probeLightingSource*/
+const GLchar* gBufferFragmentShaderSource = GLSL_CHUNK(
+
+    in vec3 vertexNormal;
+in vec3 vertexFragmentPos;
+in vec2 vertexTextureCoordinate;
+in vec2 vertexLightmapCoordinate;
+
+layout(location = 0) out vec4 gAlbedo; // Texture color, material index / 255
+layout(location = 1) out vec2 gNormal; // Octahedral encoded normal
+layout(location = 2) out vec3 gAmbient; // Baked ambient lighting
+
+uniform sampler2D uTexture;
+uniform vec3 objectColor;
+uniform vec2 uvScale;
+flat in uint vertexMaterialIndex;
+
+// Folds the lower hemisphere of the octahedron over the upper one
+vec2 octahedronWrap(vec2 v)
 {
+    return (1.0 - abs(v.yx)) * vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+void main()
+{
+    vec3 norm = normalize(vertexNormal);
+    gAmbient = bakedAmbient(vertexFragmentPos, norm, vertexLightmapCoordinate);
+
+    norm /= abs(norm.x) + abs(norm.y) + abs(norm.z);
+    gNormal = norm.z >= 0.0 ? norm.xy : octahedronWrap(norm.xy);
+    vec3 color = FEATURE_TEXTURED == 1 ? texture(uTexture, vertexTextureCoordinate * uvScale).rgb : objectColor;
+    gAlbedo = vec4(color, float(min(vertexMaterialIndex, 255u)) / 255.0); // 8 bits in the G-buffer
+}
+);
+
+
+/* Shadow map Shader Source Code: writes the distance to the light into a cube map face*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position;
+
+out vec3 vertexFragmentPos;
+
+uniform mat4 model;
+uniform mat4 faceViewProjection;
+
+void main()
+{
+    vertexFragmentPos = vec3(model * vec4(position, 1.0f));
+    gl_Position = faceViewProjection * vec4(vertexFragmentPos, 1.0f);
+}
+);
+
+
+const GLchar* shadowFragmentShaderSource = GLSL(440,
+
+    in vec3 vertexFragmentPos;
+
+uniform vec3 lightPosition;
+uniform float shadowFar;
+
+void main()
+{
+    gl_FragDepth = length(vertexFragmentPos - lightPosition) / shadowFar;
+}
+);
+
+
+/* Deferred lighting: a full screen triangle that shades every covered pixel from the G-buffer*/
+const GLchar* deferredVertexShaderSource = GLSL(440,
+
+void main()
+{
+    vec2 corner = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
+);
+
+
+/* Deferred Lighting Fragment Shader Source Code, appended to clusteredLightingSource*/
+const GLchar* deferredLightingShaderSource = GLSL_CHUNK(
+
+    out vec4 fragmentColor;
+
+layout(std430, binding = 3) readonly buffer MaterialBuffer { vec2 materials[]; }; // Specular intensity, highlight size
+
+uniform sampler2D gAlbedo;
+uniform sampler2D gNormal;
+uniform sampler2D gDepth;
+uniform sampler2D gAmbient;
+uniform mat4 inverseViewProjection;
+uniform vec3 ambientColor;
+
+vec3 octahedronDecode(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = clamp(-n.z, 0.0, 1.0);
+    n.x += n.x >= 0.0 ? -t : t;
+    n.y += n.y >= 0.0 ? -t : t;
+    return normalize(n);
+}
+
+void main()
+{
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gDepth, pixel, 0).r;
+    if (depth == 1.0)
+        discard; // Background
+
+    // Rebuild the world position from the depth
+    vec2 uv = gl_FragCoord.xy / vec2(textureSize(gDepth, 0));
+    vec4 world = inverseViewProjection * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    vec3 position = world.xyz / world.w;
+
+    vec4 albedo = texelFetch(gAlbedo, pixel, 0);
+    vec2 material = materials[uint(albedo.a * 255.0 + 0.5)];
+
+    vec3 diffuse;
+    vec3 specular;
+    shadeClusteredLights(position, octahedronDecode(texelFetch(gNormal, pixel, 0).xy), material.x, material.y, diffuse, specular);
+    vec3 ambient = ambientColor * texelFetch(gAmbient, pixel, 0).rgb;
+    fragmentColor = vec4((ambient + diffuse + specular) * albedo.rgb, 1.0);
+
+    // Later forward passes (the lamps) depth test against the scene
+    gl_FragDepth = depth;
+}
+);
+
+
+/* Lamp Shader Source Code*/
+const GLchar* lampVertexShaderSource = GLSL(440,
+
+    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+        //Uniform / Global variables for the  transform matrices
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+}
+);
+
+
+/* Fragment Shader Source Code*/
+const GLchar* lampFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
+
+void main()
+{
+    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
+}
+);
+
+
+/* HUD Vertex Shader Source Code. Every instance is one quad of the overlay, placed in window pixels from
+ * the top left; its corners come from gl_VertexID as a triangle strip.
+ */
+const GLchar* hudVertexShaderSource = GLSL(440,
+
+layout(location = 0) in vec4 rect;      // Left, top, width and height in pixels
+layout(location = 1) in uint glyph;     // Font atlas cell
+layout(location = 2) in vec4 color;
+
+out vec2 glyphPosition;                 // Font pixels from the cell's top left
+flat out uint glyphCell;
+out vec4 quadColor;
+
+uniform vec2 viewportSize;
+uniform vec2 glyphSize;                 // Font pixels per atlas cell
+
+void main()
+{
+    vec2 corner = vec2(float(gl_VertexID & 1), float(gl_VertexID >> 1));
+    vec2 pixel = rect.xy + corner * rect.zw;
+    gl_Position = vec4(pixel.x / viewportSize.x * 2.0 - 1.0, 1.0 - pixel.y / viewportSize.y * 2.0, 0.0, 1.0);
+    glyphPosition = corner * glyphSize;
+    glyphCell = glyph;
+    quadColor = color;
+}
+);
+
+
+/* HUD Fragment Shader Source Code*/
+const GLchar* hudFragmentShaderSource = GLSL(440,
+
+in vec2 glyphPosition;
+flat in uint glyphCell;
+in vec4 quadColor;
+
+out vec4 fragmentColor;
+
+uniform sampler2D fontAtlas;            // One byte per font pixel, the cells side by side
+uniform vec2 glyphSize;
+
+void main()
+{
+    ivec2 texel = ivec2(min(glyphPosition, glyphSize - 1.0));
+    float coverage = texelFetch(fontAtlas, ivec2(int(glyphCell) * int(glyphSize.x) + texel.x, texel.y), 0).r;
+    fragmentColor = vec4(quadColor.rgb, quadColor.a * coverage);
+}
+);
+
+
+/* Every shader source by name. Programs are put together from lists of these names, and with --shader-dir a
+ * file called NAME.glsl in that directory takes the place of the built-in string (see ULoadShaderOverrides).
+ */
+struct UShaderSourceEntry
+{
+    const char* name;
+    const GLchar* source;
+};
+const UShaderSourceEntry SHADER_SOURCES[] =
+{
+    { "glslVersion", GLSL_VERSION(440) },
+    { "cubeVertexShaderSource", cubeVertexShaderSource },
+    { "clusteredLightingSource", clusteredLightingSource },
+    { "probeLightingSource", probeLightingSource },
+    { "cubeFragmentShaderSource", cubeFragmentShaderSource },
+    { "gBufferFragmentShaderSource", gBufferFragmentShaderSource },
+    { "shadowVertexShaderSource", shadowVertexShaderSource },
+    { "shadowFragmentShaderSource", shadowFragmentShaderSource },
+    { "deferredVertexShaderSource", deferredVertexShaderSource },
+    { "deferredLightingShaderSource", deferredLightingShaderSource },
+    { "lampVertexShaderSource", lampVertexShaderSource },
+    { "lampFragmentShaderSource", lampFragmentShaderSource },
+    { "hudVertexShaderSource", hudVertexShaderSource },
+    { "hudFragmentShaderSource", hudFragmentShaderSource },
+};
+const size_t SHADER_SOURCE_COUNT = sizeof(SHADER_SOURCES) / sizeof(SHADER_SOURCES[0]);
+
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
+    {
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    UInitializeProfiler(gProfiler);
+
+    // Import benchmark: parse a mesh file repeatedly and report the throughput, without opening a window
+    if (argc == 3 && strcmp(argv[1], "--bench-import") == 0)
+    {
+        UBenchmarkImport(argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    // Light assignment benchmark: cull 'count' lights into the cluster grid
+    if (argc == 3 && strcmp(argv[1], "--bench-lights") == 0)
+    {
+        UStartWorkers();
+        UBenchmarkLights(size_t(atol(argv[2])));
+        UStopWorkers();
+        return EXIT_SUCCESS;
+    }
+
+    // Transform system benchmark: rebuild 'count' world matrices per frame
+    if (argc == 3 && strcmp(argv[1], "--bench-transforms") == 0)
+    {
+        UStartWorkers();
+        UBenchmarkTransforms(size_t(atol(argv[2])));
+        UStopWorkers();
+        return EXIT_SUCCESS;
+    }
+
+    // Job system benchmark: scheduling overhead over 'count' jobs, and scaling up to the given thread count
+    if ((argc == 3 || argc == 4) && strcmp(argv[1], "--bench-jobs") == 0)
+    {
+        UBenchmarkJobs(size_t(atol(argv[2])), argc == 4 ? unsigned(atoi(argv[3])) : std::max(1u, std::thread::hardware_concurrency()));
+        return EXIT_SUCCESS;
+    }
+
+    // Scene compiler: convert an authored JSON scene to the binary form
+    if (argc == 4 && strcmp(argv[1], "--compile-scene") == 0)
+    {
+        USceneDesc desc;
+        return ULoadSceneDesc(argv[2], desc) && UWriteSceneBinary(argv[3], desc) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Read the scene description before opening the window, so a bad file fails fast
+    const char* sceneFile = DEFAULT_SCENE_FILE;
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "--scene") == 0)
+            sceneFile = argv[i + 1];
+    }
+    USceneDesc sceneDesc;
+    if (!ULoadSceneDesc(sceneFile, sceneDesc))
+        return EXIT_FAILURE;
+
+    // --arena-debug: poison released frame arena memory, catch containers that outlive their frame, report peaks
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--arena-debug") == 0)
+            gIsArenaDebug = true;
+    }
+
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+
+    // T writes the profiler's trace; --trace FILE names the file and writes it at exit as well
+    UInitializeGpuProfiler(gProfiler);
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "--trace") == 0)
+        {
+            gProfiler.traceFile = argv[i + 1];
+            gProfiler.isTracingAtExit = true;
+        }
+    }
+
+    UStartWorkers();
+
+    // Pool meshes read their per draw data from the ring, so it comes first
+    UCreateDrawRing(gDrawRing);
+
+    // Create the mesh
+    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+
+    /* Create the shader programs. Everything is handed to the driver before anything is waited on, so
+     * with parallel shader compilation the programs build on the driver's threads while the scene loads.
+     * The scene shader variants draw with their family's fallback until they are ready.
+     */
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        // --shader-dir DIR: the shader sources are read from DIR, and reloaded whenever they change there
+        if (strcmp(argv[i], "--shader-dir") == 0)
+            gShaderDirectory = argv[i + 1];
+    }
+    if (!gShaderDirectory.empty() && !ULoadShaderOverrides(gShaderDirectory.c_str()))
+        return UAbortStartup();
+    UInitializeShaderCompiler();
+    UCreateShaderFamily(gShadowShaders, "shadow", "shadowVertexShaderSource", "shadowFragmentShaderSource", 0, 0);
+    UCreateShaderFamily(gLampShaders, "lamp", "lampVertexShaderSource", "lampFragmentShaderSource", 0, 0);
+    UCreateShaderFamily(gHudShaders, "HUD", "hudVertexShaderSource", "hudFragmentShaderSource", 0, 0);
+    UCreateShaderFamily(gCubeShaders, "cube", "cubeVertexShaderSource",
+        "clusteredLightingSource probeLightingSource cubeFragmentShaderSource",
+        SHADER_TEXTURED | SHADER_SPECULAR | SHADER_SHADOWED | SHADER_LIGHTMAPPED | SHADER_PROBES | SHADER_DIRECT_LIGHTS, 0);
+    UCreateShaderFamily(gGBufferShaders, "G-buffer", "cubeVertexShaderSource",
+        "glslVersion probeLightingSource gBufferFragmentShaderSource",
+        SHADER_TEXTURED | SHADER_LIGHTMAPPED | SHADER_PROBES, 0);
+    UCreateShaderFamily(gDeferredShaders, "deferred lighting", "deferredVertexShaderSource",
+        "clusteredLightingSource deferredLightingShaderSource",
+        SHADER_SHADOWED | SHADER_DIRECT_LIGHTS, SHADER_SPECULAR);
+
+    // Material textures are sampled through sampler objects; --anisotropy N turns on anisotropic filtering
+    float anisotropy = 1.0f;
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "--anisotropy") == 0)
+            anisotropy = float(atof(argv[i + 1]));
+    }
+    UInitializeSamplers(gSamplers, anisotropy);
+
+    // Load the scene's meshes and textures
+    if (!UInstantiateScene(sceneDesc, sceneFile, gScene))
+        return UAbortStartup();
+    gTissueBoxTextureId = UFindSceneTexture(gScene, "tissueBox");
+    gCamera.Position = glm::make_vec3(sceneDesc.cameraPosition);
+    UCreateClusteredLights(gClusteredLights);
+
+    // Use the scene's baked lightmap if there is one; --bake-lightmaps [samples] bakes it again in the background
+    int bakeSamples = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--bake-lightmaps") == 0)
+            bakeSamples = i + 1 < argc && atoi(argv[i + 1]) > 0 ? atoi(argv[i + 1]) : 256;
+    }
+    UPrepareLightmap(gScene, sceneFile, gLightmap, bakeSamples);
+
+    // Everything without a lightmap takes its ambient light from the probe grid
+    UBakeProbes(gLightmap, gProbes);
+
+    // Queue the variants the scene's materials need, then wait only for the programs the first frame can't do without
+    UWarmShaderVariants();
+    if (!UFinishShaderFallback(gShadowShaders) || !UFinishShaderFallback(gLampShaders) || !UFinishShaderFallback(gCubeShaders)
+        || !UFinishShaderFallback(gGBufferShaders) || !UFinishShaderFallback(gDeferredShaders) || !UFinishShaderFallback(gHudShaders))
+        return UAbortStartup();
+
+    // Edits to the shader sources, textures and meshes show up without a restart
+    UStartAssetWatcher(gAssetWatcher, gScene);
+
+    // Shadow filter quality can be picked with --pcf 0-2, and cycled with P
+    UCreateShadowMap(gShadowMap);
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (strcmp(argv[i], "--pcf") == 0)
+            gShadowMap.pcf = glm::clamp(atoi(argv[i + 1]), 0, SHADOW_PCF_LEVELS - 1);
+    }
+
+    // The G-buffer is sized on first use
+    memset(&gGBuffer, 0, sizeof(gGBuffer));
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--deferred") == 0)
+            gIsDeferred = true;
+    }
+
+    // H shows the performance HUD, or --hud from the start
+    UCreateHud(gHud);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--hud") == 0)
+            USetHudVisible(gHud, true);
+    }
+
+    // Renderer benchmark: time both renderers over a range of light counts and overdraw, then quit
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--bench-renderer") == 0)
+        {
+            UBenchmarkRenderers();
+            glfwSetWindowShouldClose(gWindow, GLFW_TRUE);
+        }
+    }
+
+
+
+
+
+
+    // Sets the background color of the window to black (it will be implicitely used by glClear)
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+
+    /* Frame pacing: --swap-interval 0, 1 or -1 (adaptive vsync), --max-frames-in-flight N (0 for the driver's
+     * default), --fps-cap N, and --frame-stats to print frame timing and input latency every few seconds
+     */
+    gFramePacing.swapInterval = 1;
+    gFramePacing.maxFramesInFlight = 2;
+    gFramePacing.frameCap = 0.0;
+    gFramePacing.isReporting = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--swap-interval") == 0 && hasValue)
+            gFramePacing.swapInterval = glm::clamp(atoi(argv[i + 1]), -1, 1);
+        else if (strcmp(argv[i], "--max-frames-in-flight") == 0 && hasValue)
+            gFramePacing.maxFramesInFlight = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--fps-cap") == 0 && hasValue)
+            gFramePacing.frameCap = std::max(0.0, atof(argv[i + 1]));
+        else if (strcmp(argv[i], "--frame-stats") == 0)
+            gFramePacing.isReporting = true;
+    }
+    UInitializeFramePacing(gFramePacing);
+
+    // From here on the camera, the lights and the transforms belong to the simulation thread
+    UStartFramePipeline(gFramePipeline);
+    URecordProfileEvent(gProfiler, "Startup", gProfiler.epoch, UProfileClock(), UProfileThread());
+
+    // render loop
+    // -----------
+    while (!glfwWindowShouldClose(gWindow))
+    {
+        UPROFILE_SCOPE("Frame");
+
+        // Swap in assets that changed on disk
+        UApplyAssetReloads(gAssetWatcher, gScene);
+
+        // Render the newest frame the simulation finished, once pacing lets the frame start
+        UBeginFrame(gFramePacing);
+        UResetFrameArena(UThreadArena());
+        const UFramePacket& packet = UAcquireFramePacket(gFramePipeline);
+
+        // input: the actions the simulation mapped from this frame's events
+        // -----
+        UProcessInput(gWindow, packet);
+        URender(packet);
+        UEndFrame(gFramePacing, packet.inputTime);
+        UCollectGpuProfile(gProfiler);
+
+        glfwPollEvents();
+    }
+
+    UStopFramePipeline(gFramePipeline);
+    UStopAssetWatcher(gAssetWatcher);
+    UDestroyFramePacing(gFramePacing);
+
+    if (gIsArenaDebug)
+        cout << "INFO: Render thread frame arena peaked at " << UThreadArena().peak << " bytes" << endl;
+
+    // The last frames' GPU times are waited for, so the trace ends with complete frames
+    if (gProfiler.isTracingAtExit)
+    {
+        glFinish();
+        UCollectGpuProfile(gProfiler);
+        UWriteTrace(gProfiler, gProfiler.traceFile.c_str());
+    }
+    UDestroyHud(gHud);
+    UDestroyProfiler(gProfiler);
+
+    // Release mesh data
+    UDestroyMesh(gMesh);
+    UDestroyDrawRing(gDrawRing);
+
+    // Release the scene's textures
+    UDestroyScene(gScene);
+    UDestroySamplers(gSamplers);
+    UDestroyClusteredLights(gClusteredLights);
+    UDestroyGBuffer(gGBuffer);
+    UDestroyShadowMap(gShadowMap);
+    UDestroyLightmap(gLightmap);
+    UDestroyProbes(gProbes);
+
+    UStopWorkers();
+
+    // Release shader programs
+    UDestroyShaderFamily(gCubeShaders);
+    UDestroyShaderFamily(gLampShaders);
+    UDestroyShaderFamily(gGBufferShaders);
+    UDestroyShaderFamily(gDeferredShaders);
+    UDestroyShaderFamily(gShadowShaders);
+    UDestroyShaderFamily(gHudShaders);
+
+    exit(EXIT_SUCCESS); // Terminates the program successfully
+}
+
+
+/* Joins the threads started so far when startup fails after the job workers are running: the workers and
+ * possibly the lightmap bake. Returning from main with them still joinable would abort the process in
+ * std::thread's destructor instead of exiting. Returns the exit code for main.
+ */
+int UAbortStartup()
+{
+    UDestroyLightmap(gLightmap);
+    UStopWorkers();
+    glfwTerminate();
+    return EXIT_FAILURE;
+}
+
+
+// Initialize GLFW, GLEW, and create a window
+bool UInitialize(int argc, char* argv[], GLFWwindow** window)
+{
+    // GLFW: initialize and configure
+    // ------------------------------
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+
+    // GLFW: window creation
+    // ---------------------
+    * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (*window == NULL)
+    {
+        std::cout << "Failed to create GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(*window);
+    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetKeyCallback(*window, UKeyCallback);
+    glfwSetCursorPosCallback(*window, UMousePositionCallback);
+    glfwSetScrollCallback(*window, UMouseScrollCallback);
+    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+    // tell GLFW to capture our mouse
+    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+
+    // GLEW: initialize
+    // ----------------
+    // Note: if using GLEW version 1.13 or earlier
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
+
+    if (GLEW_OK != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    // Displays GPU OpenGL version
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+
+    // Resources are created through direct state access when the context has it, unless --no-dsa asks otherwise
+    gHasDirectStateAccess = GLEW_VERSION_4_5 || GLEW_ARB_direct_state_access;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--no-dsa") == 0)
+            gHasDirectStateAccess = false;
+    }
+    cout << "INFO: Resource creation " << (gHasDirectStateAccess ? "with direct state access" : "through bind-to-edit") << endl;
+
+    return true;
+}
+
+
+// Carries out the actions the simulation mapped from the input events of this frame
+void UProcessInput(GLFWwindow* window, const UFramePacket& packet)
+{
+    UPROFILE_SCOPE("Process input");
+    for (size_t i = 0; i < packet.actions.size(); ++i)
+    {
+        switch (packet.actions[i])
+        {
+        case ACTION_QUIT:
+            glfwSetWindowShouldClose(window, true);
+            break;
+
+        case ACTION_WRAP_REPEAT:
+            if (gTexWrapMode != GL_REPEAT)
+            {
+                USetTextureWrap(gScene, gTissueBoxTextureId, GL_REPEAT);
+                gTexWrapMode = GL_REPEAT;
+
+                cout << "Current Texture Wrapping Mode: REPEAT" << endl;
+            }
+            break;
+
+        case ACTION_WRAP_MIRRORED_REPEAT:
+            if (gTexWrapMode != GL_MIRRORED_REPEAT)
+            {
+                USetTextureWrap(gScene, gTissueBoxTextureId, GL_MIRRORED_REPEAT);
+                gTexWrapMode = GL_MIRRORED_REPEAT;
+
+                cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
+            }
+            break;
+
+        case ACTION_WRAP_CLAMP_TO_EDGE:
+            if (gTexWrapMode != GL_CLAMP_TO_EDGE)
+            {
+                USetTextureWrap(gScene, gTissueBoxTextureId, GL_CLAMP_TO_EDGE);
+                gTexWrapMode = GL_CLAMP_TO_EDGE;
+
+                cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
+            }
+            break;
+
+        case ACTION_WRAP_CLAMP_TO_BORDER:
+            if (gTexWrapMode != GL_CLAMP_TO_BORDER)
+            {
+                USetTextureWrap(gScene, gTissueBoxTextureId, GL_CLAMP_TO_BORDER);
+                gTexWrapMode = GL_CLAMP_TO_BORDER;
+
+                cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
+            }
+            break;
+
+        case ACTION_UV_SCALE_UP:
+            gUVScale += 0.1f;
+            cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+            break;
+
+        case ACTION_UV_SCALE_DOWN:
+            gUVScale -= 0.1f;
+            cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+            break;
+
+        // Switch between the forward (F) and deferred (G) renderers
+        case ACTION_FORWARD_RENDERER:
+            if (gIsDeferred)
+            {
+                gIsDeferred = false;
+                cout << "Forward renderer" << endl;
+            }
+            break;
+
+        case ACTION_DEFERRED_RENDERER:
+            if (!gIsDeferred)
+            {
+                gIsDeferred = true;
+                cout << "Deferred renderer" << endl;
+            }
+            break;
+
+        // Cycle the shadow filter quality
+        case ACTION_CYCLE_SHADOW_FILTER:
+            gShadowMap.pcf = (gShadowMap.pcf + 1) % SHADOW_PCF_LEVELS;
+            cout << "Shadow filter quality " << gShadowMap.pcf << endl;
+            break;
+
+        // Write the profiler's events out for chrome://tracing or Perfetto
+        case ACTION_WRITE_TRACE:
+            UWriteTrace(gProfiler, gProfiler.traceFile.c_str());
+            break;
+
+        // Show or hide the performance HUD
+        case ACTION_TOGGLE_HUD:
+            USetHudVisible(gHud, !gHud.isVisible);
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+
+// Appends an input event to the ring for the simulation. Events are dropped if the ring is full.
+static void UPushInputEvent(UInputRing& ring, const UInputEvent& event)
+{
+    const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) >= INPUT_RING_SIZE)
+        return;
+    ring.events[tail % INPUT_RING_SIZE] = event;
+    ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+
+// Takes the oldest input event if it happened before 'time'
+static bool UTakeInputEvent(UInputRing& ring, double time, UInputEvent& event)
+{
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    if (head == ring.tail.load(std::memory_order_acquire))
+        return false;
+    event = ring.events[head % INPUT_RING_SIZE];
+    if (event.time >= time)
+        return false;
+    ring.head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+
+void UKeyCallback(GLFWwindow* /*window*/, int key, int /*scancode*/, int action, int /*mods*/)
+{
+    UInputEvent event;
+    event.time = glfwGetTime();
+    event.type = INPUT_KEY;
+    event.key = key;
+    event.action = action;
+    event.offset = glm::vec2(0.0f);
+    UPushInputEvent(gInputRing, event);
+}
+
+
+// glfw: whenever the window size changed (by OS or user resize) this callback function executes
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+}
+
+
+// glfw: whenever the mouse moves, this callback is called
+// -------------------------------------------------------
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos; // reversed since y-coordinates go from bottom to top
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    // The simulation step this falls in turns the camera
+    UInputEvent event;
+    event.time = glfwGetTime();
+    event.type = INPUT_MOUSE_MOVE;
+    event.key = event.action = 0;
+    event.offset = glm::vec2(xoffset, yoffset);
+    UPushInputEvent(gInputRing, event);
+}
+
+
+// glfw: whenever the mouse scroll wheel scrolls, this callback is called
+// ----------------------------------------------------------------------
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    UInputEvent event;
+    event.time = glfwGetTime();
+    event.type = INPUT_SCROLL;
+    event.key = event.action = 0;
+    event.offset = glm::vec2(float(xoffset), float(yoffset));
+    UPushInputEvent(gInputRing, event);
+}
+
+// glfw: handle mouse button events
+// --------------------------------
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Left mouse button pressed" << endl;
+        else
+            cout << "Left mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Middle mouse button pressed" << endl;
+        else
+            cout << "Middle mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Right mouse button pressed" << endl;
+        else
+            cout << "Right mouse button released" << endl;
+    }
+    break;
+
+    default:
+        cout << "Unhandled mouse button event" << endl;
+        break;
+    }
+}
+
+
+// Passes the camera and cluster grid to a program that includes clusteredLightingSource
+static void USetClusterUniforms(GLuint programId, const glm::mat4& view, const glm::vec3& cameraPosition, int width, int height, float nearPlane, float farPlane)
+{
+    glUniform3f(glGetUniformLocation(programId, "viewPosition"), cameraPosition.x, cameraPosition.y, cameraPosition.z);
+    glUniformMatrix4fv(glGetUniformLocation(programId, "view"), 1, GL_FALSE, glm::value_ptr(view));
+
+    // The cluster lookup works from the fragment's pixel and its view depth
+    const float depthScale = CLUSTER_Z / std::log(farPlane / nearPlane);
+    glUniform3ui(glGetUniformLocation(programId, "clusterCount"), CLUSTER_X, CLUSTER_Y, CLUSTER_Z);
+    glUniform2f(glGetUniformLocation(programId, "clusterTileScale"), float(CLUSTER_X) / std::max(width, 1), float(CLUSTER_Y) / std::max(height, 1));
+    glUniform2f(glGetUniformLocation(programId, "clusterDepthScale"), depthScale, -std::log(nearPlane) * depthScale);
+    gFrameStats.uniformUploads += 5;
+}
+
+
+// Features of the whole scene: shadows, probes and whether the lights are few enough to skip the clusters
+static uint32_t USceneShaderFeatures(const std::vector<USceneLight>& lights)
+{
+    uint32_t features = 0;
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        if (lights[i].shadow)
+            features |= SHADER_SHADOWED;
+    }
+    if (gProbes.texture)
+        features |= SHADER_PROBES;
+    if (!lights.empty() && lights.size() <= size_t(MAX_DIRECT_LIGHTS))
+        features |= uint32_t(lights.size()) << SHADER_DIRECT_LIGHTS_SHIFT;
+    return features;
+}
+
+
+static uint32_t UMaterialShaderFeatures(const USceneMaterial& material)
+{
+    return (material.texture ? SHADER_TEXTURED : 0u) | (material.specularIntensity > 0.0f ? SHADER_SPECULAR : 0u);
+}
+
+
+// Passes the frame's camera, lights and ambient color to a scene shader variant
+static void USetFrameUniforms(GLuint programId, const UFrameUniforms& frame)
+{
+    glUniformMatrix4fv(glGetUniformLocation(programId, "projection"), 1, GL_FALSE, glm::value_ptr(frame.projection));
+    glUniform2fv(glGetUniformLocation(programId, "uvScale"), 1, glm::value_ptr(gUVScale));
+    glUniform3fv(glGetUniformLocation(programId, "objectColor"), 1, glm::value_ptr(gObjectColor));
+    glUniform3fv(glGetUniformLocation(programId, "ambientColor"), 1, glm::value_ptr(frame.ambientColor));
+    gFrameStats.uniformUploads += 4;
+    USetClusterUniforms(programId, frame.view, frame.cameraPosition, frame.width, frame.height, frame.nearPlane, frame.farPlane);
+    USetShadowUniforms(programId, gShadowMap);
+}
+
+
+// Keeps the draws whose world space bounds reach into the view frustum, in their original order
+static void UCullDraws(const std::vector<UDrawItem>& draws, const glm::mat4& viewProjection, UArenaVector<UDrawItem>& visible)
+{
+    UPROFILE_SCOPE("Cull draws");
+    // Frustum planes from the rows of the view projection matrix (Gribb and Hartmann)
+    const glm::mat4 rows = glm::transpose(viewProjection);
+    glm::vec4 planes[6];
+    for (int i = 0; i < 3; ++i)
+    {
+        planes[2 * i] = rows[3] + rows[i];
+        planes[2 * i + 1] = rows[3] - rows[i];
+    }
+
+    // Culled draws are marked, then squeezed out in order
+    visible.resize(draws.size());
+    const UDrawItem* in = draws.data();
+    UDrawItem* out = visible.data();
+    UParallelFor(draws.size(), 256, [=](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const GLIndexedMesh& mesh = gMeshPool[in[i].mesh];
+            const glm::mat4& model = in[i].model;
+            const glm::vec3 halfSize = 0.5f * (mesh.boundsMax - mesh.boundsMin);
+            const glm::vec3 center(model * glm::vec4(0.5f * (mesh.boundsMin + mesh.boundsMax), 1.0f));
+            const glm::vec3 extent = glm::abs(glm::vec3(model[0])) * halfSize.x + glm::abs(glm::vec3(model[1])) * halfSize.y
+                + glm::abs(glm::vec3(model[2])) * halfSize.z;
+
+            bool isVisible = true;
+            for (int p = 0; p < 6 && isVisible; ++p)
+                isVisible = glm::dot(glm::vec3(planes[p]), center) + glm::dot(glm::abs(glm::vec3(planes[p])), extent) + planes[p].w >= 0.0f;
+            out[i] = in[i];
+            if (!isVisible)
+                out[i].mesh = NO_MESH;
+        }
+    });
+    visible.erase(std::remove_if(visible.begin(), visible.end(), [](const UDrawItem& draw) { return draw.mesh == NO_MESH; }), visible.end());
+}
+
+
+// Points a vertex array's per instance draw index attribute at 'buffer', one index per instance
+static void UAttachDrawIndices(GLuint vao, GLuint buffer)
+{
+    if (gHasDirectStateAccess)
+    {
+        glEnableVertexArrayAttrib(vao, DRAW_INDEX_ATTRIBUTE);
+        glVertexArrayAttribIFormat(vao, DRAW_INDEX_ATTRIBUTE, 1, GL_UNSIGNED_INT, 0);
+        glVertexArrayAttribBinding(vao, DRAW_INDEX_ATTRIBUTE, DRAW_INDEX_BINDING);
+        glVertexArrayBindingDivisor(vao, DRAW_INDEX_BINDING, 1);
+        glVertexArrayVertexBuffer(vao, DRAW_INDEX_BINDING, buffer, 0, sizeof(GLuint));
+        return;
+    }
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribIPointer(DRAW_INDEX_ATTRIBUTE, 1, GL_UNSIGNED_INT, sizeof(GLuint), 0);
+    glVertexAttribDivisor(DRAW_INDEX_ATTRIBUTE, 1);
+    glEnableVertexAttribArray(DRAW_INDEX_ATTRIBUTE);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+/* (Re)creates the ring's buffers with room for 'capacity' records per region. The old buffers are deleted
+ * right away; GL keeps them alive until the GPU is done with them, so nothing needs to wait.
+ */
+static void UResizeDrawRing(UDrawRing& ring, GLuint capacity)
+{
+    UDestroyDrawRing(ring);
+    ring.capacity = capacity;
+
+    const GLsizeiptr bytes = GLsizeiptr(DRAW_RING_REGIONS) * capacity * sizeof(UDrawData);
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    std::vector<GLuint> indices(size_t(DRAW_RING_REGIONS) * capacity);
+    for (size_t i = 0; i < indices.size(); ++i)
+        indices[i] = GLuint(i);
+    if (gHasDirectStateAccess)
+    {
+        glCreateBuffers(1, &ring.buffer);
+        glNamedBufferStorage(ring.buffer, bytes, NULL, flags);
+        ring.records = (UDrawData*)glMapNamedBufferRange(ring.buffer, 0, bytes, flags);
+        glCreateBuffers(1, &ring.drawIndexBuffer);
+        glNamedBufferStorage(ring.drawIndexBuffer, GLsizeiptr(indices.size() * sizeof(GLuint)), indices.data(), 0);
+    }
+    else
+    {
+        glGenBuffers(1, &ring.buffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, ring.buffer);
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER, bytes, NULL, flags);
+        ring.records = (UDrawData*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, bytes, flags);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        glGenBuffers(1, &ring.drawIndexBuffer);
+        glBindBuffer(GL_ARRAY_BUFFER, ring.drawIndexBuffer);
+        glBufferStorage(GL_ARRAY_BUFFER, GLsizeiptr(indices.size() * sizeof(GLuint)), indices.data(), 0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    UTrackBuffer(ring.buffer, VRAM_BUFFERS, bytes);
+    UTrackBuffer(ring.drawIndexBuffer, VRAM_BUFFERS, GLsizeiptr(indices.size() * sizeof(GLuint)));
+
+    // Every pool mesh reads its draw index from the new buffer
+    for (size_t i = 0; i < gMeshPool.size(); ++i)
+        UAttachDrawIndices(gMeshPool[i].vao, ring.drawIndexBuffer);
+}
+
+
+void UCreateDrawRing(UDrawRing& ring)
+{
+    ring.buffer = 0;
+    ring.records = NULL;
+    ring.region = 0;
+    ring.drawIndexBuffer = 0;
+    for (int i = 0; i < DRAW_RING_REGIONS; ++i)
+        ring.fences[i] = 0;
+    UResizeDrawRing(ring, DRAW_RING_MIN_CAPACITY);
+}
+
+
+void UDestroyDrawRing(UDrawRing& ring)
+{
+    for (int i = 0; i < DRAW_RING_REGIONS; ++i)
+    {
+        if (ring.fences[i])
+            glDeleteSync(ring.fences[i]);
+        ring.fences[i] = 0;
+    }
+    UDeleteBuffers(1, &ring.buffer);       // Unmaps it
+    UDeleteBuffers(1, &ring.drawIndexBuffer);
+    ring.buffer = ring.drawIndexBuffer = 0;
+    ring.records = NULL;
+}
+
+
+/* Hands out the next region for 'count' records once the GPU has finished reading it, and binds the ring
+ * as DrawBuffer. Returns the index of the region's first record, which the draws pass as baseInstance.
+ */
+static GLuint UBeginDrawData(UDrawRing& ring, size_t count)
+{
+    if (count > ring.capacity)
+    {
+        GLuint capacity = ring.capacity;
+        while (capacity < count)
+            capacity *= 2;
+        UResizeDrawRing(ring, capacity);
+    }
+
+    ring.region = (ring.region + 1) % DRAW_RING_REGIONS;
+    GLsync& fence = ring.fences[ring.region];
+    if (fence)
+    {
+        while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, GLuint64(1000000000)) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(fence);
+        fence = 0;
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_DATA_BINDING, ring.buffer);
+    return GLuint(ring.region) * ring.capacity;
+}
+
+
+// Fences the region UBeginDrawData handed out, after the draws that read it
+static void UEndDrawData(UDrawRing& ring)
+{
+    ring.fences[ring.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+// Draws a frame's draw list with the family's variant for each material, all of which use the cube vertex shader
+static void UDrawSceneObjects(UShaderFamily& family, uint32_t sceneFeatures, const UFrameUniforms& frame, const UArenaVector<UDrawItem>& draws)
+{
+    UPROFILE_SCOPE("Draw scene objects");
+    // Baked objects sample the lightmap for their ambient light
+    glActiveTexture(GL_TEXTURE0 + LIGHTMAP_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gLightmap.texture);
+    ++gFrameStats.textureBinds;
+
+    // Each draw's transforms and material go straight into the mapped ring
+    const GLuint firstRecord = UBeginDrawData(gDrawRing, draws.size());
+    UDrawData* records = gDrawRing.records + firstRecord;
+    UParallelFor(draws.size(), 256, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const glm::mat4& model = draws[i].model;
+            const glm::mat3 normalMatrix = glm::inverseTranspose(glm::mat3(model));
+            UDrawData& record = records[i];
+            record.model = model;
+            for (int c = 0; c < 3; ++c)
+                record.normalMatrix[c] = glm::vec4(normalMatrix[c], 0.0f);
+            record.material = gScene.objects[draws[i].object].material;
+        }
+    });
+
+    // Objects are sorted by material and mesh, so only bind when they change
+    glActiveTexture(GL_TEXTURE0);
+    UArenaVector<GLuint> preparedPrograms((UArenaAllocator<GLuint>(UThreadArena())));
+    uint32_t boundFeatures = ~0u;
+    GLuint boundProgram = 0;
+    GLint specularIntensityLoc = -1, highlightSizeLoc = -1;
+    GLuint boundVao = 0;
+    GLuint boundTexture = 0;
+    GLuint boundSampler = 0;
+    GLuint boundMaterial = GLuint(-1);
+    for (size_t i = 0; i < draws.size(); ++i)
+    {
+        const USceneObject& object = gScene.objects[draws[i].object];
+        const USceneMaterial& material = gScene.materials[object.material];
+        const bool hasLightmap = object.lightmapMesh != NO_MESH;
+        const GLIndexedMesh& mesh = gMeshPool[hasLightmap ? object.lightmapMesh : draws[i].mesh];
+
+        // Each material binds the smallest variant that covers it
+        uint32_t features = sceneFeatures | UMaterialShaderFeatures(material);
+        if (hasLightmap)
+            features = (features & ~SHADER_PROBES) | SHADER_LIGHTMAPPED;
+        if (features != boundFeatures)
+        {
+            boundFeatures = features;
+            const GLuint programId = UGetShaderVariant(family, features);
+            if (programId != boundProgram)
+            {
+                boundProgram = programId;
+                glUseProgram(programId);
+                ++gFrameStats.programBinds;
+                if (std::find(preparedPrograms.begin(), preparedPrograms.end(), programId) == preparedPrograms.end())
+                {
+                    USetFrameUniforms(programId, frame);
+                    preparedPrograms.push_back(programId);
+                }
+
+                // Material uniforms; variants without them get -1, which glUniform ignores
+                specularIntensityLoc = glGetUniformLocation(programId, "specularIntensity");
+                highlightSizeLoc = glGetUniformLocation(programId, "highlightSize");
+                boundMaterial = GLuint(-1);
+            }
+        }
+        if (!boundProgram)
+            continue; // The variant failed to compile
+
+        if (mesh.vao != boundVao)
+        {
+            glBindVertexArray(mesh.vao);
+            boundVao = mesh.vao;
+        }
+        if (material.texture != boundTexture)
+        {
+            glBindTexture(GL_TEXTURE_2D, material.texture);
+            boundTexture = material.texture;
+            ++gFrameStats.textureBinds;
+        }
+        if (material.sampler != boundSampler)
+        {
+            glBindSampler(0, material.sampler);
+            boundSampler = material.sampler;
+        }
+        if (object.material != boundMaterial)
+        {
+            glUniform1f(specularIntensityLoc, material.specularIntensity);
+            glUniform1f(highlightSizeLoc, material.highlightSize);
+            boundMaterial = object.material;
+            gFrameStats.uniformUploads += 2;
+        }
+
+        // Draws the triangles, as one instance that reads record firstRecord + i
+        glDrawElementsInstancedBaseInstance(GL_TRIANGLES, mesh.indices, GL_UNSIGNED_INT, NULL, 1, firstRecord + GLuint(i));
+        ++gFrameStats.draws;
+        gFrameStats.triangles += GLuint(mesh.indices / 3);
+    }
+    UEndDrawData(gDrawRing);
+
+    // Later passes sample their own textures on unit 0 with the textures' parameters
+    glBindSampler(0, 0);
+}
+
+
+/* Advances the simulation by one fixed step, applying the input events that happened during it in order.
+ * Movement is scaled by how long within the step its key was held, so it doesn't depend on when frames or
+ * steps happen to land.
+ */
+void UStepSimulation(USimulationState& state, UFramePacket& packet)
+{
+    state.previousCameraPosition = gCamera.Position;
+    state.previousOrbitSteps = state.orbitSteps;
+
+    const double stepStart = state.simulatedTime;
+    const double stepEnd = stepStart + SIMULATION_STEP;
+    double heldTime[ACTION_COUNT] = {};
+    UInputEvent event;
+    while (UTakeInputEvent(gInputRing, stepEnd, event))
+    {
+        if (event.type == INPUT_MOUSE_MOVE)
+        {
+            gCamera.ProcessMouseMovement(event.offset.x, event.offset.y);
+            if (packet.inputTime == 0.0)
+                packet.inputTime = event.time;
+            continue;
+        }
+        if (event.type == INPUT_SCROLL)
+        {
+            gCamera.ProcessMouseScroll(event.offset.y);
+            continue;
+        }
+
+        const UKeyBinding* binding = NULL;
+        for (int i = 0; i < KEY_BINDING_COUNT && !binding; ++i)
+        {
+            if (KEY_BINDINGS[i].key == event.key)
+                binding = &KEY_BINDINGS[i];
+        }
+        if (!binding)
+            continue;
+
+        const UAction action = binding->action;
+        const double time = std::max(event.time, stepStart);
+        if (action <= ACTION_MOVE_RIGHT)
+        {
+            if (event.action == GLFW_PRESS && !state.isHeld[action])
+            {
+                state.isHeld[action] = true;
+                state.heldSince[action] = time;
+            }
+            else if (event.action == GLFW_RELEASE && state.isHeld[action])
+            {
+                heldTime[action] += time - std::max(state.heldSince[action], stepStart);
+                state.isHeld[action] = false;
+            }
+        }
+        else if (event.action == GLFW_PRESS || (event.action == GLFW_REPEAT && binding->isRepeating))
+        {
+            // Pause and resume lamp orbiting here; everything else is the main thread's to carry out
+            if (action == ACTION_ORBIT_LAMPS)
+                gIsLampOrbiting = true;
+            else if (action == ACTION_STOP_LAMPS)
+                gIsLampOrbiting = false;
+            else
+                packet.actions.push_back(action);
+        }
+    }
+
+    static const Camera_Movement directions[] = { FORWARD, BACKWARD, LEFT, RIGHT };
+    for (int i = ACTION_MOVE_FORWARD; i <= ACTION_MOVE_RIGHT; ++i)
+    {
+        if (state.isHeld[i])
+            heldTime[i] += stepEnd - std::max(state.heldSince[i], stepStart);
+        if (heldTime[i] > 0.0)
+            gCamera.ProcessKeyboard(directions[i - ACTION_MOVE_FORWARD], float(heldTime[i]));
+    }
+
+    if (gIsLampOrbiting)
+        ++state.orbitSteps;
+    state.simulatedTime = stepEnd;
+    ++state.steps;
+}
+
+
+void USimulate(UFramePacket& packet, double deltaTime)
+{
+    UPROFILE_SCOPE("Simulate");
+    USimulationState& state = gSimulation;
+    packet.actions.clear();
+    packet.inputTime = 0.0;
+
+    // Run the steps that fit the time that passed. Time beyond MAX_STEPS_PER_FRAME steps is dropped, so a
+    // stall slows the simulation down instead of making every following frame catch up.
+    state.accumulator += deltaTime;
+    if (state.accumulator > MAX_STEPS_PER_FRAME * SIMULATION_STEP)
+    {
+        state.simulatedTime += state.accumulator - MAX_STEPS_PER_FRAME * SIMULATION_STEP;
+        state.accumulator = MAX_STEPS_PER_FRAME * SIMULATION_STEP;
+    }
+    while (state.accumulator >= SIMULATION_STEP)
+    {
+        UStepSimulation(state, packet);
+        state.accumulator -= SIMULATION_STEP;
+    }
+
+    // Show the state between the last two steps, as far along as time has moved past the last one
+    const double alpha = state.accumulator / SIMULATION_STEP;
+
+    // camera/view transformation
+    const glm::vec3 cameraPosition = glm::mix(state.previousCameraPosition, gCamera.Position, float(alpha));
+    packet.view = glm::lookAt(cameraPosition, cameraPosition + gCamera.Front, gCamera.Up);
+    packet.cameraPosition = cameraPosition;
+
+    // Creates a perspective projection
+    packet.nearPlane = 0.1f;
+    packet.farPlane = 100.0f;
+    packet.projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, packet.nearPlane, packet.farPlane);
+
+    // Orbiting lamps circle the origin. The angle comes from the time spent orbiting rather than being
+    // accumulated, so the scene's light positions never drift.
+    const double angularVelocity = glm::radians(45.0);
+    const double orbitTime = (double(state.previousOrbitSteps) + alpha * double(state.orbitSteps - state.previousOrbitSteps)) * SIMULATION_STEP;
+    const glm::mat4 orbit = glm::rotate(float(std::fmod(angularVelocity * orbitTime, glm::radians(360.0))), glm::vec3(0.0f, 1.0f, 0.0f));
+    packet.lights = gScene.lights;
+    for (size_t i = 0; i < packet.lights.size(); ++i)
+    {
+        if (packet.lights[i].orbit)
+            packet.lights[i].position = glm::vec3(orbit * glm::vec4(gScene.lights[i].position, 1.0f));
+    }
+
+    // Sorting the lights into the clusters of this view doesn't depend on the transforms, so it runs as a
+    // job beside them
+    UJobCounter lightsAssigned;
+    const auto assignLights = [&]()
+    {
+        UAssignLights(packet.clusters, packet.lights, packet.view, packet.projection, packet.nearPlane, packet.farPlane);
+    };
+    USubmitTask(lightsAssigned, assignLights);
+
+    // Rebuild the world matrices of objects that moved since the last step
+    UUpdateTransforms(gScene.transforms);
+
+    // The draw list keeps the scene's material and mesh order
+    packet.draws.resize(gScene.objects.size());
+    UDrawItem* draws = packet.draws.data();
+    UParallelFor(gScene.objects.size(), 256, [=](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            const USceneObject& object = gScene.objects[i];
+            UDrawItem& draw = draws[i];
+            draw.object = GLuint(i);
+            draw.model = gScene.transforms.world[object.entity];
+            draw.mesh = gScene.meshes[object.mesh].lods[USelectLod(glm::vec3(draw.model[3]))];
+        }
+    });
+    UWaitForJobs(lightsAssigned);
+    packet.transformVersion = gScene.transforms.version;
+}
+
+
+// Functioned called to render a frame
+void URender(const UFramePacket& packet)
+{
+    UPROFILE_SCOPE("Render");
+    gFrameStats = UFrameStats();
+    UBeginHudFrame(gHud);
+
+    // Enable z-depth
+    glEnable(GL_DEPTH_TEST);
+
+    // Clear the frame and z buffers
+    glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    const glm::mat4& view = packet.view;
+    const glm::mat4& projection = packet.projection;
+
+    // Light lists of this view's clusters, sorted by the simulation
+    UUploadClusteredLights(gClusteredLights, packet.clusters);
+
+    // Ambient light takes the color of the unbounded lights (white if there are none)
+    glm::vec3 ambientColor(0.0f);
+    bool hasUnboundedLight = false;
+    for (size_t i = 0; i < packet.lights.size(); ++i)
+    {
+        if (packet.lights[i].radius <= 0.0f)
+        {
+            ambientColor += packet.lights[i].color;
+            hasUnboundedLight = true;
+        }
+    }
+    if (!hasUnboundedLight)
+        ambientColor = glm::vec3(1.0f);
+    ambientColor *= gScene.ambientStrength;
+
+    int framebufferWidth, framebufferHeight;
+    glfwGetFramebufferSize(gWindow, &framebufferWidth, &framebufferHeight);
+
+    UFrameUniforms frame;
+    frame.view = view;
+    frame.projection = projection;
+    frame.cameraPosition = packet.cameraPosition;
+    frame.width = framebufferWidth;
+    frame.height = framebufferHeight;
+    frame.nearPlane = packet.nearPlane;
+    frame.farPlane = packet.farPlane;
+    frame.ambientColor = ambientColor;
+
+    // Show the baker's progress
+    UUpdateLightmap(gLightmap);
+
+    // Bring the cached shadow map up to date with the light, within the per frame face budget
+    UUpdateShadowMap(gShadowMap, gScene, packet);
+    const uint32_t sceneFeatures = USceneShaderFeatures(packet.lights);
+    glViewport(0, 0, framebufferWidth, framebufferHeight);
+
+    // Falls back to forward rendering if the G-buffer can't be created
+    if (gIsDeferred && (gGBuffer.width != framebufferWidth || gGBuffer.height != framebufferHeight)
+        && !UCreateGBuffer(gGBuffer, framebufferWidth, framebufferHeight))
+        gIsDeferred = false;
+
+    // Shadows above still use every draw, since casters outside the view can shade what's in it
+    UArenaAllocator<UDrawItem> frameAllocator(UThreadArena());
+    UArenaVector<UDrawItem> visibleDraws(frameAllocator);
+    UCullDraws(packet.draws, projection * view, visibleDraws);
+    gFrameStats.objects = GLuint(packet.draws.size());
+    gFrameStats.visibleObjects = GLuint(visibleDraws.size());
+
+    if (!gIsDeferred)
+    {
+        // SCENE: draw every visible object with the Phong shader variant of its material
+        //------------------------------------------------------------------------------
+        UPROFILE_GPU_SCOPE("Scene");
+        UDrawSceneObjects(gCubeShaders, sceneFeatures, frame, visibleDraws);
+    }
+    else
+    {
+        // GEOMETRY: write every visible object's surface into the G-buffer
+        //-----------------------------------------------------------------
+        {
+            UPROFILE_GPU_SCOPE("G-buffer");
+            glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.framebuffer);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            UDrawSceneObjects(gGBufferShaders, sceneFeatures, frame, visibleDraws);
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        }
+
+        // LIGHTING: shade each pixel once, from the lights of its cluster
+        //----------------------------------------------------------------
+        UPROFILE_GPU_SCOPE("Deferred lighting");
+        UArenaVector<glm::vec2> materials(gScene.materials.size(), glm::vec2(0.0f), frameAllocator);
+        for (size_t i = 0; i < materials.size(); ++i)
+            materials[i] = glm::vec2(gScene.materials[i].specularIntensity, gScene.materials[i].highlightSize);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gGBuffer.materialBuffer);
+        const GLsizeiptr materialBytes = materials.size() * sizeof(glm::vec2);
+        if (materialBytes > gGBuffer.materialBytes)
+        {
+            gGBuffer.materialBytes = materialBytes;
+            glBufferData(GL_SHADER_STORAGE_BUFFER, materialBytes, NULL, GL_DYNAMIC_DRAW);
+            UTrackBuffer(gGBuffer.materialBuffer, VRAM_BUFFERS, materialBytes);
+        }
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, materialBytes, materials.data());
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gGBuffer.materialBuffer);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        const GLuint lightingProgramId = UGetShaderVariant(gDeferredShaders, sceneFeatures);
+        glUseProgram(lightingProgramId);
+        USetFrameUniforms(lightingProgramId, frame);
+        const glm::mat4 inverseViewProjection = glm::inverse(projection * view);
+        glUniformMatrix4fv(glGetUniformLocation(lightingProgramId, "inverseViewProjection"), 1, GL_FALSE, glm::value_ptr(inverseViewProjection));
+        ++gFrameStats.programBinds;
+        ++gFrameStats.uniformUploads;
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, gGBuffer.albedo);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, gGBuffer.normal);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, gGBuffer.depth);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, gGBuffer.ambient);
+        gFrameStats.textureBinds += 4;
+
+        // The pass copies the scene depth through gl_FragDepth, so it must always pass the depth test
+        glDepthFunc(GL_ALWAYS);
+        glBindVertexArray(gGBuffer.emptyVao);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glDepthFunc(GL_LESS);
+        ++gFrameStats.draws;
+        ++gFrameStats.triangles;
+        glActiveTexture(GL_TEXTURE0);
+    }
+
+
+    // LAMPS: draw a small cube at every light that has one
+    //----------------------------------------------------
+    {
+        UPROFILE_GPU_SCOPE("Lamps");
+        const GLuint lampProgramId = UGetShaderVariant(gLampShaders, 0);
+        glUseProgram(lampProgramId);
+        const GLIndexedMesh& lampMesh = gMeshPool[gMesh.tissueBox];
+        glBindVertexArray(lampMesh.vao);
+
+        // Reference matrix uniforms from the Lamp Shader program
+        GLint modelLoc = glGetUniformLocation(lampProgramId, "model");
+        GLint viewLoc = glGetUniformLocation(lampProgramId, "view");
+        GLint projLoc = glGetUniformLocation(lampProgramId, "projection");
+
+        // Pass matrix data to the Lamp Shader program's matrix uniforms
+        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        ++gFrameStats.programBinds;
+        gFrameStats.uniformUploads += 2;
+
+        for (size_t i = 0; i < packet.lights.size(); ++i)
+        {
+            if (packet.lights[i].scale <= 0.0f)
+                continue;
+
+            //Transform the smaller cube used as a visual que for the light source
+            glm::mat4 model = glm::translate(packet.lights[i].position) * glm::scale(glm::vec3(packet.lights[i].scale));
+            glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+
+            glDrawElements(GL_TRIANGLES, lampMesh.indices, GL_UNSIGNED_INT, NULL);
+            ++gFrameStats.uniformUploads;
+            ++gFrameStats.draws;
+            gFrameStats.triangles += GLuint(lampMesh.indices / 3);
+        }
+
+        // Deactivate the Vertex Array Object and shader program
+        glBindVertexArray(0);
+        glUseProgram(0);
+    }
+
+    // HUD: the timings and counters of this frame, over everything else
+    UDrawHud(gHud, gFrameStats);
+
+    // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+    UPROFILE_SCOPE("Swap buffers");
+    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+}
+
+
+/* Simulation thread. Each frame simulates the time since the last one, fills the writing packet and
+ * trades it for the waiting one, then waits for the main thread to pick that up; so the simulation works
+ * on frame N + 1 while frame N is drawn, and never runs further ahead than that.
+ */
+static void URunSimulation(UFramePipeline* pipeline)
+{
+    UNameProfileThread(gProfiler, "Simulation");
+    uint64_t sequence = 0;
+    std::unique_lock<std::mutex> lock(pipeline->mutex);
+    while (!pipeline->quit)
+    {
+        UFramePacket& packet = pipeline->packets[pipeline->writing];
+        lock.unlock();
+        UResetFrameArena(UThreadArena());
+
+        // per-frame timing
+        // --------------------
+        const double currentTime = glfwGetTime();
+        const double deltaTime = currentTime - gSimulation.lastTime;
+        gSimulation.lastTime = currentTime;
+
+        USimulate(packet, deltaTime);
+
+        lock.lock();
+        packet.sequence = ++sequence;
+        std::swap(pipeline->writing, pipeline->waiting);
+        pipeline->isWaitingFresh = true;
+        pipeline->published.notify_one();
+        while (pipeline->isWaitingFresh && !pipeline->quit)
+            pipeline->taken.wait(lock);
+    }
+}
+
+
+void UStartFramePipeline(UFramePipeline& pipeline)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        pipeline.packets[i].sequence = 0;
+        pipeline.packets[i].clusters.clusters.assign(2 * CLUSTER_X * CLUSTER_Y * CLUSTER_Z, 0);
+    }
+    pipeline.writing = 0;
+    pipeline.waiting = 1;
+    pipeline.drawing = 2;
+    pipeline.isWaitingFresh = false;
+    pipeline.quit = false;
+
+    gSimulation.previousCameraPosition = gCamera.Position;
+    gSimulation.previousOrbitSteps = gSimulation.orbitSteps;
+    gSimulation.accumulator = 0.0;
+    gSimulation.lastTime = gSimulation.simulatedTime = glfwGetTime();
+    pipeline.thread = std::thread(URunSimulation, &pipeline);
+}
+
+
+// The newest packet the simulation finished, waiting for it if the last one has been drawn already
+const UFramePacket& UAcquireFramePacket(UFramePipeline& pipeline)
+{
+    UPROFILE_SCOPE("Wait for frame packet");
+    std::unique_lock<std::mutex> lock(pipeline.mutex);
+    while (!pipeline.isWaitingFresh)
+        pipeline.published.wait(lock);
+    std::swap(pipeline.drawing, pipeline.waiting);
+    pipeline.isWaitingFresh = false;
+    pipeline.taken.notify_one();
+    return pipeline.packets[pipeline.drawing];
+}
+
+
+void UStopFramePipeline(UFramePipeline& pipeline)
+{
+    {
+        std::lock_guard<std::mutex> lock(pipeline.mutex);
+        pipeline.quit = true;
+    }
+    pipeline.taken.notify_one();
+    if (pipeline.thread.joinable())
+        pipeline.thread.join();
+}
+
+
+/* Frame pacing */
+
+// Sleeps until 'time' (in glfwGetTime seconds). The last stretch is spun, since sleeps can overshoot by a scheduler tick.
+static void USleepUntil(double time)
+{
+    const double spinTime = 0.002;
+    const double remaining = time - glfwGetTime();
+    if (remaining > spinTime)
+        std::this_thread::sleep_for(std::chrono::duration<double>(remaining - spinTime));
+    while (glfwGetTime() < time)
+        std::this_thread::yield();
+}
+
+
+void UInitializeFramePacing(UFramePacing& pacing)
+{
+    // Adaptive vsync needs the swap control tear extension of the window system
+    if (pacing.swapInterval < 0 && !glfwExtensionSupported("WGL_EXT_swap_control_tear") && !glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+    {
+        cout << "INFO: Adaptive vsync is not supported, using vsync" << endl;
+        pacing.swapInterval = 1;
+    }
+    glfwSwapInterval(pacing.swapInterval);
+    pacing.maxFramesInFlight = glm::clamp(pacing.maxFramesInFlight, 0, MAX_PENDING_FRAMES);
+
+    pacing.firstPending = pacing.pendingCount = 0;
+    pacing.nextFrameTime = pacing.periodStart = pacing.lastPresent = glfwGetTime();
+    pacing.frames = pacing.latencyCount = 0;
+    pacing.intervalSum = pacing.intervalSquares = pacing.intervalMax = 0.0;
+    pacing.latencySum = pacing.latencyMax = 0.0;
+
+    cout << "INFO: Swap interval " << pacing.swapInterval << ", at most " << pacing.maxFramesInFlight << " frames in flight";
+    if (pacing.frameCap > 0.0)
+        cout << ", capped at " << pacing.frameCap << " fps";
+    cout << endl;
+}
+
+
+/* Retires the frames the GPU has finished, recording their input latency. With 'wait', blocks on the oldest
+ * one first.
+ */
+static void URetireFrames(UFramePacing& pacing, bool wait)
+{
+    while (pacing.pendingCount > 0)
+    {
+        UPendingFrame& frame = pacing.pending[pacing.firstPending];
+        const GLuint64 timeout = wait ? GLuint64(1000000000) : 0;
+        const GLenum status = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+        if (status == GL_TIMEOUT_EXPIRED)
+            break;
+        wait = false;
+
+        // GLFW doesn't timestamp events, so this counts from when glfwPollEvents delivered the mouse event
+        // to when the GPU finished the frame that shows it
+        if (frame.inputTime > 0.0)
+        {
+            const double latency = glfwGetTime() - frame.inputTime;
+            pacing.latencySum += latency;
+            pacing.latencyMax = std::max(pacing.latencyMax, latency);
+            ++pacing.latencyCount;
+        }
+        glDeleteSync(frame.fence);
+        pacing.firstPending = (pacing.firstPending + 1) % MAX_PENDING_FRAMES;
+        --pacing.pendingCount;
+    }
+}
+
+
+// Holds the next frame back until the frame cap and the frames in flight limit allow it to start
+void UBeginFrame(UFramePacing& pacing)
+{
+    UPROFILE_SCOPE("Pace frame");
+    if (pacing.frameCap > 0.0)
+    {
+        // Frames are spaced from the previous deadline rather than from now, so oversleeping doesn't add up,
+        // unless the program fell a whole frame behind
+        const double now = glfwGetTime();
+        if (now - pacing.nextFrameTime > 1.0 / pacing.frameCap)
+            pacing.nextFrameTime = now;
+        USleepUntil(pacing.nextFrameTime);
+        pacing.nextFrameTime += 1.0 / pacing.frameCap;
+    }
+
+    URetireFrames(pacing, false);
+    const int limit = pacing.maxFramesInFlight > 0 ? pacing.maxFramesInFlight : MAX_PENDING_FRAMES;
+    while (pacing.pendingCount >= limit)
+        URetireFrames(pacing, true);
+}
+
+
+// Fences the frame just presented, and reports the pacing statistics every FRAME_STATS_PERIOD seconds
+void UEndFrame(UFramePacing& pacing, double inputTime)
+{
+    UPendingFrame& frame = pacing.pending[(pacing.firstPending + pacing.pendingCount) % MAX_PENDING_FRAMES];
+    frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame.inputTime = inputTime;
+    ++pacing.pendingCount;
+
+    const double now = glfwGetTime();
+    const double interval = now - pacing.lastPresent;
+    pacing.lastPresent = now;
+    pacing.intervalSum += interval;
+    pacing.intervalSquares += interval * interval;
+    pacing.intervalMax = std::max(pacing.intervalMax, interval);
+    ++pacing.frames;
+
+    if (now - pacing.periodStart < FRAME_STATS_PERIOD)
+        return;
+    if (pacing.isReporting)
+    {
+        const double mean = pacing.intervalSum / pacing.frames;
+        const double jitter = sqrt(std::max(0.0, pacing.intervalSquares / pacing.frames - mean * mean));
+        cout << "INFO: " << pacing.frames / (now - pacing.periodStart) << " fps, frame interval " << mean * 1000.0
+             << " ms +/- " << jitter * 1000.0 << " ms (max " << pacing.intervalMax * 1000.0 << " ms)";
+        if (pacing.latencyCount > 0)
+            cout << ", input to GPU done " << pacing.latencySum / pacing.latencyCount * 1000.0 << " ms (max "
+                 << pacing.latencyMax * 1000.0 << " ms)";
+        cout << endl;
+    }
+    pacing.periodStart = now;
+    pacing.frames = pacing.latencyCount = 0;
+    pacing.intervalSum = pacing.intervalSquares = pacing.intervalMax = 0.0;
+    pacing.latencySum = pacing.latencyMax = 0.0;
+}
+
+
+void UDestroyFramePacing(UFramePacing& pacing)
+{
+    for (; pacing.pendingCount > 0; --pacing.pendingCount)
+    {
+        glDeleteSync(pacing.pending[pacing.firstPending].fence);
+        pacing.firstPending = (pacing.firstPending + 1) % MAX_PENDING_FRAMES;
+    }
+}
+
+
+// Implements the UCreateMesh function
+void UCreateMesh(GLMesh& mesh)
+{
+    UPROFILE_SCOPE("Create meshes");
     // Position and Color data
     GLfloat tissueBoxV[] = {
         //Positions          //Normals
@@ -769,407 +3396,6108 @@ void UCreateMesh(GLMesh& mesh)
       -0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
       -0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
 
-       //Front Face         //Positive Z Normal
-      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-       0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-      -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
-      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+       //Front Face         //Positive Z Normal
+      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+       0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
+       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+       0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
+      -0.5f,  0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
+      -0.5f, -0.5f,  0.5f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
+
+      //Left Face          //Negative X Normal
+      -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+      -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+      -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+      -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+      -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+      -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+      //Right Face         //Positive X Normal
+       0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+       0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
+       0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+       0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
+       0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
+       0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+
+     //Bottom Face        //Negative Y Normal
+      -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+       0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
+       0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+       0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
+      -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
+      -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+
+      //Top Face           //Positive Y Normal
+      -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+       0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
+       0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+       0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
+      -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
+      -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
+    };
+
+    GLfloat planeV[] = {
+        -10.0f, -0.5f, 10.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
+         10.0f, -0.5f, 10.0f, 0.0f, 0.0f, -1.0f, 1.0f, 0.0f,
+         10.0f, -0.5f, -10.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
+         10.0f, -0.5f, -10.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
+        -10.0f, -0.5f, -10.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
+        -10.0f, -0.5f, 10.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f
+
+    };
+
+    GLfloat tissueV[] = {
+        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Front triangle
+       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
+        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
+
+        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,     // Left triangle
+       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,
+       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
+
+        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Back triangle
+       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
+        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
+
+        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,     // Right triangle
+        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
+        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
+
+       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,     // Base of pyramid left
+       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
+        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,
+
+        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Base of pyramid right
+       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
+        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f
+
+    };
+
+    GLfloat wristPadV[] = {
+       // Bottom square
+      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
+       4.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 1
+       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
+       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
+      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
+      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
+
+       // Top sqaure
+      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 0.0f, // index 4
+       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 0.0f, // index 5
+       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 1.0f, // index 6
+       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 1.0f, // index 6
+      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 1.0f, // index 7
+      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 0.0f, // index 4
+
+       // Left square
+      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
+      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 3
+      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 4
+      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 4
+      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
+      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 7
+
+       // Right sqaure
+       4.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 1
+       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
+       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 5
+       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 5
+       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 2
+       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 6
+
+       // Back square
+      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 3
+       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 2
+       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 6
+       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 6
+      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
+      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 7
+
+       // Front sqaure
+      -2.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 0.0f, // index 0
+       4.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 0.0f, // index 1
+       4.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 1.0f, // index 5
+       4.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 1.0f, // index 5
+      -2.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 1.0f, // index 0
+      -2.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 0.0f // index 4
+    };
+
+    GLfloat chargerProngV[] = {
+      // Front face
+     -0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,  // index 0
+      0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,  // index 1
+     -0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,  // index 2
+     -0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,  // index 2
+      0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,  // index 3
+      0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,  // index 1
+
+      //Back Face         //Positive Z Normal
+     -0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,  // index 4
+      0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,  // index 5
+     -0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,  // index 6
+     -0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,  // index 6
+      0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,  // index 7
+      0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,  // index 5
+
+     //Left Face          //Negative X Normal
+     -0.1f, 1.5f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 0
+     -0.1f, 0.0f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  // index 2
+     -0.1f, 0.0f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 6
+     -0.1f, 0.0f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 6
+     -0.1f, 1.5f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  // index 4
+     -0.1f, 1.5f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 0
+
+     //Right Face         //Positive X Normal
+      0.1f, 1.5f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 1
+      0.1f, 0.0f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  // index 3
+      0.1f, 0.0f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 7
+      0.1f, 0.0f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 7
+      0.1f, 1.5f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  // index 5
+      0.1f, 1.5f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 1
+
+      //Bottom Face        //Negative Y Normal
+     -0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,  // index 2
+      0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,  // index 3
+      0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,  // index 7
+      0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,  // index 7
+     -0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,  // index 6
+     -0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,  // index 2
+
+       //Top Face           //Positive Y Normal
+     -0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,  // index 0
+      0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,  // index 1
+      0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  // index 5
+      0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  // index 5
+     -0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,  // index 4
+     -0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f   // index 0
+    };
+
+
+
+    // The arrays are already triangle lists, so they go into the mesh pool with sequential indices
+    mesh.tissueBox = UAddArraysToMeshPool(tissueBoxV, sizeof(tissueBoxV) / sizeof(tissueBoxV[0]));
+    mesh.plane = UAddArraysToMeshPool(planeV, sizeof(planeV) / sizeof(planeV[0]));
+    mesh.tissue = UAddArraysToMeshPool(tissueV, sizeof(tissueV) / sizeof(tissueV[0]));
+    mesh.wristPad = UAddArraysToMeshPool(wristPadV, sizeof(wristPadV) / sizeof(wristPadV[0]));
+    mesh.chargerProng = UAddArraysToMeshPool(chargerProngV, sizeof(chargerProngV) / sizeof(chargerProngV[0]));
+}
+
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    // The hand-built meshes live in the pool with everything else
+    mesh = GLMesh();
+    for (size_t i = 0; i < gMeshPool.size(); ++i)
+    {
+        glDeleteVertexArrays(1, &gMeshPool[i].vao);
+        UDeleteBuffers(1, &gMeshPool[i].vbo);
+        UDeleteBuffers(1, &gMeshPool[i].ebo);
+        UDeleteBuffers(1, &gMeshPool[i].lightmapVbo);
+    }
+    gMeshPool.clear();
+}
+
+
+/*Generate and load the texture*/
+// New repeating, linearly filtered texture object without an image
+static GLuint UCreateTextureObject()
+{
+    GLuint textureId = 0;
+    if (gHasDirectStateAccess)
+    {
+        glCreateTextures(GL_TEXTURE_2D, 1, &textureId);
+        glTextureParameteri(textureId, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTextureParameteri(textureId, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTextureParameteri(textureId, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTextureParameteri(textureId, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        return textureId;
+    }
+
+    glGenTextures(1, &textureId);
+    glBindTexture(GL_TEXTURE_2D, textureId);
+
+    // set the texture wrapping parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    // set texture filtering parameters
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return textureId;
+}
+
+
+/* Gives a texture with immutable storage (or none yet) an image flipped for GL already, and its mipmaps.
+ * Storage can't change size once allocated, so an image of another size or format replaces the texture
+ * object and textureId changes.
+ */
+static bool USetTextureStorageImage(GLuint& textureId, const unsigned char* image, int width, int height, int channels)
+{
+    if (channels != 3 && channels != 4)
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        return false;
+    }
+    const GLenum internalFormat = channels == 3 ? GL_RGB8 : GL_RGBA8;
+    const GLenum format = channels == 3 ? GL_RGB : GL_RGBA;
+
+    GLint isImmutable = GL_FALSE;
+    glGetTextureParameteriv(textureId, GL_TEXTURE_IMMUTABLE_FORMAT, &isImmutable);
+    if (isImmutable)
+    {
+        GLint currentWidth = 0, currentHeight = 0, currentFormat = 0;
+        glGetTextureLevelParameteriv(textureId, 0, GL_TEXTURE_WIDTH, &currentWidth);
+        glGetTextureLevelParameteriv(textureId, 0, GL_TEXTURE_HEIGHT, &currentHeight);
+        glGetTextureLevelParameteriv(textureId, 0, GL_TEXTURE_INTERNAL_FORMAT, &currentFormat);
+        if (currentWidth != width || currentHeight != height || GLenum(currentFormat) != internalFormat)
+        {
+            UDeleteTextures(1, &textureId);
+            textureId = UCreateTextureObject();
+            isImmutable = GL_FALSE;
+        }
+    }
+    if (!isImmutable)
+    {
+        const GLsizei levels = 1 + GLsizei(std::floor(std::log2(float(std::max(std::max(width, height), 1)))));
+        glTextureStorage2D(textureId, levels, internalFormat, width, height);
+    }
+
+    glTextureSubImage2D(textureId, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, image);
+    glGenerateTextureMipmap(textureId);
+    UTrackTexture(textureId, VRAM_TEXTURES, UMipmappedBytes(width, height, channels));
+    return true;
+}
+
+
+/* Replaces the image of a texture (flipped for GL already) and rebuilds its mipmaps. Leaves no texture bound.
+ * With direct state access the texture object is replaced when the size or format changes.
+ */
+static bool USetTextureImage(GLuint& textureId, const unsigned char* image, int width, int height, int channels)
+{
+    if (gHasDirectStateAccess)
+        return USetTextureStorageImage(textureId, image, width, height, channels);
+
+    glBindTexture(GL_TEXTURE_2D, textureId);
+    if (channels == 3)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+    else if (channels == 4)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+    else
+    {
+        cout << "Not implemented to handle image with " << channels << " channels" << endl;
+        glBindTexture(GL_TEXTURE_2D, 0);
+        return false;
+    }
+
+    glGenerateMipmap(GL_TEXTURE_2D);
+    glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    UTrackTexture(textureId, VRAM_TEXTURES, UMipmappedBytes(width, height, channels));
+    return true;
+}
+
+
+// Creates a repeating, linearly filtered texture from an image flipped for GL already
+static bool UCreateTextureFromImage(const unsigned char* image, int width, int height, int channels, GLuint& textureId)
+{
+    textureId = UCreateTextureObject();
+    return USetTextureImage(textureId, image, width, height, channels);
+}
+
+
+bool UCreateTexture(const char* filename, GLuint& textureId)
+{
+    UPROFILE_GPU_SCOPE("Load texture");
+    int width, height, channels;
+    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
+    if (image)
+    {
+        flipImageVertically(image, width, height, channels);
+        const bool isLoaded = UCreateTextureFromImage(image, width, height, channels, textureId);
+        stbi_image_free(image);
+        return isLoaded;
+    }
+
+    // Error loading the image
+    return false;
+}
+
+
+void UDestroyTexture(GLuint textureId)
+{
+    UDeleteTextures(1, &textureId);
+}
+
+
+// Clamps the requested anisotropy to what the driver supports (anisotropic filtering is core in 4.6)
+void UInitializeSamplers(USamplerCache& cache, float anisotropy)
+{
+    cache.keys.clear();
+    cache.samplers.clear();
+    cache.maxAnisotropy = 1.0f;
+    if (GLEW_VERSION_4_6 || GLEW_ARB_texture_filter_anisotropic || GLEW_EXT_texture_filter_anisotropic)
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &cache.maxAnisotropy);
+    cache.anisotropy = glm::clamp(anisotropy, 1.0f, cache.maxAnisotropy);
+    if (anisotropy > 1.0f)
+        cout << "INFO: Anisotropic filtering " << cache.anisotropy << "x (at most " << cache.maxAnisotropy << "x)" << endl;
+}
+
+
+static bool USamplerKeysEqual(const USamplerKey& a, const USamplerKey& b)
+{
+    return a.minFilter == b.minFilter && a.magFilter == b.magFilter && a.wrap == b.wrap && a.anisotropy == b.anisotropy
+        && (a.wrap != GL_CLAMP_TO_BORDER || a.borderColor == b.borderColor);
+}
+
+
+// Sampler object for the key, created the first time the key is asked for
+GLuint UGetSampler(USamplerCache& cache, const USamplerKey& key)
+{
+    for (size_t i = 0; i < cache.keys.size(); ++i)
+    {
+        if (USamplerKeysEqual(cache.keys[i], key))
+            return cache.samplers[i];
+    }
+
+    GLuint sampler = 0;
+    glGenSamplers(1, &sampler);
+    glSamplerParameteri(sampler, GL_TEXTURE_MIN_FILTER, key.minFilter);
+    glSamplerParameteri(sampler, GL_TEXTURE_MAG_FILTER, key.magFilter);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_S, key.wrap);
+    glSamplerParameteri(sampler, GL_TEXTURE_WRAP_T, key.wrap);
+    if (key.wrap == GL_CLAMP_TO_BORDER)
+        glSamplerParameterfv(sampler, GL_TEXTURE_BORDER_COLOR, glm::value_ptr(key.borderColor));
+    if (key.anisotropy > 1.0f)
+        glSamplerParameterf(sampler, GL_TEXTURE_MAX_ANISOTROPY_EXT, key.anisotropy);
+    cache.keys.push_back(key);
+    cache.samplers.push_back(sampler);
+    return sampler;
+}
+
+
+/* How the material textures are sampled: linear, or trilinear with anisotropic filtering on top when
+ * --anisotropy asks for it. Clamping to the border shows magenta, so the edge of the texture stands out.
+ */
+USamplerKey UMaterialSamplerKey(const USamplerCache& cache, GLenum wrap)
+{
+    USamplerKey key;
+    key.minFilter = cache.anisotropy > 1.0f ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR;
+    key.magFilter = GL_LINEAR;
+    key.wrap = wrap;
+    key.anisotropy = cache.anisotropy;
+    key.borderColor = glm::vec4(1.0f, 0.0f, 1.0f, 1.0f);
+    return key;
+}
+
+
+// Samples every material using the texture with the given wrap mode. The texture itself isn't touched.
+void USetTextureWrap(UScene& scene, GLuint textureId, GLenum wrap)
+{
+    const GLuint sampler = UGetSampler(gSamplers, UMaterialSamplerKey(gSamplers, wrap));
+    for (size_t i = 0; i < scene.materials.size(); ++i)
+    {
+        if (scene.materials[i].texture == textureId)
+            scene.materials[i].sampler = sampler;
+    }
+}
+
+
+void UDestroySamplers(USamplerCache& cache)
+{
+    if (!cache.samplers.empty())
+        glDeleteSamplers(GLsizei(cache.samplers.size()), cache.samplers.data());
+    cache.keys.clear();
+    cache.samplers.clear();
+}
+
+
+void UDestroyShaderProgram(GLuint programId)
+{
+    glDeleteProgram(programId);
+}
+
+
+// Lets the driver compile on as many threads as it likes, when it supports parallel shader compilation
+void UInitializeShaderCompiler()
+{
+    gHasParallelShaderCompile = false;
+    if (GLEW_KHR_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFFu);
+        gHasParallelShaderCompile = true;
+    }
+    else if (GLEW_ARB_parallel_shader_compile)
+    {
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFFu);
+        gHasParallelShaderCompile = true;
+    }
+    cout << "INFO: Parallel shader compilation " << (gHasParallelShaderCompile ? "enabled" : "not supported") << endl;
+}
+
+
+/* Starts compiling and linking a program without waiting for either. Drivers that compile in the
+ * background return right away; the program is usable once UPollShaderProgram reports it ready.
+ */
+void USubmitShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, UShaderBuild& build)
+{
+    UPROFILE_SCOPE("Submit shader program");
+    build.submitted = UProfileClock();
+    build.status = BUILD_PENDING;
+    build.program = glCreateProgram();
+    build.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    build.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(build.vertexShader, 1, &vtxShaderSource, NULL);
+    glShaderSource(build.fragmentShader, 1, &fragShaderSource, NULL);
+    glCompileShader(build.vertexShader);
+    glCompileShader(build.fragmentShader);
+
+    // Linking right away lets the driver chain the link onto the compiles
+    glAttachShader(build.program, build.vertexShader);
+    glAttachShader(build.program, build.fragmentShader);
+    glLinkProgram(build.program);
+}
+
+
+/* Returns the build's status. Without 'wait' a program the driver is still working on reports
+ * BUILD_PENDING; with it, or without parallel shader compilation, this blocks until the program is done.
+ * Errors are printed once, and a failed program is deleted.
+ */
+int UPollShaderProgram(UShaderBuild& build, bool wait)
+{
+    if (build.status != BUILD_PENDING)
+        return build.status;
+    if (!wait && gHasParallelShaderCompile)
+    {
+        GLint isComplete = GL_FALSE;
+        glGetProgramiv(build.program, GL_COMPLETION_STATUS_KHR, &isComplete);
+        if (!isComplete)
+            return BUILD_PENDING;
+    }
+    UPROFILE_SCOPE("Finish shader program");
+
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+    build.status = BUILD_READY;
+    glGetShaderiv(build.vertexShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(build.vertexShader, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+        build.status = BUILD_FAILED;
+    }
+    glGetShaderiv(build.fragmentShader, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(build.fragmentShader, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        build.status = BUILD_FAILED;
+    }
+    glGetProgramiv(build.program, GL_LINK_STATUS, &success);
+    if (!success && build.status == BUILD_READY)
+    {
+        glGetProgramInfoLog(build.program, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        build.status = BUILD_FAILED;
+    }
+
+    // The linked program no longer needs its shaders
+    glDetachShader(build.program, build.vertexShader);
+    glDetachShader(build.program, build.fragmentShader);
+    glDeleteShader(build.vertexShader);
+    glDeleteShader(build.fragmentShader);
+    if (build.status == BUILD_FAILED)
+    {
+        glDeleteProgram(build.program);
+        build.program = 0;
+    }
+    return build.status;
+}
+
+
+// Variants are submitted as they are asked for; the fallback goes first, so it is usually ready soonest
+static size_t USubmitShaderVariant(UShaderFamily& family, uint32_t features);
+
+// Joins the named SHADER_SOURCES entries (space separated), taking the --shader-dir text over the built-in one
+static std::string UComposeShaderSource(const char* names)
+{
+    std::string source;
+    const char* name = names;
+    while (*name)
+    {
+        const char* end = strchr(name, ' ');
+        const size_t length = end ? size_t(end - name) : strlen(name);
+        for (size_t i = 0; i < SHADER_SOURCE_COUNT; ++i)
+        {
+            if (strlen(SHADER_SOURCES[i].name) != length || strncmp(SHADER_SOURCES[i].name, name, length) != 0)
+                continue;
+            if (i < gShaderOverrides.size() && !gShaderOverrides[i].empty())
+                source += gShaderOverrides[i];
+            else
+                source += SHADER_SOURCES[i].source;
+        }
+        name += length;
+        while (*name == ' ')
+            ++name;
+    }
+    return source;
+}
+
+/* The fallback is textured, specular, clustered, unshadowed and lit by the flat ambient term: it draws
+ * anything the family is asked for, if not exactly as the real variant will.
+ */
+void UCreateShaderFamily(UShaderFamily& family, const char* name, const char* vertexSources, const char* fragmentSources, uint32_t featureMask, uint32_t fixedFeatures)
+{
+    family.name = name;
+    family.vertexSources = vertexSources;
+    family.fragmentSources = fragmentSources;
+    family.vertexSource = UComposeShaderSource(vertexSources);
+    family.fragmentSource = UComposeShaderSource(fragmentSources);
+    family.featureMask = featureMask;
+    family.fixedFeatures = fixedFeatures;
+    family.keys.clear();
+    family.builds.clear();
+    USubmitShaderVariant(family, SHADER_TEXTURED | SHADER_SPECULAR);
+}
+
+
+// Points a new variant's samplers at their texture units and hands it the probe grid
+static void UInitializeSceneProgram(GLuint programId)
+{
+    glUseProgram(programId);
+    glUniform1i(glGetUniformLocation(programId, "uTexture"), 0);
+    glUniform1i(glGetUniformLocation(programId, "gAlbedo"), 0);
+    glUniform1i(glGetUniformLocation(programId, "gNormal"), 1);
+    glUniform1i(glGetUniformLocation(programId, "gDepth"), 2);
+    glUniform1i(glGetUniformLocation(programId, "gAmbient"), 3);
+    glUniform1i(glGetUniformLocation(programId, "shadowMap"), SHADOW_TEXTURE_UNIT);
+    glUniform1i(glGetUniformLocation(programId, "uLightmap"), LIGHTMAP_TEXTURE_UNIT);
+    if (gProbes.texture)
+        USetProbeUniforms(programId, gProbes);
+    glUseProgram(0);
+}
+
+
+/* Finds or submits the variant for a set of features. Features the family doesn't test are dropped from
+ * the key, so materials that only differ in those share a program.
+ */
+static size_t USubmitShaderVariant(UShaderFamily& family, uint32_t features)
+{
+    const uint32_t key = (features & family.featureMask) | family.fixedFeatures;
+    for (size_t i = 0; i < family.keys.size(); ++i)
+    {
+        if (family.keys[i] == key)
+            return i;
+    }
+
+    // Every feature is defined, as 0 or 1, right after the #version line
+    std::string defines;
+    const char* const names[] = { "FEATURE_TEXTURED", "FEATURE_SPECULAR", "FEATURE_SHADOWED", "FEATURE_LIGHTMAPPED", "FEATURE_PROBES" };
+    for (int i = 0; i < 5; ++i)
+        defines += std::string("#define ") + names[i] + ((key & (1u << i)) ? " 1\n" : " 0\n");
+    defines += "#define DIRECT_LIGHTS " + std::to_string((key & SHADER_DIRECT_LIGHTS) >> SHADER_DIRECT_LIGHTS_SHIFT) + "\n";
+    std::string source = family.fragmentSource;
+    source.insert(source.find('\n') + 1, defines);
+
+    UShaderBuild build;
+    USubmitShaderProgram(family.vertexSource.c_str(), source.c_str(), build);
+    family.keys.push_back(key);
+    family.builds.push_back(build);
+    return family.keys.size() - 1;
+}
+
+
+// Checks on a variant, setting it up the moment it becomes ready
+static int UPollShaderVariant(UShaderFamily& family, size_t index, bool wait)
+{
+    UShaderBuild& build = family.builds[index];
+    if (build.status != BUILD_PENDING)
+        return build.status;
+    const int status = UPollShaderProgram(build, wait);
+    if (status == BUILD_PENDING)
+        return status;
+
+    // On the trace's shader track, from submission until the program was found ready
+    const uint64_t finished = UProfileClock();
+    URecordProfileEvent(gProfiler, family.name, build.submitted, finished, PROFILE_SHADER_TRACK);
+    const double milliseconds = double(finished - build.submitted) / 1e6;
+    if (status == BUILD_READY)
+    {
+        UInitializeSceneProgram(build.program);
+        cout << "INFO: Compiled " << family.name << " shader variant 0x" << hex << family.keys[index] << dec << " in " << milliseconds << " ms" << endl;
+    }
+    else
+        cout << "Failed to compile " << family.name << " shader variant 0x" << hex << family.keys[index] << dec << endl;
+    return status;
+}
+
+
+/* Returns the family's program for a set of features. A variant that is still compiling, or failed to,
+ * is stood in for by the fallback; 0 only if the fallback isn't ready either.
+ */
+GLuint UGetShaderVariant(UShaderFamily& family, uint32_t features)
+{
+    const size_t index = USubmitShaderVariant(family, features);
+    if (UPollShaderVariant(family, index, false) == BUILD_READY)
+        return family.builds[index].program;
+    return UPollShaderVariant(family, 0, false) == BUILD_READY ? family.builds[0].program : 0;
+}
+
+
+// Waits for the family's fallback, which every draw can rely on from then on
+bool UFinishShaderFallback(UShaderFamily& family)
+{
+    return UPollShaderVariant(family, 0, true) == BUILD_READY;
+}
+
+
+// Submits every variant the current scene draws with, so they all compile at once rather than on first use
+void UWarmShaderVariants()
+{
+    bool hasLightmap = false, hasPlain = false;
+    for (size_t i = 0; i < gScene.objects.size(); ++i)
+    {
+        hasLightmap |= gScene.objects[i].lightmapMesh != NO_MESH;
+        hasPlain |= gScene.objects[i].lightmapMesh == NO_MESH;
+    }
+    const uint32_t sceneFeatures = USceneShaderFeatures(gScene.lights);
+    for (size_t i = 0; i < gScene.materials.size(); ++i)
+    {
+        const uint32_t features = sceneFeatures | UMaterialShaderFeatures(gScene.materials[i]);
+        if (hasPlain)
+        {
+            USubmitShaderVariant(gCubeShaders, features);
+            USubmitShaderVariant(gGBufferShaders, features);
+        }
+        if (hasLightmap)
+        {
+            USubmitShaderVariant(gCubeShaders, (features & ~SHADER_PROBES) | SHADER_LIGHTMAPPED);
+            USubmitShaderVariant(gGBufferShaders, (features & ~SHADER_PROBES) | SHADER_LIGHTMAPPED);
+        }
+    }
+    USubmitShaderVariant(gDeferredShaders, sceneFeatures);
+    cout << "INFO: Submitted " << gCubeShaders.keys.size() + gGBufferShaders.keys.size() + gDeferredShaders.keys.size() << " scene shader variants" << endl;
+}
+
+
+void UDestroyShaderFamily(UShaderFamily& family)
+{
+    for (size_t i = 0; i < family.builds.size(); ++i)
+    {
+        // Waiting first, so no shader objects are left behind
+        UPollShaderProgram(family.builds[i], true);
+        UDestroyShaderProgram(family.builds[i].program);
+    }
+    family.keys.clear();
+    family.builds.clear();
+}
+
+
+/* Procedural mesh generation
+ * Each generator sizes its output once from the tessellation parameters and then writes vertices and
+ * indices through raw pointers, so no allocation happens per vertex. Rings are emitted one after the
+ * other and triangulated row by row, which keeps consecutive triangles on recently used vertices.
+ */
+
+// Writes one interleaved vertex and returns the position after it
+static GLfloat* UPutVertex(GLfloat* v, const glm::vec3& position, const glm::vec3& normal, float u, float t)
+{
+    v[0] = position.x; v[1] = position.y; v[2] = position.z;
+    v[3] = normal.x;   v[4] = normal.y;   v[5] = normal.z;
+    v[6] = u;          v[7] = t;
+    return v + FLOATS_PER_VERTEX;
+}
+
+
+// Triangulates a (rows + 1) x (cols + 1) vertex grid starting at vertex 'base'
+static GLuint* UPutGridIndices(GLuint* idx, GLuint base, GLuint rows, GLuint cols)
+{
+    const GLuint stride = cols + 1;
+    for (GLuint r = 0; r < rows; ++r)
+    {
+        for (GLuint c = 0; c < cols; ++c)
+        {
+            const GLuint a = base + r * stride + c;
+            const GLuint b = a + stride;
+            *idx++ = a; *idx++ = a + 1; *idx++ = b;
+            *idx++ = b; *idx++ = a + 1; *idx++ = b + 1;
+        }
+    }
+    return idx;
+}
+
+
+// Raises a tessellation parameter to the smallest count that still makes a closed shape (and never divides by zero)
+static GLuint UClampTessellation(GLuint count, GLuint minimum)
+{
+    return count < minimum ? minimum : count;
+}
+
+
+// Sizes the output for the given vertex and index counts
+static void UResizeMeshData(UMeshData& out, GLuint vertexCount, GLuint indexCount)
+{
+    out.vertices.resize(vertexCount * FLOATS_PER_VERTEX);
+    out.indices.resize(indexCount);
+}
+
+
+// Fills the sine and cosine of 'slices + 1' evenly spaced angles around the Y axis (the last repeats the first for the uv seam)
+static void USliceTable(GLuint slices, std::vector<float>& sines, std::vector<float>& cosines)
+{
+    sines.resize(slices + 1);
+    cosines.resize(slices + 1);
+    const float step = 2.0f * glm::pi<float>() / slices;
+    for (GLuint j = 0; j <= slices; ++j)
+    {
+        sines[j] = sin(j * step);
+        cosines[j] = cos(j * step);
+    }
+    sines[slices] = sines[0];
+    cosines[slices] = cosines[0];
+}
+
+
+/* Revolves a profile around the Y axis. Each profile point is (radius, y, normal radius, normal y, v)
+ * and becomes one ring of 'slices + 1' vertices.
+ */
+static void URevolveProfile(const float* profile, GLuint profileCount, GLuint slices, GLfloat*& v, GLuint*& idx, GLuint& base)
+{
+    std::vector<float> sines, cosines;
+    USliceTable(slices, sines, cosines);
+
+    for (GLuint i = 0; i < profileCount; ++i)
+    {
+        const float* p = profile + i * 5;
+        for (GLuint j = 0; j <= slices; ++j)
+        {
+            const glm::vec3 position(p[0] * sines[j], p[1], p[0] * cosines[j]);
+            const glm::vec3 normal(p[2] * sines[j], p[3], p[2] * cosines[j]);
+            v = UPutVertex(v, position, normal, float(j) / slices, p[4]);
+        }
+    }
+
+    idx = UPutGridIndices(idx, base, profileCount - 1, slices);
+    base += profileCount * (slices + 1);
+}
+
+
+// Flat disc at height y facing up (ny = 1) or down (ny = -1): a center vertex plus a ring, triangulated as a fan
+static void UPutCap(float radius, float y, float ny, GLuint slices, GLfloat*& v, GLuint*& idx, GLuint& base)
+{
+    std::vector<float> sines, cosines;
+    USliceTable(slices, sines, cosines);
+
+    const glm::vec3 normal(0.0f, ny, 0.0f);
+    v = UPutVertex(v, glm::vec3(0.0f, y, 0.0f), normal, 0.5f, 0.5f);
+    for (GLuint j = 0; j <= slices; ++j)
+        v = UPutVertex(v, glm::vec3(radius * sines[j], y, radius * cosines[j]), normal, 0.5f + 0.5f * sines[j], 0.5f + 0.5f * cosines[j]);
+
+    // The ring runs counter-clockwise seen from +Y, so a downward cap takes its fan in reverse
+    const bool up = ny > 0.0f;
+    for (GLuint j = 0; j < slices; ++j)
+    {
+        *idx++ = base;
+        *idx++ = base + (up ? 1 + j : 2 + j);
+        *idx++ = base + (up ? 2 + j : 1 + j);
+    }
+    base += slices + 2;
+}
+
+
+void UGenerateCylinder(float radius, float height, GLuint slices, GLuint stacks, bool caps, UMeshData& out)
+{
+    slices = UClampTessellation(slices, 3);
+    stacks = UClampTessellation(stacks, 1);
+    const GLuint sideVertices = (stacks + 1) * (slices + 1);
+    const GLuint capVertices = caps ? 2 * (slices + 2) : 0;
+    const GLuint capIndices = caps ? 2 * slices * 3 : 0;
+    UResizeMeshData(out, sideVertices + capVertices, stacks * slices * 6 + capIndices);
+
+    std::vector<float> profile((stacks + 1) * 5);
+    for (GLuint i = 0; i <= stacks; ++i)
+    {
+        const float t = float(i) / stacks;
+        float* p = &profile[i * 5];
+        p[0] = radius; p[1] = (t - 0.5f) * height; p[2] = 1.0f; p[3] = 0.0f; p[4] = t;
+    }
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    GLuint base = 0;
+    URevolveProfile(&profile[0], stacks + 1, slices, v, idx, base);
+    if (caps)
+    {
+        UPutCap(radius, -0.5f * height, -1.0f, slices, v, idx, base);
+        UPutCap(radius, 0.5f * height, 1.0f, slices, v, idx, base);
+    }
+}
+
+
+void UGenerateCapsule(float radius, float height, GLuint slices, GLuint stacks, UMeshData& out)
+{
+    slices = UClampTessellation(slices, 3);
+    stacks = UClampTessellation(stacks, 1);
+
+    // Two hemispheres of 'stacks + 1' rings each; the equator rings double as the cylinder band between them
+    const GLuint rings = 2 * (stacks + 1);
+    UResizeMeshData(out, rings * (slices + 1), (rings - 1) * slices * 6);
+
+    const float totalHeight = height + 2.0f * radius;
+    std::vector<float> profile(rings * 5);
+    for (GLuint i = 0; i < rings; ++i)
+    {
+        const bool top = i > stacks;
+        const float phi = glm::half_pi<float>() * (float(top ? i - stacks - 1 : i) / stacks - (top ? 0.0f : 1.0f));
+        const float y = radius * sin(phi) + (top ? 0.5f : -0.5f) * height;
+        float* p = &profile[i * 5];
+        p[0] = radius * cos(phi); p[1] = y; p[2] = cos(phi); p[3] = sin(phi); p[4] = y / totalHeight + 0.5f;
+    }
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    GLuint base = 0;
+    URevolveProfile(&profile[0], rings, slices, v, idx, base);
+}
+
+
+void UGenerateSphere(float radius, GLuint slices, GLuint stacks, UMeshData& out)
+{
+    slices = UClampTessellation(slices, 3);
+    stacks = UClampTessellation(stacks, 2);
+    UResizeMeshData(out, (stacks + 1) * (slices + 1), stacks * slices * 6);
+
+    std::vector<float> profile((stacks + 1) * 5);
+    for (GLuint i = 0; i <= stacks; ++i)
+    {
+        const float t = float(i) / stacks;
+        const float phi = glm::pi<float>() * (t - 0.5f);
+        float* p = &profile[i * 5];
+        p[0] = radius * cos(phi); p[1] = radius * sin(phi); p[2] = cos(phi); p[3] = sin(phi); p[4] = t;
+    }
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    GLuint base = 0;
+    URevolveProfile(&profile[0], stacks + 1, slices, v, idx, base);
+}
+
+
+void UGenerateTorus(float majorRadius, float minorRadius, GLuint slices, GLuint sides, UMeshData& out)
+{
+    slices = UClampTessellation(slices, 3);
+    sides = UClampTessellation(sides, 3);
+    UResizeMeshData(out, (sides + 1) * (slices + 1), sides * slices * 6);
+
+    std::vector<float> profile((sides + 1) * 5);
+    for (GLuint i = 0; i <= sides; ++i)
+    {
+        const float t = float(i) / sides;
+        const float psi = 2.0f * glm::pi<float>() * t;
+        float* p = &profile[i * 5];
+        p[0] = majorRadius + minorRadius * cos(psi); p[1] = minorRadius * sin(psi); p[2] = cos(psi); p[3] = sin(psi); p[4] = t;
+    }
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    GLuint base = 0;
+    URevolveProfile(&profile[0], sides + 1, slices, v, idx, base);
+}
+
+
+void UGenerateRoundedBox(const glm::vec3& halfExtents, float radius, GLuint segments, UMeshData& out)
+{
+    segments = UClampTessellation(segments, 1);
+
+    // Each face is a grid over the box surface; points are pulled onto the rounded shell by
+    // clamping to the inner box and pushing out along the offset direction by the radius
+    const GLuint faceVertices = (segments + 1) * (segments + 1);
+    UResizeMeshData(out, 6 * faceVertices, 6 * segments * segments * 6);
+
+    // Face normal, then the two in-plane axes (u, v) chosen so u x v points along the normal
+    static const float faces[6][9] = {
+        {  0,  0,  1,   1,  0,  0,   0,  1,  0 },
+        {  0,  0, -1,  -1,  0,  0,   0,  1,  0 },
+        {  1,  0,  0,   0,  0, -1,   0,  1,  0 },
+        { -1,  0,  0,   0,  0,  1,   0,  1,  0 },
+        {  0,  1,  0,   1,  0,  0,   0,  0, -1 },
+        {  0, -1,  0,   1,  0,  0,   0,  0,  1 },
+    };
+    const glm::vec3 inner = glm::max(halfExtents - glm::vec3(radius), glm::vec3(0.0f));
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    for (GLuint f = 0; f < 6; ++f)
+    {
+        const glm::vec3 n(faces[f][0], faces[f][1], faces[f][2]);
+        const glm::vec3 du(faces[f][3], faces[f][4], faces[f][5]);
+        const glm::vec3 dv(faces[f][6], faces[f][7], faces[f][8]);
+        for (GLuint r = 0; r <= segments; ++r)
+        {
+            const float tv = float(r) / segments;
+            for (GLuint c = 0; c <= segments; ++c)
+            {
+                const float tu = float(c) / segments;
+                const glm::vec3 onBox = (n + du * (2.0f * tu - 1.0f) + dv * (2.0f * tv - 1.0f)) * halfExtents;
+                const glm::vec3 clamped = glm::clamp(onBox, -inner, inner);
+                const glm::vec3 offset = onBox - clamped;
+                const float len = glm::length(offset);
+                const glm::vec3 normal = len > 0.0f ? offset / len : n;
+                v = UPutVertex(v, clamped + normal * radius, normal, tu, tv);
+            }
+        }
+        idx = UPutGridIndices(idx, f * faceVertices, segments, segments);
+    }
+}
+
+
+bool UGenerateExtrusion(const glm::vec2* profile, GLuint profileCount, float height, bool caps, UMeshData& out)
+{
+    // The profile is a closed, counter-clockwise loop in the XZ plane (seen from +Y). Walls get their own
+    // vertices per edge for flat normals; caps are fan triangulated, so they assume a convex profile.
+    if (profileCount < 3)
+    {
+        cout << "Extrusion profile needs at least 3 points, got " << profileCount << endl;
+        return false;
+    }
+
+    const GLuint capVertices = caps ? 2 * profileCount : 0;
+    const GLuint capIndices = caps ? 2 * (profileCount - 2) * 3 : 0;
+    UResizeMeshData(out, 4 * profileCount + capVertices, 6 * profileCount + capIndices);
+
+    float perimeter = 0.0f;
+    for (GLuint i = 0; i < profileCount; ++i)
+        perimeter += glm::length(profile[(i + 1) % profileCount] - profile[i]);
+
+    GLfloat* v = &out.vertices[0];
+    GLuint* idx = &out.indices[0];
+    const float y0 = -0.5f * height;
+    const float y1 = 0.5f * height;
+    float u = 0.0f;
+    for (GLuint i = 0; i < profileCount; ++i)
+    {
+        const glm::vec2 a = profile[i];
+        const glm::vec2 b = profile[(i + 1) % profileCount];
+        const glm::vec2 edge = b - a;
+        const float len = glm::length(edge);
+        const glm::vec3 normal = len > 0.0f ? glm::vec3(-edge.y, 0.0f, edge.x) / len : glm::vec3(0.0f);
+        const float u1 = u + len / perimeter;
+
+        v = UPutVertex(v, glm::vec3(a.x, y0, a.y), normal, u, 0.0f);
+        v = UPutVertex(v, glm::vec3(b.x, y0, b.y), normal, u1, 0.0f);
+        v = UPutVertex(v, glm::vec3(a.x, y1, a.y), normal, u, 1.0f);
+        v = UPutVertex(v, glm::vec3(b.x, y1, b.y), normal, u1, 1.0f);
+        idx = UPutGridIndices(idx, i * 4, 1, 1);
+        u = u1;
+    }
+
+    if (caps)
+    {
+        GLuint base = 4 * profileCount;
+        for (int side = 0; side < 2; ++side)
+        {
+            const float y = side ? y1 : y0;
+            const glm::vec3 normal(0.0f, side ? 1.0f : -1.0f, 0.0f);
+            for (GLuint i = 0; i < profileCount; ++i)
+                v = UPutVertex(v, glm::vec3(profile[i].x, y, profile[i].y), normal, profile[i].x, profile[i].y);
+            for (GLuint i = 1; i + 1 < profileCount; ++i)
+            {
+                *idx++ = base;
+                *idx++ = base + (side ? i : i + 1);
+                *idx++ = base + (side ? i + 1 : i);
+            }
+            base += profileCount;
+        }
+    }
+    return true;
+}
+
+
+// Uploads generated data into a new mesh pool entry and returns its index
+GLuint UAddToMeshPool(const UMeshData& data)
+{
+    const GLuint meshId = UCreatePoolMesh();
+    UUpdatePoolMesh(meshId, data);
+    return meshId;
+}
+
+
+// Buffer with immutable storage holding 'data', which the GPU only reads from
+static GLuint UCreateStaticBuffer(GLsizeiptr size, const void* data)
+{
+    // Zero sized storage is an error, and the driver may read 'size' bytes from data
+    GLuint buffer = 0;
+    glCreateBuffers(1, &buffer);
+    glNamedBufferStorage(buffer, std::max<GLsizeiptr>(size, 1), size > 0 ? data : NULL, 0);
+    return buffer;
+}
+
+
+// Creates an empty mesh pool entry with the interleaved vertex layout and returns its index
+GLuint UCreatePoolMesh()
+{
+    GLIndexedMesh mesh;
+    mesh.vbo = mesh.ebo = 0;
+    mesh.lightmapVbo = 0;
+    mesh.indices = 0;
+    mesh.boundsMin = mesh.boundsMax = glm::vec3(0.0f);
+
+    // With direct state access only the attribute layout is set up here; UUploadPoolMesh attaches the buffers
+    if (gHasDirectStateAccess)
+    {
+        glCreateVertexArrays(1, &mesh.vao);
+        const GLint sizes[] = { 3, 3, 2 };
+        GLuint offset = 0;
+        for (GLuint attribute = 0; attribute < 3; ++attribute)
+        {
+            glEnableVertexArrayAttrib(mesh.vao, attribute);
+            glVertexArrayAttribFormat(mesh.vao, attribute, sizes[attribute], GL_FLOAT, GL_FALSE, offset);
+            glVertexArrayAttribBinding(mesh.vao, attribute, 0);
+            offset += sizes[attribute] * sizeof(GLfloat);
+        }
+        UAttachDrawIndices(mesh.vao, gDrawRing.drawIndexBuffer);
+        gMeshPool.push_back(mesh);
+        return GLuint(gMeshPool.size() - 1);
+    }
+
+    glGenVertexArrays(1, &mesh.vao);
+    glGenBuffers(1, &mesh.vbo);
+    glGenBuffers(1, &mesh.ebo);
+    glBindVertexArray(mesh.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo);
+
+    const GLint stride = sizeof(GLfloat) * FLOATS_PER_VERTEX;
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(GLfloat) * 3));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(GLfloat) * 6));
+    glEnableVertexAttribArray(2);
+    glBindVertexArray(0);
+    UAttachDrawIndices(mesh.vao, gDrawRing.drawIndexBuffer);
+
+    gMeshPool.push_back(mesh);
+    return GLuint(gMeshPool.size() - 1);
+}
+
+
+// Replaces the contents of a pool mesh, e.g. after regenerating it at a different tessellation
+void UUpdatePoolMesh(GLuint meshId, const UMeshData& data)
+{
+    glm::vec3 boundsMin, boundsMax;
+    UComputeBounds(data, boundsMin, boundsMax);
+    UUploadPoolMesh(meshId, data.vertices.data(), data.vertices.size() / FLOATS_PER_VERTEX, data.indices.data(), data.indices.size(), boundsMin, boundsMax);
+}
+
+
+// Uploads vertex and index data to a pool mesh straight from the given memory (which may be a mapped file)
+void UUploadPoolMesh(GLuint meshId, const GLfloat* vertices, size_t vertexCount, const GLuint* indices, size_t indexCount, const glm::vec3& boundsMin, const glm::vec3& boundsMax)
+{
+    GLIndexedMesh& mesh = gMeshPool[meshId];
+    const GLsizeiptr vertexBytes = GLsizeiptr(vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat));
+    const GLsizeiptr indexBytes = GLsizeiptr(indexCount * sizeof(GLuint));
+
+    if (gHasDirectStateAccess)
+    {
+        // Immutable storage can't be resized, so every upload gets new buffers. GL keeps the old ones alive
+        // until the frames still in flight are done with them.
+        UDeleteBuffers(1, &mesh.vbo);
+        UDeleteBuffers(1, &mesh.ebo);
+        mesh.vbo = UCreateStaticBuffer(vertexBytes, vertices);
+        mesh.ebo = UCreateStaticBuffer(indexBytes, indices);
+        glVertexArrayVertexBuffer(mesh.vao, 0, mesh.vbo, 0, sizeof(GLfloat) * FLOATS_PER_VERTEX);
+        glVertexArrayElementBuffer(mesh.vao, mesh.ebo);
+    }
+    else
+    {
+        glBindVertexArray(mesh.vao);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, indices, GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+    UTrackBuffer(mesh.vbo, VRAM_MESHES, vertexBytes);
+    UTrackBuffer(mesh.ebo, VRAM_MESHES, indexBytes);
+
+    mesh.indices = GLsizei(indexCount);
+    mesh.boundsMin = boundsMin;
+    mesh.boundsMax = boundsMax;
+}
+
+
+// Axis aligned bounding box of the vertex positions
+void UComputeBounds(const UMeshData& data, glm::vec3& boundsMin, glm::vec3& boundsMax)
+{
+    boundsMin = glm::vec3(0.0f);
+    boundsMax = glm::vec3(0.0f);
+    for (size_t i = 0; i < data.vertices.size(); i += FLOATS_PER_VERTEX)
+    {
+        const glm::vec3 position(data.vertices[i], data.vertices[i + 1], data.vertices[i + 2]);
+        boundsMin = i == 0 ? position : glm::min(boundsMin, position);
+        boundsMax = i == 0 ? position : glm::max(boundsMax, position);
+    }
+}
+
+
+// Adds a non-indexed triangle list (interleaved position, normal, uv) to the mesh pool
+GLuint UAddArraysToMeshPool(const GLfloat* vertices, size_t floatCount)
+{
+    UMeshData data;
+    data.vertices.assign(vertices, vertices + floatCount);
+    data.indices.resize(floatCount / FLOATS_PER_VERTEX);
+    for (size_t i = 0; i < data.indices.size(); ++i)
+        data.indices[i] = GLuint(i);
+    return UAddToMeshPool(data);
+}
+
+
+// Picks the level of detail for an object at the given position from its distance to the camera
+GLuint USelectLod(const glm::vec3& position)
+{
+    const float distance = glm::length(position - gCamera.Position);
+    GLuint lod = 0;
+    while (lod < NUM_LODS - 1 && distance > LOD_DISTANCES[lod])
+        ++lod;
+    return lod;
+}
+
+
+/* Mesh importing
+ * Files are memory mapped and parsed in place. OBJ files are split into line aligned chunks that are
+ * parsed on all cores; glTF accessors are read straight out of the mapped buffers.
+ */
+
+bool UMapFile(const char* filename, UMappedFile& file)
+{
+    file.data = NULL;
+    file.size = 0;
+#ifdef _WIN32
+    file.file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    file.mapping = NULL;
+    if (file.file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file.file, &size);
+    file.size = size_t(size.QuadPart);
+    if (file.size > 0)
+    {
+        file.mapping = CreateFileMappingA(file.file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file.mapping)
+            file.data = (const unsigned char*)MapViewOfFile(file.mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!file.data)
+    {
+        UUnmapFile(file);
+        return false;
+    }
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0)
+    {
+        void* data = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            madvise(data, size_t(info.st_size), MADV_SEQUENTIAL);
+            file.data = (const unsigned char*)data;
+            file.size = size_t(info.st_size);
+        }
+    }
+    close(fd);  // The mapping stays valid after the descriptor is closed
+    if (!file.data)
+        return false;
+#endif
+    return true;
+}
+
+
+void UUnmapFile(UMappedFile& file)
+{
+#ifdef _WIN32
+    if (file.data)
+        UnmapViewOfFile(file.data);
+    if (file.mapping)
+        CloseHandle(file.mapping);
+    if (file.file != INVALID_HANDLE_VALUE)
+        CloseHandle(file.file);
+    file.mapping = NULL;
+    file.file = INVALID_HANDLE_VALUE;
+#else
+    if (file.data)
+        munmap((void*)file.data, file.size);
+#endif
+    file.data = NULL;
+    file.size = 0;
+}
+
+
+// Parses a decimal number (optionally signed, with fraction and exponent). Much faster than strtod because
+// it skips locale handling and correct rounding of the last bit, neither of which matters for vertex data.
+// Integers up to 19 digits are exact as long as they fit the double mantissa (2^53).
+static bool UParseDouble(const char*& p, const char* end, double& out)
+{
+    static const double POWERS_OF_TEN[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        ++p;
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+    {
+        if (digits < 19)
+            mantissa = mantissa * 10 + uint64_t(*p - '0');
+        else
+            ++exponent;
+    }
+    if (p < end && *p == '.')
+    {
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits)
+        {
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + uint64_t(*p - '0');
+                --exponent;
+            }
+        }
+    }
+    if (digits == 0)
+        return false;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        ++p;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+            negativeExponent = *p++ == '-';
+        int value = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+            value = value < 10000 ? value * 10 + (*p - '0') : value;
+        exponent += negativeExponent ? -value : value;
+    }
+
+    double result = double(mantissa);
+    while (exponent > 22)
+    {
+        result *= 1e22;
+        exponent -= 22;
+    }
+    while (exponent < -22)
+    {
+        result /= 1e22;
+        exponent += 22;
+    }
+    result = exponent >= 0 ? result * POWERS_OF_TEN[exponent] : result / POWERS_OF_TEN[-exponent];
+
+    out = negative ? -result : result;
+    return true;
+}
+
+
+static bool UParseFloat(const char*& p, const char* end, float& out)
+{
+    double value;
+    if (!UParseDouble(p, end, value))
+        return false;
+    out = float(value);
+    return true;
+}
+
+
+// Parses a signed decimal integer
+static bool UParseInt(const char*& p, const char* end, int& out)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p >= end || *p < '0' || *p > '9')
+        return false;
+
+    int value = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        value = value * 10 + (*p - '0');
+    out = negative ? -value : value;
+    return true;
+}
+
+
+namespace
+{
+    // Per thread results of parsing one chunk of an OBJ file
+    struct UObjChunk
+    {
+        const char* begin;
+        const char* end;
+        std::vector<float> positions, uvs, normals;
+        std::vector<int> corners;   // Triangulated (v, vt, vn) triples of 0-based indices, -1 where missing
+        std::vector<unsigned char> relativeCorners; // Per corner: bit i set when index i is relative to the chunk start, see UParseObjChunk
+        size_t firstPosition, firstUv, firstNormal; // Global offsets, from the counts of the preceding chunks
+        bool valid;                 // False if a corner refers to a statement the file doesn't have
+    };
+}
+
+
+// Appends one triangle corner to the chunk
+static void UPutObjCorner(UObjChunk& chunk, const int* corner, unsigned char relative)
+{
+    chunk.corners.insert(chunk.corners.end(), corner, corner + 3);
+    chunk.relativeCorners.push_back(relative);
+}
+
+
+/* Parses the v, vt, vn and f statements of one chunk. OBJ indices are 1-based; relative (negative) indices
+ * count back from the statements read so far, which may reach into earlier chunks. They are stored as an
+ * offset from the chunk's first statement (negative when they point before it) and flagged, so the merge
+ * step can resolve them once the counts of the preceding chunks are known.
+ */
+static void UParseObjChunk(UObjChunk& chunk)
+{
+    const char* p = chunk.begin;
+    const char* end = chunk.end;
+    int face[3 * 64];
+    unsigned char relative[64];
+
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            ++p;
+        const char* lineEnd = (const char*)memchr(p, '\n', size_t(end - p));
+        if (!lineEnd)
+            lineEnd = end;
+
+        if (lineEnd - p > 2 && p[0] == 'v')
+        {
+            float value;
+            if (p[1] == ' ' || p[1] == '\t')
+            {
+                p += 2;
+                for (int i = 0; i < 3; ++i)
+                    chunk.positions.push_back(UParseFloat(p, lineEnd, value) ? value : 0.0f);
+            }
+            else if (p[1] == 't')
+            {
+                p += 2;
+                for (int i = 0; i < 2; ++i)
+                    chunk.uvs.push_back(UParseFloat(p, lineEnd, value) ? value : 0.0f);
+            }
+            else if (p[1] == 'n')
+            {
+                p += 2;
+                for (int i = 0; i < 3; ++i)
+                    chunk.normals.push_back(UParseFloat(p, lineEnd, value) ? value : 0.0f);
+            }
+        }
+        else if (lineEnd - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+        {
+            p += 2;
+            const int counts[3] = { int(chunk.positions.size() / 3), int(chunk.uvs.size() / 2), int(chunk.normals.size() / 3) };
+            int cornerCount = 0;
+            for (;;)
+            {
+                while (p < lineEnd && (*p == ' ' || *p == '\t' || *p == '\r'))
+                    ++p;
+                if (cornerCount == 64 && p < lineEnd)
+                {
+                    // Triangulate what the buffer holds, then continue the fan from its first and last corners
+                    for (int i = 1; i + 1 < cornerCount; ++i)
+                    {
+                        UPutObjCorner(chunk, face, relative[0]);
+                        UPutObjCorner(chunk, &face[i * 3], relative[i]);
+                        UPutObjCorner(chunk, &face[i * 3 + 3], relative[i + 1]);
+                    }
+                    memcpy(&face[3], &face[63 * 3], 3 * sizeof(int));
+                    relative[1] = relative[63];
+                    cornerCount = 2;
+                }
+                int* corner = &face[cornerCount * 3];
+                corner[0] = corner[1] = corner[2] = 0;
+                if (!UParseInt(p, lineEnd, corner[0]))
+                    break;
+                if (p < lineEnd && *p == '/')
+                {
+                    ++p;
+                    UParseInt(p, lineEnd, corner[1]);
+                    if (p < lineEnd && *p == '/')
+                    {
+                        ++p;
+                        UParseInt(p, lineEnd, corner[2]);
+                    }
+                }
+                relative[cornerCount] = 0;
+                for (int i = 0; i < 3; ++i)
+                {
+                    if (corner[i] < 0)
+                    {
+                        corner[i] += counts[i];
+                        relative[cornerCount] |= 1 << i;
+                    }
+                    else
+                    {
+                        --corner[i];
+                    }
+                }
+                ++cornerCount;
+            }
+
+            // Fan triangulation of the polygon
+            for (int i = 1; i + 1 < cornerCount; ++i)
+            {
+                UPutObjCorner(chunk, face, relative[0]);
+                UPutObjCorner(chunk, &face[i * 3], relative[i]);
+                UPutObjCorner(chunk, &face[i * 3 + 3], relative[i + 1]);
+            }
+        }
+        p = lineEnd + 1;
+    }
+}
+
+
+// Hash of a (position, uv, normal) index triple for vertex de-duplication
+struct UObjCornerHash
+{
+    size_t operator()(const glm::ivec3& c) const
+    {
+        return size_t(c.x) * 73856093u ^ size_t(c.y) * 19349663u ^ size_t(c.z) * 83492791u;
+    }
+};
+
+
+/* Converts the corners of one chunk to 0-based indices into the merged attribute arrays, -1 where a corner
+ * has no uv or normal, and checks them against the statement counts of the whole file.
+ */
+static void UResolveObjChunk(UObjChunk& chunk, const int* counts)
+{
+    const int first[3] = { int(chunk.firstPosition), int(chunk.firstUv), int(chunk.firstNormal) };
+    chunk.valid = true;
+    for (size_t i = 0; i < chunk.relativeCorners.size(); ++i)
+    {
+        int* c = &chunk.corners[i * 3];
+        for (int k = 0; k < 3; ++k)
+        {
+            if (chunk.relativeCorners[i] & (1 << k))
+                c[k] += first[k];
+            else if (k > 0 && c[k] == -1)
+                continue;   // Not given
+            if (c[k] < 0 || c[k] >= counts[k])
+                chunk.valid = false;
+        }
+    }
+}
+
+
+/* Builds the interleaved vertices and indices from the resolved corners of every chunk. Vertices are
+ * de-duplicated across the whole file, and corners without a normal get the area weighted sum of the face
+ * normals around their position, so the mesh doesn't depend on where the file was split.
+ */
+static void UBuildObjMesh(const std::vector<UObjChunk>& chunks, const std::vector<float>& positions, const std::vector<float>& uvs, const std::vector<float>& normals, UMeshData& out)
+{
+    size_t cornerCount = 0;
+    for (size_t i = 0; i < chunks.size(); ++i)
+        cornerCount += chunks[i].relativeCorners.size();
+    out.indices.resize(cornerCount);
+    out.vertices.clear();
+    out.vertices.reserve(cornerCount * FLOATS_PER_VERTEX);
+
+    std::unordered_map<glm::ivec3, GLuint, UObjCornerHash> unique;
+    unique.reserve(cornerCount);
+    std::vector<int> vertexPositions;
+    std::vector<bool> needsNormal;
+    bool anyNeedsNormal = false;
+
+    size_t corner = 0;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+        const std::vector<int>& corners = chunks[i].corners;
+        for (size_t c = 0; c < corners.size(); c += 3, ++corner)
+        {
+            const glm::ivec3 key(corners[c], corners[c + 1], corners[c + 2]);
+            std::pair<std::unordered_map<glm::ivec3, GLuint, UObjCornerHash>::iterator, bool> inserted =
+                unique.insert(std::make_pair(key, GLuint(vertexPositions.size())));
+            if (inserted.second)
+            {
+                for (int k = 0; k < 3; ++k)
+                    out.vertices.push_back(positions[size_t(key.x) * 3 + k]);
+                for (int k = 0; k < 3; ++k)
+                    out.vertices.push_back(key.z >= 0 ? normals[size_t(key.z) * 3 + k] : 0.0f);
+                for (int k = 0; k < 2; ++k)
+                    out.vertices.push_back(key.y >= 0 ? uvs[size_t(key.y) * 2 + k] : 0.0f);
+                vertexPositions.push_back(key.x);
+                needsNormal.push_back(key.z < 0);
+                anyNeedsNormal = anyNeedsNormal || key.z < 0;
+            }
+            out.indices[corner] = inserted.first->second;
+        }
+    }
+    if (!anyNeedsNormal)
+        return;
+
+    // Sum the face normals per position, so vertices split by uv seams still shade smoothly
+    std::vector<glm::vec3> positionNormals(positions.size() / 3, glm::vec3(0.0f));
+    for (size_t t = 0; t + 2 < cornerCount; t += 3)
+    {
+        const int p[3] = { vertexPositions[out.indices[t]], vertexPositions[out.indices[t + 1]], vertexPositions[out.indices[t + 2]] };
+        const glm::vec3 p0 = glm::make_vec3(&positions[size_t(p[0]) * 3]);
+        const glm::vec3 faceNormal = glm::cross(glm::make_vec3(&positions[size_t(p[1]) * 3]) - p0, glm::make_vec3(&positions[size_t(p[2]) * 3]) - p0);
+        for (int k = 0; k < 3; ++k)
+            positionNormals[p[k]] += faceNormal;
+    }
+    for (size_t i = 0; i < needsNormal.size(); ++i)
+    {
+        if (!needsNormal[i])
+            continue;
+        const glm::vec3& sum = positionNormals[vertexPositions[i]];
+        const float length = sqrt(sum.x * sum.x + sum.y * sum.y + sum.z * sum.z);
+        if (length > 0.0f)
+        {
+            GLfloat* n = &out.vertices[i * FLOATS_PER_VERTEX + 3];
+            n[0] = sum.x / length;
+            n[1] = sum.y / length;
+            n[2] = sum.z / length;
+        }
+    }
+}
+
+
+bool UImportObj(const char* filename, UMeshData& out)
+{
+    UMappedFile file;
+    if (!UMapFile(filename, file))
+    {
+        cout << "Failed to open mesh " << filename << endl;
+        return false;
+    }
+
+    // Split into line aligned chunks, one per core (small files are parsed on one thread)
+    const char* text = (const char*)file.data;
+    const size_t minChunkSize = 256 * 1024;
+    size_t chunkCount = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), file.size / minChunkSize));
+    std::vector<UObjChunk> chunks(chunkCount);
+    const char* cursor = text;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        const char* end = text + file.size * (i + 1) / chunkCount;
+        const char* newline = i + 1 < chunkCount ? (const char*)memchr(end, '\n', size_t(text + file.size - end)) : NULL;
+        end = newline ? newline + 1 : text + file.size;
+        chunks[i].begin = cursor;
+        chunks[i].end = end < cursor ? cursor : end;
+        cursor = chunks[i].end;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < chunkCount; ++i)
+        workers.push_back(std::thread(UParseObjChunk, std::ref(chunks[i])));
+    UParseObjChunk(chunks[0]);
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    workers.clear();
+
+    // Merge the attribute arrays, remembering where each chunk's statements start
+    std::vector<float> positions, uvs, normals;
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        chunks[i].firstPosition = positions.size() / 3;
+        chunks[i].firstUv = uvs.size() / 2;
+        chunks[i].firstNormal = normals.size() / 3;
+        positions.insert(positions.end(), chunks[i].positions.begin(), chunks[i].positions.end());
+        uvs.insert(uvs.end(), chunks[i].uvs.begin(), chunks[i].uvs.end());
+        normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+    }
+    UUnmapFile(file);
+
+    // Resolve the indices in parallel, then build one mesh from all chunks
+    const int counts[3] = { int(positions.size() / 3), int(uvs.size() / 2), int(normals.size() / 3) };
+    for (size_t i = 1; i < chunkCount; ++i)
+        workers.push_back(std::thread(UResolveObjChunk, std::ref(chunks[i]), counts));
+    UResolveObjChunk(chunks[0], counts);
+    for (size_t i = 0; i < workers.size(); ++i)
+        workers[i].join();
+    for (size_t i = 0; i < chunkCount; ++i)
+    {
+        if (!chunks[i].valid)
+        {
+            cout << "Failed to parse OBJ " << filename << ": face index out of range" << endl;
+            return false;
+        }
+    }
+
+    UBuildObjMesh(chunks, positions, uvs, normals, out);
+    return !out.indices.empty();
+}
+
+
+/* JSON parsing */
+
+static void USkipJsonSpace(const char*& p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        ++p;
+}
+
+
+static bool UParseJsonString(const char*& p, const char* end, std::string& out)
+{
+    ++p; // Opening quote
+    out.clear();
+    while (p < end && *p != '"')
+    {
+        if (*p == '\\' && p + 1 < end)
+        {
+            ++p;
+            switch (*p)
+            {
+            case 'n': out += '\n'; break;
+            case 't': out += '\t'; break;
+            case 'r': out += '\r'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u':
+            {
+                // Only code points below 0x80 are kept as-is; anything else becomes '?'
+                unsigned code = 0;
+                for (int i = 0; i < 4 && p + 1 < end; ++i)
+                {
+                    const char h = *++p;
+                    code = code * 16 + unsigned(h <= '9' ? h - '0' : (h | 0x20) - 'a' + 10);
+                }
+                out += code < 0x80 ? char(code) : '?';
+            }
+            break;
+            default: out += *p; break;
+            }
+            ++p;
+        }
+        else
+            out += *p++;
+    }
+    if (p >= end)
+        return false;
+    ++p; // Closing quote
+    return true;
+}
+
+
+static bool UParseJsonValue(const char*& p, const char* end, UJsonValue& value, int depth)
+{
+    USkipJsonSpace(p, end);
+    if (p >= end || depth > 64)
+        return false;
+
+    if (*p == '{')
+    {
+        value.type = UJsonValue::OBJECT;
+        ++p;
+        USkipJsonSpace(p, end);
+        if (p < end && *p == '}')
+        {
+            ++p;
+            return true;
+        }
+        while (p < end)
+        {
+            USkipJsonSpace(p, end);
+            value.keys.push_back(std::string());
+            if (p >= end || *p != '"' || !UParseJsonString(p, end, value.keys.back()))
+                return false;
+            USkipJsonSpace(p, end);
+            if (p >= end || *p++ != ':')
+                return false;
+            value.items.push_back(UJsonValue());
+            if (!UParseJsonValue(p, end, value.items.back(), depth + 1))
+                return false;
+            USkipJsonSpace(p, end);
+            if (p < end && *p == ',')
+                ++p;
+            else if (p < end && *p == '}')
+            {
+                ++p;
+                return true;
+            }
+            else
+                return false;
+        }
+        return false;
+    }
+    if (*p == '[')
+    {
+        value.type = UJsonValue::ARRAY;
+        ++p;
+        USkipJsonSpace(p, end);
+        if (p < end && *p == ']')
+        {
+            ++p;
+            return true;
+        }
+        while (p < end)
+        {
+            value.items.push_back(UJsonValue());
+            if (!UParseJsonValue(p, end, value.items.back(), depth + 1))
+                return false;
+            USkipJsonSpace(p, end);
+            if (p < end && *p == ',')
+                ++p;
+            else if (p < end && *p == ']')
+            {
+                ++p;
+                return true;
+            }
+            else
+                return false;
+        }
+        return false;
+    }
+    if (*p == '"')
+    {
+        value.type = UJsonValue::STRING;
+        return UParseJsonString(p, end, value.string);
+    }
+    if (end - p >= 4 && strncmp(p, "true", 4) == 0)
+    {
+        value.type = UJsonValue::BOOLEAN;
+        value.number = 1.0;
+        p += 4;
+        return true;
+    }
+    if (end - p >= 5 && strncmp(p, "false", 5) == 0)
+    {
+        value.type = UJsonValue::BOOLEAN;
+        p += 5;
+        return true;
+    }
+    if (end - p >= 4 && strncmp(p, "null", 4) == 0)
+    {
+        p += 4;
+        return true;
+    }
+
+    // Parsed at full precision, so byte offsets and counts past 2^24 stay exact
+    if (!UParseDouble(p, end, value.number))
+        return false;
+    value.type = UJsonValue::NUMBER;
+    return true;
+}
+
+
+bool UParseJson(const char* text, size_t length, UJsonValue& root)
+{
+    const char* p = text;
+    root = UJsonValue();
+    return UParseJsonValue(p, text + length, root, 0);
+}
+
+
+// Returns the member of a JSON object with the given key, or NULL
+const UJsonValue* UJsonFind(const UJsonValue& object, const char* key)
+{
+    for (size_t i = 0; i < object.keys.size(); ++i)
+    {
+        if (object.keys[i] == key)
+            return &object.items[i];
+    }
+    return NULL;
+}
+
+
+// Reads a numeric member, with a default for missing keys
+static double UJsonNumber(const UJsonValue& object, const char* key, double fallback)
+{
+    const UJsonValue* value = UJsonFind(object, key);
+    return value && (value->type == UJsonValue::NUMBER || value->type == UJsonValue::BOOLEAN) ? value->number : fallback;
+}
+
+
+// Reads a non-negative integer member such as a byte offset or count, with a default for missing keys.
+// Fails on negative, fractional or oversized values instead of truncating them.
+static bool UJsonSize(const UJsonValue& object, const char* key, size_t fallback, size_t& out)
+{
+    const UJsonValue* value = UJsonFind(object, key);
+    out = fallback;
+    if (!value)
+        return true;
+    if (value->type != UJsonValue::NUMBER || value->number < 0.0 || value->number != floor(value->number)
+        || value->number >= double(SIZE_MAX) || value->number > 9007199254740992.0)
+        return false;
+    out = size_t(value->number);
+    return true;
+}
+
+
+/* glTF 2.0 importing */
+
+namespace
+{
+    // A glTF buffer: either a view into a mapped file (.bin or the .glb binary chunk) or decoded base64 data
+    struct UGltfBuffer
+    {
+        const unsigned char* data;
+        size_t size;
+        std::vector<unsigned char> decoded;
+    };
+
+    // Typed, strided view of an accessor inside a buffer
+    struct UGltfAccessor
+    {
+        const unsigned char* data;
+        size_t count;
+        size_t stride;
+        int components;
+        int componentType;
+        bool normalized;
+    };
+}
+
+
+static void UDecodeBase64(const char* text, size_t length, std::vector<unsigned char>& out)
+{
+    unsigned buffer = 0;
+    int bits = 0;
+    for (size_t i = 0; i < length; ++i)
+    {
+        const char c = text[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+') value = 62;
+        else if (c == '/') value = 63;
+        else continue;
+
+        buffer = (buffer << 6) | unsigned(value);
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            out.push_back((unsigned char)((buffer >> bits) & 0xFF));
+        }
+    }
+}
+
+
+static bool UGltfGetAccessor(const UJsonValue& doc, const std::vector<UGltfBuffer>& buffers, int index, UGltfAccessor& out)
+{
+    const UJsonValue* accessors = UJsonFind(doc, "accessors");
+    const UJsonValue* views = UJsonFind(doc, "bufferViews");
+    if (!accessors || !views || index < 0 || size_t(index) >= accessors->items.size())
+        return false;
+
+    const UJsonValue& accessor = accessors->items[index];
+    const UJsonValue* type = UJsonFind(accessor, "type");
+    const int viewIndex = int(UJsonNumber(accessor, "bufferView", -1));
+    if (!type || viewIndex < 0 || size_t(viewIndex) >= views->items.size())
+        return false;
+
+    const std::string& typeName = type->string;
+    out.components = typeName == "SCALAR" ? 1 : typeName == "VEC2" ? 2 : typeName == "VEC3" ? 3 : typeName == "VEC4" ? 4 : 0;
+    out.componentType = int(UJsonNumber(accessor, "componentType", 0));
+    out.normalized = UJsonNumber(accessor, "normalized", 0) != 0.0;
+
+    const int componentSize = out.componentType == 5126 || out.componentType == 5125 ? 4 : out.componentType == 5122 || out.componentType == 5123 ? 2 : 1;
+    const size_t elementSize = size_t(componentSize * out.components);
+    const UJsonValue& view = views->items[viewIndex];
+    size_t bufferIndex, viewOffset, viewLength, accessorOffset;
+    if (!UJsonSize(accessor, "count", 0, out.count) || !UJsonSize(accessor, "byteOffset", 0, accessorOffset)
+        || !UJsonSize(view, "buffer", 0, bufferIndex) || !UJsonSize(view, "byteOffset", 0, viewOffset)
+        || !UJsonSize(view, "byteLength", 0, viewLength) || !UJsonSize(view, "byteStride", elementSize, out.stride))
+        return false;
+    if (out.stride == 0)
+        out.stride = elementSize;
+    if (out.components == 0 || bufferIndex >= buffers.size())
+        return false;
+
+    // Reject accessors that would read past the end of their view or buffer (written so no sum can overflow)
+    const UGltfBuffer& buffer = buffers[bufferIndex];
+    if (viewOffset > buffer.size || viewLength > buffer.size - viewOffset || accessorOffset > viewLength)
+        return false;
+    const size_t available = viewLength - accessorOffset;
+    if (out.count > 0 && (elementSize > available || out.count - 1 > (available - elementSize) / out.stride))
+        return false;
+
+    out.data = buffer.data + viewOffset + accessorOffset;
+    return true;
+}
+
+
+// Reads one component of an accessor element as a float, applying normalization for integer types
+static float UGltfRead(const UGltfAccessor& accessor, size_t element, int component)
+{
+    const unsigned char* p = accessor.data + element * accessor.stride;
+    switch (accessor.componentType)
+    {
+    case 5126: { float f; memcpy(&f, p + component * 4, 4); return f; }
+    case 5121: return accessor.normalized ? p[component] / 255.0f : float(p[component]);
+    case 5120: return accessor.normalized ? std::max(((const signed char*)p)[component] / 127.0f, -1.0f) : float(((const signed char*)p)[component]);
+    case 5123: { uint16_t u; memcpy(&u, p + component * 2, 2); return accessor.normalized ? u / 65535.0f : float(u); }
+    case 5122: { int16_t i; memcpy(&i, p + component * 2, 2); return accessor.normalized ? std::max(i / 32767.0f, -1.0f) : float(i); }
+    case 5125: { uint32_t u; memcpy(&u, p + component * 4, 4); return float(u); }
+    }
+    return 0.0f;
+}
+
+
+// Reads an index accessor element
+static GLuint UGltfReadIndex(const UGltfAccessor& accessor, size_t element)
+{
+    const unsigned char* p = accessor.data + element * accessor.stride;
+    if (accessor.componentType == 5125)
+    {
+        uint32_t u;
+        memcpy(&u, p, 4);
+        return u;
+    }
+    if (accessor.componentType == 5123)
+    {
+        uint16_t u;
+        memcpy(&u, p, 2);
+        return u;
+    }
+    return *p;
+}
+
+
+/* Appends the triangle primitives of one glTF mesh, transformed by the node's world matrix. Returns false if
+ * a primitive references an accessor that fails validation or an index past its vertices. Primitives
+ * without normals get area weighted face normals, as OBJ files do.
+ */
+static bool UGltfAppendMesh(const UJsonValue& doc, const std::vector<UGltfBuffer>& buffers, const UJsonValue& mesh, const glm::mat4& world, UMeshData& out)
+{
+    const UJsonValue* primitives = UJsonFind(mesh, "primitives");
+    if (!primitives)
+        return true;
+
+    const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(world)));
+    for (size_t i = 0; i < primitives->items.size(); ++i)
+    {
+        const UJsonValue& primitive = primitives->items[i];
+        const UJsonValue* attributes = UJsonFind(primitive, "attributes");
+        if (!attributes || UJsonNumber(primitive, "mode", 4) != 4 || !UJsonFind(*attributes, "POSITION"))
+            continue;
+
+        // An accessor that is referenced must be valid; only a missing one falls back to a default
+        UGltfAccessor positions, normals, uvs, indices;
+        const bool hasNormals = UJsonFind(*attributes, "NORMAL") != NULL;
+        const bool hasUvs = UJsonFind(*attributes, "TEXCOORD_0") != NULL;
+        const bool hasIndices = UJsonFind(primitive, "indices") != NULL;
+        if (!UGltfGetAccessor(doc, buffers, int(UJsonNumber(*attributes, "POSITION", -1)), positions)
+            || (hasNormals && (!UGltfGetAccessor(doc, buffers, int(UJsonNumber(*attributes, "NORMAL", -1)), normals) || normals.count != positions.count))
+            || (hasUvs && (!UGltfGetAccessor(doc, buffers, int(UJsonNumber(*attributes, "TEXCOORD_0", -1)), uvs) || uvs.count != positions.count))
+            || (hasIndices && !UGltfGetAccessor(doc, buffers, int(UJsonNumber(primitive, "indices", -1)), indices)))
+            return false;
+
+        // glTF puts the uv origin at the top-left of the image, while textures here are flipped on load, so v is inverted
+        const GLuint base = GLuint(out.vertices.size() / FLOATS_PER_VERTEX);
+        size_t v = out.vertices.size();
+        out.vertices.resize(v + positions.count * FLOATS_PER_VERTEX);
+        for (size_t k = 0; k < positions.count; ++k, v += FLOATS_PER_VERTEX)
+        {
+            GLfloat* vertex = &out.vertices[v];
+            const glm::vec3 position = glm::vec3(world * glm::vec4(UGltfRead(positions, k, 0), UGltfRead(positions, k, 1), UGltfRead(positions, k, 2), 1.0f));
+            glm::vec3 normal(0.0f);
+            if (hasNormals)
+                normal = glm::normalize(normalMatrix * glm::vec3(UGltfRead(normals, k, 0), UGltfRead(normals, k, 1), UGltfRead(normals, k, 2)));
+            UPutVertex(vertex, position, normal, hasUvs ? UGltfRead(uvs, k, 0) : 0.0f, hasUvs ? 1.0f - UGltfRead(uvs, k, 1) : 0.0f);
+        }
+
+        const size_t count = hasIndices ? indices.count : positions.count;
+        if (count % 3 != 0)
+            return false;
+        const size_t firstIndex = out.indices.size();
+        out.indices.resize(firstIndex + count);
+        for (size_t k = 0; k < count; ++k)
+        {
+            const GLuint index = hasIndices ? UGltfReadIndex(indices, k) : GLuint(k);
+            if (index >= positions.count)
+                return false;
+            out.indices[firstIndex + k] = base + index;
+        }
+        if (hasNormals)
+            continue;
+
+        // Sum the face normals into the (zeroed) normals of each triangle's vertices, then normalize
+        for (size_t t = firstIndex; t < out.indices.size(); t += 3)
+        {
+            GLfloat* corner[3];
+            for (int k = 0; k < 3; ++k)
+                corner[k] = &out.vertices[size_t(out.indices[t + k]) * FLOATS_PER_VERTEX];
+            const glm::vec3 p0 = glm::make_vec3(corner[0]);
+            const glm::vec3 faceNormal = glm::cross(glm::make_vec3(corner[1]) - p0, glm::make_vec3(corner[2]) - p0);
+            for (int k = 0; k < 3; ++k)
+            {
+                corner[k][3] += faceNormal.x;
+                corner[k][4] += faceNormal.y;
+                corner[k][5] += faceNormal.z;
+            }
+        }
+        for (size_t k = base; k < out.vertices.size() / FLOATS_PER_VERTEX; ++k)
+        {
+            GLfloat* n = &out.vertices[k * FLOATS_PER_VERTEX + 3];
+            const float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+            if (length > 0.0f)
+            {
+                n[0] /= length;
+                n[1] /= length;
+                n[2] /= length;
+            }
+        }
+    }
+    return true;
+}
+
+
+// Local matrix of a glTF node, from either 'matrix' or translation/rotation/scale
+static glm::mat4 UGltfNodeMatrix(const UJsonValue& node)
+{
+    const UJsonValue* matrix = UJsonFind(node, "matrix");
+    if (matrix && matrix->items.size() == 16)
+    {
+        glm::mat4 m;
+        for (int i = 0; i < 16; ++i)
+            m[i / 4][i % 4] = float(matrix->items[i].number);
+        return m;
+    }
+
+    glm::vec3 translation(0.0f), scale(1.0f);
+    glm::quat rotation(1.0f, 0.0f, 0.0f, 0.0f);
+    const UJsonValue* t = UJsonFind(node, "translation");
+    const UJsonValue* r = UJsonFind(node, "rotation");
+    const UJsonValue* s = UJsonFind(node, "scale");
+    if (t && t->items.size() == 3)
+        translation = glm::vec3(t->items[0].number, t->items[1].number, t->items[2].number);
+    if (r && r->items.size() == 4)
+        rotation = glm::quat(float(r->items[3].number), float(r->items[0].number), float(r->items[1].number), float(r->items[2].number));
+    if (s && s->items.size() == 3)
+        scale = glm::vec3(s->items[0].number, s->items[1].number, s->items[2].number);
+    return glm::translate(translation) * glm::mat4_cast(rotation) * glm::scale(scale);
+}
+
+
+// Appends the meshes of a node and its children; returns false if any of them is invalid
+static bool UGltfAppendNode(const UJsonValue& doc, const std::vector<UGltfBuffer>& buffers, int nodeIndex, const glm::mat4& parent, UMeshData& out, int depth)
+{
+    const UJsonValue* nodes = UJsonFind(doc, "nodes");
+    const UJsonValue* meshes = UJsonFind(doc, "meshes");
+    if (!nodes || nodeIndex < 0 || size_t(nodeIndex) >= nodes->items.size() || depth > 64)
+        return true;
+
+    const UJsonValue& node = nodes->items[nodeIndex];
+    const glm::mat4 world = parent * UGltfNodeMatrix(node);
+    const int meshIndex = int(UJsonNumber(node, "mesh", -1));
+    if (meshes && meshIndex >= 0 && size_t(meshIndex) < meshes->items.size() && !UGltfAppendMesh(doc, buffers, meshes->items[meshIndex], world, out))
+        return false;
+
+    const UJsonValue* children = UJsonFind(node, "children");
+    for (size_t i = 0; children && i < children->items.size(); ++i)
+    {
+        if (!UGltfAppendNode(doc, buffers, int(children->items[i].number), world, out, depth + 1))
+            return false;
+    }
+    return true;
+}
+
+
+bool UImportGltf(const char* filename, UMeshData& out)
+{
+    UMappedFile file;
+    if (!UMapFile(filename, file))
+    {
+        cout << "Failed to open mesh " << filename << endl;
+        return false;
+    }
+
+    // A .glb is a 12 byte header followed by a JSON chunk and an optional binary chunk
+    const char* json = (const char*)file.data;
+    size_t jsonLength = file.size;
+    const unsigned char* binary = NULL;
+    size_t binaryLength = 0;
+    if (file.size >= 20 && memcmp(file.data, "glTF", 4) == 0)
+    {
+        uint32_t chunkLength;
+        memcpy(&chunkLength, file.data + 12, 4);
+        json = (const char*)file.data + 20;
+        jsonLength = std::min<size_t>(chunkLength, file.size - 20);
+        const size_t binaryChunk = 20 + ((size_t(chunkLength) + 3) & ~size_t(3));
+        if (binaryChunk + 8 <= file.size)
+        {
+            memcpy(&chunkLength, file.data + binaryChunk, 4);
+            binary = file.data + binaryChunk + 8;
+            binaryLength = std::min<size_t>(chunkLength, file.size - binaryChunk - 8);
+        }
+    }
+
+    UJsonValue doc;
+    if (!UParseJson(json, jsonLength, doc))
+    {
+        cout << "Failed to parse glTF " << filename << endl;
+        UUnmapFile(file);
+        return false;
+    }
+
+    // Resolve buffers: the .glb binary chunk, external .bin files (mapped) or embedded base64 data
+    const std::string path(filename);
+    const std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+    const UJsonValue* bufferList = UJsonFind(doc, "buffers");
+    const size_t bufferCount = bufferList ? bufferList->items.size() : 0;
+    std::vector<UGltfBuffer> buffers(bufferCount);
+    std::vector<UMappedFile> mappedBuffers;
+    mappedBuffers.reserve(bufferCount);
+    for (size_t i = 0; i < bufferCount; ++i)
+    {
+        UGltfBuffer& buffer = buffers[i];
+        buffer.data = NULL;
+        buffer.size = 0;
+        const UJsonValue* uri = UJsonFind(bufferList->items[i], "uri");
+        if (!uri)
+        {
+            buffer.data = binary;
+            buffer.size = binaryLength;
+        }
+        else if (uri->string.compare(0, 5, "data:") == 0)
+        {
+            const size_t comma = uri->string.find(',');
+            if (comma != std::string::npos)
+                UDecodeBase64(uri->string.data() + comma + 1, uri->string.size() - comma - 1, buffer.decoded);
+            buffer.data = buffer.decoded.empty() ? NULL : buffer.decoded.data();
+            buffer.size = buffer.decoded.size();
+        }
+        else
+        {
+            mappedBuffers.push_back(UMappedFile());
+            if (UMapFile((directory + uri->string).c_str(), mappedBuffers.back()))
+            {
+                buffer.data = mappedBuffers.back().data;
+                buffer.size = mappedBuffers.back().size;
+            }
+            else
+                cout << "Failed to open glTF buffer " << uri->string << endl;
+        }
+    }
+
+    out.vertices.clear();
+    out.indices.clear();
+    bool valid = true;
+    const UJsonValue* scenes = UJsonFind(doc, "scenes");
+    const int sceneIndex = int(UJsonNumber(doc, "scene", 0));
+    if (scenes && sceneIndex >= 0 && size_t(sceneIndex) < scenes->items.size())
+    {
+        const UJsonValue* roots = UJsonFind(scenes->items[sceneIndex], "nodes");
+        for (size_t i = 0; valid && roots && i < roots->items.size(); ++i)
+            valid = UGltfAppendNode(doc, buffers, int(roots->items[i].number), glm::mat4(1.0f), out, 0);
+    }
+    else if (const UJsonValue* meshes = UJsonFind(doc, "meshes"))
+    {
+        // No scene graph: take every mesh untransformed
+        for (size_t i = 0; valid && i < meshes->items.size(); ++i)
+            valid = UGltfAppendMesh(doc, buffers, meshes->items[i], glm::mat4(1.0f), out);
+    }
+
+    for (size_t i = 0; i < mappedBuffers.size(); ++i)
+        UUnmapFile(mappedBuffers[i]);
+    UUnmapFile(file);
+
+    if (!valid)
+    {
+        cout << "Failed to parse glTF " << filename << ": invalid accessor or index" << endl;
+        return false;
+    }
+    return !out.indices.empty();
+}
+
+
+// Picks the importer from the file extension
+bool UImportMesh(const char* filename, UMeshData& out)
+{
+    const std::string path(filename);
+    const std::string extension = path.substr(path.find_last_of('.') + 1);
+    if (extension == "obj" || extension == "OBJ")
+        return UImportObj(filename, out);
+    if (extension == "gltf" || extension == "glb" || extension == "GLTF" || extension == "GLB")
+        return UImportGltf(filename, out);
+
+    cout << "Unsupported mesh format: " << filename << endl;
+    return false;
+}
+
+
+// Imports a file several times and prints the best throughput
+void UBenchmarkImport(const char* filename)
+{
+    UMappedFile file;
+    if (!UMapFile(filename, file))
+    {
+        cout << "Failed to open mesh " << filename << endl;
+        return;
+    }
+    const double megabytes = file.size / (1024.0 * 1024.0);
+    UUnmapFile(file);
+
+    UMeshData mesh;
+    double best = 1e30;
+    const int runs = 5;
+    for (int i = 0; i < runs; ++i)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (!UImportMesh(filename, mesh))
+            return;
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, seconds);
+    }
+
+    cout << "INFO: Imported " << filename << " (" << megabytes << " MB, " << mesh.vertices.size() / FLOATS_PER_VERTEX << " vertices, "
+         << mesh.indices.size() / 3 << " triangles) in " << best * 1000.0 << " ms: " << megabytes / best << " MB/s" << endl;
+
+    // Warm start, as ULoadMesh does it: stat the source, map the cache and touch every page the GL upload
+    // would read. The cache goes to a scratch file, so the user's own cache is left alone.
+    const std::string cachePath = std::string(filename) + ".meshcache.bench";
+    UFileStamp stamp;
+    uint64_t hash;
+    if (!UStatFile(filename, stamp) || !UHashFile(filename, hash) || !UWriteMeshCache(cachePath.c_str(), stamp, hash, mesh))
+        return;
+
+    best = 1e30;
+    for (int i = 0; i < runs; ++i)
+    {
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        UMappedFile cache;
+        const UMeshCacheHeader* header;
+        if (!UStatFile(filename, stamp) || !UOpenMeshCache(cachePath.c_str(), filename, stamp, cache, header))
+            break;
+        volatile unsigned char sink = 0;
+        for (size_t offset = 0; offset < cache.size; offset += 4096)
+            sink = sink + cache.data[offset];
+        UUnmapFile(cache);
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        best = std::min(best, seconds);
+    }
+    remove(cachePath.c_str());
+    if (best < 1e30)
+        cout << "INFO: Warm start from a mesh cache in " << best * 1000.0 << " ms" << endl;
+}
+
+
+/* Binary mesh cache
+ * Layout: UMeshCacheHeader, then the LOD table, vertex array and index array, each 16 byte aligned.
+ * Loading stats the source, maps the cache, checks the header, and passes the mapped arrays straight to
+ * glNamedBufferStorage (glBufferData without direct state access), so a warm start does no parsing and no
+ * intermediate copies. The source is only hashed when its size or modification time changed.
+ */
+
+// 64-bit FNV-1a, consuming eight bytes per step to keep up with the disk
+uint64_t UHashBytes(const unsigned char* data, size_t size)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    for (; i < size; ++i)
+        hash = (hash ^ data[i]) * prime;
+    return hash;
+}
+
+
+bool UHashFile(const char* filename, uint64_t& hash)
+{
+    UMappedFile file;
+    if (!UMapFile(filename, file))
+        return false;
+    hash = UHashBytes(file.data, file.size);
+    UUnmapFile(file);
+    return true;
+}
+
+
+bool UStatFile(const char* filename, UFileStamp& stamp)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &info))
+        return false;
+    stamp.size = uint64_t(info.nFileSizeHigh) << 32 | info.nFileSizeLow;
+    stamp.time = int64_t(uint64_t(info.ftLastWriteTime.dwHighDateTime) << 32 | info.ftLastWriteTime.dwLowDateTime);
+#else
+    struct stat info;
+    if (stat(filename, &info) != 0)
+        return false;
+    stamp.size = uint64_t(info.st_size);
+#ifdef __linux__
+    stamp.time = int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+#else
+    stamp.time = int64_t(info.st_mtime);
+#endif
+#endif
+    return true;
+}
+
+
+// The cache is little-endian on disk and used in place, so it is only used on little-endian hosts
+static bool UIsLittleEndian()
+{
+    const uint16_t probe = 1;
+    unsigned char first;
+    memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+
+static uint64_t UAlign16(uint64_t offset)
+{
+    return (offset + 15) & ~uint64_t(15);
+}
+
+
+static bool UWritePadding(FILE* out, uint64_t bytes)
+{
+    static const unsigned char zeros[16] = { 0 };
+    return bytes == 0 || fwrite(zeros, size_t(bytes), 1, out) == 1;
+}
+
+
+bool UWriteMeshCache(const char* filename, const UFileStamp& source, uint64_t contentHash, const UMeshData& data)
+{
+    if (!UIsLittleEndian())
+        return false;
+
+    UMeshCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "UMSH", 4);
+    header.version = MESH_CACHE_VERSION;
+    header.contentHash = contentHash;
+    header.sourceSize = source.size;
+    header.sourceTime = source.time;
+    header.vertexCount = uint32_t(data.vertices.size() / FLOATS_PER_VERTEX);
+    header.indexCount = uint32_t(data.indices.size());
+    header.floatsPerVertex = FLOATS_PER_VERTEX;
+
+    // Imported meshes have a single level; the table leaves room for simplified ones
+    const UMeshCacheLod lods[] = { { 0, header.indexCount, 1e30f, 0 } };
+    header.lodCount = sizeof(lods) / sizeof(lods[0]);
+
+    glm::vec3 boundsMin, boundsMax;
+    UComputeBounds(data, boundsMin, boundsMax);
+    memcpy(header.boundsMin, glm::value_ptr(boundsMin), sizeof(header.boundsMin));
+    memcpy(header.boundsMax, glm::value_ptr(boundsMax), sizeof(header.boundsMax));
+
+    header.lodOffset = UAlign16(sizeof(header));
+    header.vertexOffset = UAlign16(header.lodOffset + sizeof(lods));
+    header.indexOffset = UAlign16(header.vertexOffset + data.vertices.size() * sizeof(GLfloat));
+
+    // Write to a temporary file and rename it, so a crash never leaves a truncated cache behind
+    const std::string temporary = std::string(filename) + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (!out)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && UWritePadding(out, header.lodOffset - sizeof(header));
+    ok = ok && fwrite(lods, sizeof(lods), 1, out) == 1;
+    ok = ok && UWritePadding(out, header.vertexOffset - header.lodOffset - sizeof(lods));
+    ok = ok && fwrite(data.vertices.data(), sizeof(GLfloat), data.vertices.size(), out) == data.vertices.size();
+    ok = ok && UWritePadding(out, header.indexOffset - header.vertexOffset - data.vertices.size() * sizeof(GLfloat));
+    ok = ok && fwrite(data.indices.data(), sizeof(GLuint), data.indices.size(), out) == data.indices.size();
+    ok = fclose(out) == 0 && ok;
+
+    if (ok)
+    {
+        remove(filename);
+        ok = rename(temporary.c_str(), filename) == 0;
+    }
+    if (!ok)
+    {
+        remove(temporary.c_str());
+        cout << "Failed to write mesh cache " << filename << endl;
+    }
+    return ok;
+}
+
+
+/* Maps a cache file and checks that it is well formed and was built from the source's current contents. On
+ * success the file stays mapped. When the source's size and modification time match the header, the source
+ * isn't read; otherwise it is hashed, and a cache whose hash still matches is restamped, so e.g. a checkout
+ * that only touched the file costs one hash rather than one per run.
+ * The arrays go to the GL unchanged, so every index is checked against the vertex count here: a corrupt
+ * cache must not make the GPU read past the vertex buffer.
+ */
+bool UOpenMeshCache(const char* filename, const char* sourceFilename, const UFileStamp& source, UMappedFile& file, const UMeshCacheHeader*& header)
+{
+    if (!UIsLittleEndian() || !UMapFile(filename, file))
+        return false;
+
+    header = (const UMeshCacheHeader*)file.data;
+    if (file.size < sizeof(UMeshCacheHeader))
+    {
+        UUnmapFile(file);
+        return false;
+    }
+
+    // Offsets are compared before sizes are subtracted from the file size, so no sum can overflow
+    const uint64_t lodBytes = uint64_t(header->lodCount) * sizeof(UMeshCacheLod);
+    const uint64_t vertexBytes = uint64_t(header->vertexCount) * FLOATS_PER_VERTEX * sizeof(GLfloat);
+    const uint64_t indexBytes = uint64_t(header->indexCount) * sizeof(GLuint);
+    bool valid = memcmp(header->magic, "UMSH", 4) == 0
+        && header->version == MESH_CACHE_VERSION
+        && header->floatsPerVertex == FLOATS_PER_VERTEX
+        && header->indexCount % 3 == 0
+        && header->lodCount > 0
+        && header->lodOffset % 16 == 0 && header->lodOffset <= file.size && lodBytes <= file.size - header->lodOffset
+        && header->vertexOffset % 16 == 0 && header->vertexOffset <= file.size && vertexBytes <= file.size - header->vertexOffset
+        && header->indexOffset % 16 == 0 && header->indexOffset <= file.size && indexBytes <= file.size - header->indexOffset;
+
+    const bool stamped = valid && header->sourceSize == source.size && header->sourceTime == source.time;
+    uint64_t contentHash = 0;
+    if (valid && !stamped)
+        valid = UHashFile(sourceFilename, contentHash) && header->contentHash == contentHash;
+
+    if (valid)
+    {
+        const UMeshCacheLod* lods = (const UMeshCacheLod*)(file.data + header->lodOffset);
+        for (uint32_t i = 0; valid && i < header->lodCount; ++i)
+            valid = lods[i].firstIndex % 3 == 0 && lods[i].indexCount % 3 == 0 && lods[i].firstIndex <= header->indexCount
+                && lods[i].indexCount <= header->indexCount - lods[i].firstIndex;
+
+        const GLuint* indices = (const GLuint*)(file.data + header->indexOffset);
+        GLuint largest = 0;
+        for (uint32_t i = 0; i < header->indexCount; ++i)
+            largest = std::max(largest, indices[i]);
+        valid = valid && (header->indexCount == 0 || largest < header->vertexCount);
+    }
+    if (!valid)
+    {
+        cout << "Ignoring stale or corrupt mesh cache " << filename << endl;
+        UUnmapFile(file);
+        return false;
+    }
+
+    if (!stamped)
+    {
+        // Best effort: if the header can't be rewritten, the next run just hashes the source again
+        UMeshCacheHeader restamped = *header;
+        restamped.sourceSize = source.size;
+        restamped.sourceTime = source.time;
+        if (FILE* out = fopen(filename, "r+b"))
+        {
+            fwrite(&restamped, sizeof(restamped), 1, out);
+            fclose(out);
+        }
+    }
+    return true;
+}
+
+
+/* Loads a mesh file into a new pool entry. A valid cache next to the file is uploaded directly from its
+ * mapping; otherwise the file is imported and the cache (re)written for the next run.
+ */
+bool ULoadMesh(const char* filename, GLuint& meshId)
+{
+    UFileStamp stamp;
+    if (!UStatFile(filename, stamp))
+    {
+        cout << "Failed to open mesh " << filename << endl;
+        return false;
+    }
+
+    const std::string cachePath = std::string(filename) + ".meshcache";
+    UMappedFile cache;
+    const UMeshCacheHeader* header;
+    if (UOpenMeshCache(cachePath.c_str(), filename, stamp, cache, header))
+    {
+        meshId = UCreatePoolMesh();
+        UUploadPoolMesh(meshId, (const GLfloat*)(cache.data + header->vertexOffset), header->vertexCount,
+            (const GLuint*)(cache.data + header->indexOffset), header->indexCount,
+            glm::make_vec3(header->boundsMin), glm::make_vec3(header->boundsMax));
+        UUnmapFile(cache);
+        return true;
+    }
+
+    // Hashed before importing, so a file that changes meanwhile isn't cached under its new contents
+    uint64_t hash;
+    if (!UHashFile(filename, hash))
+    {
+        cout << "Failed to open mesh " << filename << endl;
+        return false;
+    }
+    UMeshData data;
+    if (!UImportMesh(filename, data))
+        return false;
+    UWriteMeshCache(cachePath.c_str(), stamp, hash, data);
+    meshId = UAddToMeshPool(data);
+    return true;
+}
+
+
+/* Scene files
+ * The JSON form is for authoring; --compile-scene turns it into the binary form, which is the same records
+ * written back to back and loads with a handful of copies. Both produce a USceneDesc, which
+ * UInstantiateScene turns into GL resources and the flat arrays URender walks.
+ */
+
+// Adds a string to the scene's string table and returns its offset
+static uint32_t UAddSceneString(USceneDesc& desc, const std::string& text)
+{
+    const uint32_t offset = uint32_t(desc.strings.size());
+    desc.strings += text;
+    desc.strings += '\0';
+    return offset;
+}
+
+
+static const char* USceneString(const USceneDesc& desc, uint32_t offset)
+{
+    return offset < desc.strings.size() ? desc.strings.c_str() + offset : "";
+}
+
+
+// Reads a 3 component array member into 'out', keeping 'out' as the default when it is missing
+static void UJsonVec3(const UJsonValue& object, const char* key, float* out)
+{
+    const UJsonValue* value = UJsonFind(object, key);
+    if (value && value->type == UJsonValue::NUMBER)
+        out[0] = out[1] = out[2] = float(value->number);
+    else if (value && value->items.size() == 3)
+    {
+        for (int i = 0; i < 3; ++i)
+            out[i] = float(value->items[i].number);
+    }
+}
+
+
+static std::string UJsonString(const UJsonValue& object, const char* key)
+{
+    const UJsonValue* value = UJsonFind(object, key);
+    return value && value->type == UJsonValue::STRING ? value->string : std::string();
+}
+
+
+// Maps the names (string table offsets) of a record list to their indices; the first of duplicate names wins
+template <typename Record>
+static void UIndexSceneRecords(const USceneDesc& desc, const std::vector<Record>& records, std::unordered_map<std::string, int>& index)
+{
+    index.clear();
+    index.reserve(records.size());
+    for (size_t i = 0; i < records.size(); ++i)
+        index.insert(std::make_pair(std::string(USceneString(desc, records[i].name)), int(i)));
+}
+
+
+// Index of the record with the given name, or -1
+static int UFindSceneRecord(const std::unordered_map<std::string, int>& index, const std::string& name)
+{
+    const std::unordered_map<std::string, int>::const_iterator found = index.find(name);
+    return found != index.end() ? found->second : -1;
+}
+
+
+bool UParseSceneJson(const UJsonValue& root, USceneDesc& desc)
+{
+    desc = USceneDesc();
+    desc.cameraPosition[0] = 1.0f;
+    desc.cameraPosition[1] = 1.0f;
+    desc.cameraPosition[2] = 8.0f;
+    UJsonVec3(root, "camera", desc.cameraPosition);
+    desc.ambientStrength = float(UJsonNumber(root, "ambientStrength", 0.5));
+
+    static const char* const SHAPES[] = { "builtin", "file", "cylinder", "capsule", "sphere", "torus", "roundedBox", "extrusion" };
+    const UJsonValue* meshes = UJsonFind(root, "meshes");
+    for (size_t i = 0; meshes && i < meshes->items.size(); ++i)
+    {
+        const UJsonValue& mesh = meshes->items[i];
+        USceneMeshDesc record;
+        memset(&record, 0, sizeof(record));
+        record.name = UAddSceneString(desc, UJsonString(mesh, "name"));
+
+        const std::string shape = UJsonString(mesh, "shape");
+        record.kind = MESH_BUILTIN;
+        for (uint32_t k = 0; k < sizeof(SHAPES) / sizeof(SHAPES[0]); ++k)
+        {
+            if (shape == SHAPES[k])
+                record.kind = k;
+        }
+        if (UJsonFind(mesh, "file"))
+            record.kind = MESH_FILE;
+        record.source = UAddSceneString(desc, record.kind == MESH_FILE ? UJsonString(mesh, "file") : UJsonString(mesh, "builtin"));
+
+        switch (record.kind)
+        {
+        case MESH_CYLINDER:
+        case MESH_CAPSULE:
+            record.params[0] = float(UJsonNumber(mesh, "radius", 0.5));
+            record.params[1] = float(UJsonNumber(mesh, "height", 1.0));
+            break;
+        case MESH_SPHERE:
+            record.params[0] = float(UJsonNumber(mesh, "radius", 0.5));
+            break;
+        case MESH_TORUS:
+            record.params[0] = float(UJsonNumber(mesh, "majorRadius", 0.5));
+            record.params[1] = float(UJsonNumber(mesh, "minorRadius", 0.15));
+            break;
+        case MESH_ROUNDED_BOX:
+            record.params[0] = record.params[1] = record.params[2] = 0.5f;
+            UJsonVec3(mesh, "halfExtents", record.params);
+            record.params[3] = float(UJsonNumber(mesh, "radius", 0.1));
+            break;
+        case MESH_EXTRUSION:
+        {
+            record.params[0] = float(UJsonNumber(mesh, "height", 1.0));
+            record.firstProfilePoint = uint32_t(desc.profilePoints.size());
+            const UJsonValue* profile = UJsonFind(mesh, "profile");
+            for (size_t k = 0; profile && k < profile->items.size(); ++k)
+            {
+                const UJsonValue& point = profile->items[k];
+                if (point.items.size() == 2)
+                    desc.profilePoints.push_back(glm::vec2(point.items[0].number, point.items[1].number));
+            }
+            record.profilePointCount = uint32_t(desc.profilePoints.size()) - record.firstProfilePoint;
+        }
+        break;
+        }
+        desc.meshes.push_back(record);
+    }
+
+    const UJsonValue* textures = UJsonFind(root, "textures");
+    for (size_t i = 0; textures && i < textures->items.size(); ++i)
+    {
+        USceneTextureDesc record;
+        record.name = UAddSceneString(desc, UJsonString(textures->items[i], "name"));
+        record.file = UAddSceneString(desc, UJsonString(textures->items[i], "file"));
+        desc.textures.push_back(record);
+    }
+
+    // References are resolved through name indices, so loading stays linear in the scene size
+    std::unordered_map<std::string, int> textureIndex, meshIndex, materialIndex, objectIndex;
+    UIndexSceneRecords(desc, desc.textures, textureIndex);
+    UIndexSceneRecords(desc, desc.meshes, meshIndex);
+
+    const UJsonValue* materials = UJsonFind(root, "materials");
+    for (size_t i = 0; materials && i < materials->items.size(); ++i)
+    {
+        const UJsonValue& material = materials->items[i];
+        USceneMaterialDesc record;
+        record.name = UAddSceneString(desc, UJsonString(material, "name"));
+        record.texture = UFindSceneRecord(textureIndex, UJsonString(material, "texture"));
+        record.specularIntensity = float(UJsonNumber(material, "specularIntensity", 1.0));
+        record.highlightSize = float(UJsonNumber(material, "highlightSize", 30.0));
+        desc.materials.push_back(record);
+    }
+
+    UIndexSceneRecords(desc, desc.materials, materialIndex);
+
+    const UJsonValue* objects = UJsonFind(root, "objects");
+    for (size_t i = 0; objects && i < objects->items.size(); ++i)
+    {
+        const UJsonValue& object = objects->items[i];
+        const std::string name = UJsonString(object, "name");
+        const int mesh = UFindSceneRecord(meshIndex, UJsonString(object, "mesh"));
+        const int material = UFindSceneRecord(materialIndex, UJsonString(object, "material"));
+        if (mesh < 0 || material < 0)
+        {
+            cout << "Scene object '" << name << "' references an unknown mesh or material" << endl;
+            return false;
+        }
+
+        USceneObjectDesc record;
+        record.name = UAddSceneString(desc, name);
+        record.mesh = uint32_t(mesh);
+        record.material = uint32_t(material);
+        record.parent = -1;
+        record.position[0] = record.position[1] = record.position[2] = 0.0f;
+        record.scale[0] = record.scale[1] = record.scale[2] = 1.0f;
+        record.rotationAxis[0] = 0.0f;
+        record.rotationAxis[1] = 1.0f;
+        record.rotationAxis[2] = 0.0f;
+        record.rotationAngle = 0.0f;
+        UJsonVec3(object, "position", record.position);
+        UJsonVec3(object, "scale", record.scale);
+        if (const UJsonValue* rotation = UJsonFind(object, "rotation"))
+        {
+            UJsonVec3(*rotation, "axis", record.rotationAxis);
+            record.rotationAngle = float(UJsonNumber(*rotation, "angle", 0.0));
+        }
+        desc.objects.push_back(record);
+    }
+
+    // Parents are resolved once every object is known, so they may be listed after their children
+    UIndexSceneRecords(desc, desc.objects, objectIndex);
+    for (size_t i = 0; objects && i < objects->items.size(); ++i)
+    {
+        const std::string parent = UJsonString(objects->items[i], "parent");
+        if (parent.empty())
+            continue;
+        desc.objects[i].parent = UFindSceneRecord(objectIndex, parent);
+        if (desc.objects[i].parent < 0)
+        {
+            cout << "Scene object '" << USceneString(desc, desc.objects[i].name) << "' has an unknown parent '" << parent << "'" << endl;
+            return false;
+        }
+    }
+
+    const UJsonValue* lights = UJsonFind(root, "lights");
+    for (size_t i = 0; lights && i < lights->items.size(); ++i)
+    {
+        const UJsonValue& light = lights->items[i];
+        USceneLightDesc record;
+        record.position[0] = record.position[1] = record.position[2] = 0.0f;
+        record.color[0] = record.color[1] = record.color[2] = 1.0f;
+        UJsonVec3(light, "position", record.position);
+        UJsonVec3(light, "color", record.color);
+        record.scale = float(UJsonNumber(light, "scale", 0.1));
+        record.orbit = UJsonNumber(light, "orbit", 0) != 0.0 ? 1 : 0;
+        record.radius = float(UJsonNumber(light, "radius", 0.0));
+        record.shadow = UJsonNumber(light, "shadow", 0) != 0.0 ? 1 : 0;
+        desc.lights.push_back(record);
+    }
+    return true;
+}
+
+
+// Copies 'count' records of type T out of a mapped scene file
+template <typename T>
+static bool UReadSceneRecords(const UMappedFile& file, size_t& offset, uint32_t count, std::vector<T>& out)
+{
+    const size_t bytes = size_t(count) * sizeof(T);
+    if (offset + bytes > file.size)
+        return false;
+    out.resize(count);
+    if (bytes)
+        memcpy(&out[0], file.data + offset, bytes);
+    offset += bytes;
+    return true;
+}
+
+
+bool ULoadSceneDesc(const char* filename, USceneDesc& desc)
+{
+    UMappedFile file;
+    if (!UMapFile(filename, file))
+    {
+        cout << "Failed to open scene " << filename << endl;
+        return false;
+    }
+
+    bool ok;
+    USceneFileHeader header;
+    if (file.size >= sizeof(header) && memcmp(file.data, "USCN", 4) == 0)
+    {
+        memcpy(&header, file.data, sizeof(header));
+        size_t offset = sizeof(header);
+        ok = header.version == SCENE_FILE_VERSION
+            && UReadSceneRecords(file, offset, header.meshCount, desc.meshes)
+            && UReadSceneRecords(file, offset, header.textureCount, desc.textures)
+            && UReadSceneRecords(file, offset, header.materialCount, desc.materials)
+            && UReadSceneRecords(file, offset, header.objectCount, desc.objects)
+            && UReadSceneRecords(file, offset, header.lightCount, desc.lights)
+            && UReadSceneRecords(file, offset, header.profilePointCount, desc.profilePoints)
+            && offset + header.stringBytes <= file.size;
+        if (ok)
+        {
+            desc.strings.assign((const char*)file.data + offset, header.stringBytes);
+            memcpy(desc.cameraPosition, header.cameraPosition, sizeof(desc.cameraPosition));
+            desc.ambientStrength = header.ambientStrength;
+        }
+    }
+    else
+    {
+        UJsonValue root;
+        ok = UParseJson((const char*)file.data, file.size, root) && UParseSceneJson(root, desc);
+    }
+    UUnmapFile(file);
+
+    // Reject out of range references, so the renderer can index without checks
+    for (size_t i = 0; ok && i < desc.objects.size(); ++i)
+        ok = desc.objects[i].mesh < desc.meshes.size() && desc.objects[i].material < desc.materials.size()
+            && desc.objects[i].parent < int32_t(desc.objects.size());
+    for (size_t i = 0; ok && i < desc.materials.size(); ++i)
+        ok = desc.materials[i].texture < int32_t(desc.textures.size());
+    for (size_t i = 0; ok && i < desc.meshes.size(); ++i)
+        ok = desc.meshes[i].firstProfilePoint + desc.meshes[i].profilePointCount <= desc.profilePoints.size();
+
+    if (!ok)
+        cout << "Failed to load scene " << filename << endl;
+    return ok;
+}
+
+
+bool UWriteSceneBinary(const char* filename, const USceneDesc& desc)
+{
+    USceneFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "USCN", 4);
+    header.version = SCENE_FILE_VERSION;
+    header.meshCount = uint32_t(desc.meshes.size());
+    header.textureCount = uint32_t(desc.textures.size());
+    header.materialCount = uint32_t(desc.materials.size());
+    header.objectCount = uint32_t(desc.objects.size());
+    header.lightCount = uint32_t(desc.lights.size());
+    header.profilePointCount = uint32_t(desc.profilePoints.size());
+    header.stringBytes = uint32_t(desc.strings.size());
+    memcpy(header.cameraPosition, desc.cameraPosition, sizeof(header.cameraPosition));
+    header.ambientStrength = desc.ambientStrength;
+
+    FILE* out = fopen(filename, "wb");
+    if (!out)
+    {
+        cout << "Failed to write scene " << filename << endl;
+        return false;
+    }
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(desc.meshes.data(), sizeof(USceneMeshDesc), desc.meshes.size(), out);
+    fwrite(desc.textures.data(), sizeof(USceneTextureDesc), desc.textures.size(), out);
+    fwrite(desc.materials.data(), sizeof(USceneMaterialDesc), desc.materials.size(), out);
+    fwrite(desc.objects.data(), sizeof(USceneObjectDesc), desc.objects.size(), out);
+    fwrite(desc.lights.data(), sizeof(USceneLightDesc), desc.lights.size(), out);
+    fwrite(desc.profilePoints.data(), sizeof(glm::vec2), desc.profilePoints.size(), out);
+    fwrite(desc.strings.data(), 1, desc.strings.size(), out);
+    const bool ok = !ferror(out);
+    fclose(out);
+
+    cout << "INFO: Compiled scene " << filename << " (" << desc.objects.size() << " objects)" << endl;
+    return ok;
+}
+
+
+// Creates the mesh pool entries for one scene mesh, at every level of detail for generated shapes
+static bool UInstantiateSceneMesh(const USceneDesc& desc, const USceneMeshDesc& record, const std::string& directory, USceneMesh& mesh)
+{
+    const std::string source = USceneString(desc, record.source);
+    const float* params = record.params;
+    UMeshData data;
+    for (int lod = 0; lod < NUM_LODS; ++lod)
+    {
+        const GLuint slices = LOD_SLICES[lod];
+        switch (record.kind)
+        {
+        case MESH_BUILTIN:
+        {
+            const GLuint builtins[] = { gMesh.tissueBox, gMesh.plane, gMesh.tissue, gMesh.wristPad, gMesh.chargerProng };
+            const char* const names[] = { "tissueBox", "plane", "tissue", "wristPad", "chargerProng" };
+            for (int i = 0; i < 5; ++i)
+            {
+                if (source == names[i])
+                {
+                    mesh.lods[0] = mesh.lods[1] = mesh.lods[2] = builtins[i];
+                    return true;
+                }
+            }
+            cout << "Unknown built-in mesh '" << source << "'" << endl;
+            return false;
+        }
+        case MESH_FILE:
+            if (!ULoadMesh((directory + source).c_str(), mesh.lods[0]))
+                return false;
+            mesh.lods[1] = mesh.lods[2] = mesh.lods[0];
+            return true;
+        case MESH_CYLINDER:
+            UGenerateCylinder(params[0], params[1], slices, 1, true, data);
+            break;
+        case MESH_CAPSULE:
+            UGenerateCapsule(params[0], params[1], slices, slices / 4, data);
+            break;
+        case MESH_SPHERE:
+            UGenerateSphere(params[0], slices, slices / 2, data);
+            break;
+        case MESH_TORUS:
+            UGenerateTorus(params[0], params[1], slices, slices / 2, data);
+            break;
+        case MESH_ROUNDED_BOX:
+            UGenerateRoundedBox(glm::vec3(params[0], params[1], params[2]), params[3], slices / 4, data);
+            break;
+        case MESH_EXTRUSION:
+            if (!UGenerateExtrusion(desc.profilePoints.data() + record.firstProfilePoint, record.profilePointCount, params[0], true, data))
+                return false;
+            mesh.lods[0] = mesh.lods[1] = mesh.lods[2] = UAddToMeshPool(data);
+            return true;
+        default:
+            return false;
+        }
+        mesh.lods[lod] = UAddToMeshPool(data);
+    }
+    return true;
+}
+
+
+bool UInstantiateScene(const USceneDesc& desc, const char* sceneFile, UScene& scene)
+{
+    UPROFILE_SCOPE("Load scene");
+
+    // Paths in the scene are relative to the scene file
+    const std::string path(sceneFile);
+    const std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+
+    scene = UScene();
+    scene.ambientStrength = desc.ambientStrength;
+
+    scene.meshes.resize(desc.meshes.size());
+    scene.meshFiles.resize(desc.meshes.size());
+    for (size_t i = 0; i < desc.meshes.size(); ++i)
+    {
+        if (desc.meshes[i].kind == MESH_FILE)
+            scene.meshFiles[i] = directory + USceneString(desc, desc.meshes[i].source);
+        if (!UInstantiateSceneMesh(desc, desc.meshes[i], directory, scene.meshes[i]))
+        {
+            cout << "Failed to create scene mesh '" << USceneString(desc, desc.meshes[i].name) << "'" << endl;
+            return false;
+        }
+    }
+
+    // Textures shared by several entries are only loaded once. The files decode as jobs, then upload here.
+    struct DecodedImage
+    {
+        unsigned char* pixels;
+        int width, height, channels;
+    };
+    const size_t textureCount = desc.textures.size();
+    std::vector<std::string> textureFiles(textureCount);
+    std::vector<size_t> firstUse(textureCount);
+    std::unordered_map<std::string, size_t> loaded;
+    loaded.reserve(textureCount);
+    for (size_t i = 0; i < textureCount; ++i)
+    {
+        textureFiles[i] = directory + USceneString(desc, desc.textures[i].file);
+        firstUse[i] = loaded.insert(std::make_pair(textureFiles[i], i)).first->second;
+    }
+    std::vector<DecodedImage> images(textureCount, DecodedImage());
+    UParallelFor(textureCount, 1, [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            DecodedImage& image = images[i];
+            if (firstUse[i] != i)
+                continue;
+            UPROFILE_SCOPE("Decode texture");
+            image.pixels = stbi_load(textureFiles[i].c_str(), &image.width, &image.height, &image.channels, 0);
+            if (image.pixels)
+                flipImageVertically(image.pixels, image.width, image.height, image.channels);
+        }
+    });
+
+    UPROFILE_GPU_SCOPE("Upload textures");
+    for (size_t i = 0; i < textureCount; ++i)
+    {
+        GLuint textureId = 0;
+        if (firstUse[i] != i)
+            textureId = scene.textures[firstUse[i]];
+        else if (!images[i].pixels || !UCreateTextureFromImage(images[i].pixels, images[i].width, images[i].height, images[i].channels, textureId))
+            cout << "Failed to load texture " << textureFiles[i] << endl;
+        stbi_image_free(images[i].pixels);
+        scene.textures.push_back(textureId);
+        scene.textureNames.push_back(USceneString(desc, desc.textures[i].name));
+        scene.textureFiles.push_back(textureFiles[i]);
+    }
+
+    for (size_t i = 0; i < desc.materials.size(); ++i)
+    {
+        const USceneMaterialDesc& record = desc.materials[i];
+        USceneMaterial material;
+        material.texture = record.texture >= 0 ? scene.textures[record.texture] : 0;
+        material.sampler = UGetSampler(gSamplers, UMaterialSamplerKey(gSamplers, GL_REPEAT));
+        material.specularIntensity = record.specularIntensity;
+        material.highlightSize = record.highlightSize;
+        scene.materials.push_back(material);
+    }
+
+    /* Entities are created depth first so every subtree ends up contiguous in the transform store. The
+     * children of each object are gathered into one array first (counted, then placed in listing order), so
+     * the walk visits every object once instead of rescanning the list for each one.
+     */
+    const size_t objectCount = desc.objects.size();
+    std::vector<GLuint> firstChild(objectCount + 1, 0);
+    for (size_t i = 0; i < objectCount; ++i)
+    {
+        if (desc.objects[i].parent >= 0)
+            ++firstChild[desc.objects[i].parent + 1];
+    }
+    for (size_t i = 0; i < objectCount; ++i)
+        firstChild[i + 1] += firstChild[i];
+    std::vector<GLuint> children(firstChild[objectCount]);
+    std::vector<GLuint> placed(firstChild.begin(), firstChild.end() - 1);
+    for (size_t i = 0; i < objectCount; ++i)
+    {
+        if (desc.objects[i].parent >= 0)
+            children[placed[desc.objects[i].parent]++] = GLuint(i);
+    }
+
+    std::vector<GLuint> entities(objectCount, NO_PARENT);
+    std::vector<GLuint> stack;
+    for (size_t i = objectCount; i-- > 0;)
+    {
+        if (desc.objects[i].parent < 0)
+            stack.push_back(GLuint(i));
+    }
+    while (!stack.empty())
+    {
+        const GLuint i = stack.back();
+        stack.pop_back();
+
+        const USceneObjectDesc& record = desc.objects[i];
+        const GLuint parent = record.parent < 0 ? NO_PARENT : entities[record.parent];
+        entities[i] = UCreateEntity(scene.transforms, parent, glm::make_vec3(record.position),
+            glm::angleAxis(record.rotationAngle, glm::normalize(glm::make_vec3(record.rotationAxis))), glm::make_vec3(record.scale));
+
+        // Push in reverse so children are created in the order they were listed
+        for (GLuint k = firstChild[i + 1]; k-- > firstChild[i];)
+            stack.push_back(children[k]);
+    }
+
+    for (size_t i = 0; i < objectCount; ++i)
+    {
+        // Objects in a parent cycle are never reached from a root
+        if (entities[i] == NO_PARENT)
+        {
+            cout << "Scene object '" << USceneString(desc, desc.objects[i].name) << "' is part of a parent cycle" << endl;
+            return false;
+        }
+
+        USceneObject object;
+        object.mesh = desc.objects[i].mesh;
+        object.material = desc.objects[i].material;
+        object.entity = entities[i];
+        object.lightmapMesh = NO_MESH;
+        scene.objects.push_back(object);
+    }
+    struct ByState
+    {
+        bool operator()(const USceneObject& a, const USceneObject& b) const
+        {
+            return a.material != b.material ? a.material < b.material : a.mesh < b.mesh;
+        }
+    };
+    std::stable_sort(scene.objects.begin(), scene.objects.end(), ByState());
+
+    for (size_t i = 0; i < desc.lights.size(); ++i)
+    {
+        const USceneLightDesc& record = desc.lights[i];
+        USceneLight light;
+        light.position = glm::make_vec3(record.position);
+        light.color = glm::make_vec3(record.color);
+        light.scale = record.scale;
+        light.orbit = record.orbit != 0;
+        light.radius = record.radius;
+        light.shadow = record.shadow != 0;
+        scene.lights.push_back(light);
+    }
+    return true;
+}
+
+
+void UDestroyScene(UScene& scene)
+{
+    // Shared textures appear more than once in the list
+    std::sort(scene.textures.begin(), scene.textures.end());
+    scene.textures.erase(std::unique(scene.textures.begin(), scene.textures.end()), scene.textures.end());
+    for (size_t i = 0; i < scene.textures.size(); ++i)
+    {
+        if (scene.textures[i])
+            UDestroyTexture(scene.textures[i]);
+    }
+    scene = UScene();
+}
+
+
+// Texture id of the named scene texture, or 0
+GLuint UFindSceneTexture(const UScene& scene, const char* name)
+{
+    for (size_t i = 0; i < scene.textureNames.size(); ++i)
+    {
+        if (scene.textureNames[i] == name)
+            return scene.textures[i];
+    }
+    return 0;
+}
+
+
+/* Hot reloading
+ * See UAssetWatcher. Only the watcher thread touches the inotify descriptor and the files; it hands what it
+ * loaded to UApplyAssetReloads, which runs on the main thread at the top of each frame.
+ */
+
+static bool UReadTextFile(const std::string& path, std::string& text)
+{
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    text.clear();
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, count);
+    fclose(file);
+    return true;
+}
+
+
+// The GLSL macros leave a source on one line; this breaks it after every statement and brace so it can be edited
+static std::string UFormatShaderSource(const char* source)
+{
+    std::string text;
+    int parentheses = 0, braces = 0;
+    bool isLineStart = false;
+    for (const char* c = source; *c; ++c)
+    {
+        if (isLineStart && *c == ' ')
+            continue;
+        if (*c == '}')
+            --braces;
+        if (isLineStart)
+            text.append(4 * std::max(braces, 0), ' ');
+        isLineStart = false;
+        text += *c;
+
+        if (*c == '(')
+            ++parentheses;
+        else if (*c == ')')
+            --parentheses;
+        else if (*c == '{')
+            ++braces;
+        if (*c == '\n')
+            isLineStart = true;
+        else if (parentheses == 0 && (*c == ';' || *c == '{' || *c == '}'))
+        {
+            text += '\n';
+            isLineStart = true;
+        }
+    }
+    return text;
+}
+
+
+/* Reads DIRECTORY/NAME.glsl for every shader source. A missing file is written out with the built-in text,
+ * so a fresh directory starts out with everything there is to edit. The first file of each stage must keep
+ * the #version line as its first line, since the feature #defines are added after it.
+ */
+bool ULoadShaderOverrides(const char* directory)
+{
+    gShaderOverrides.assign(SHADER_SOURCE_COUNT, std::string());
+    for (size_t i = 0; i < SHADER_SOURCE_COUNT; ++i)
+    {
+        const std::string path = std::string(directory) + "/" + SHADER_SOURCES[i].name + ".glsl";
+        if (UReadTextFile(path, gShaderOverrides[i]))
+            continue;
+
+        gShaderOverrides[i] = UFormatShaderSource(SHADER_SOURCES[i].source);
+        FILE* file = fopen(path.c_str(), "wb");
+        if (!file || fwrite(gShaderOverrides[i].data(), 1, gShaderOverrides[i].size(), file) != gShaderOverrides[i].size())
+        {
+            cout << "Failed to write shader source " << path << endl;
+            if (file)
+                fclose(file);
+            return false;
+        }
+        fclose(file);
+    }
+    cout << "INFO: Shader sources are read from " << directory << endl;
+    return true;
+}
+
+
+// Reads and decodes a changed file on the watcher thread, so the main thread only has to upload it
+static bool ULoadChangedAsset(const UAssetFile& file, UAssetReload& reload)
+{
+    UPROFILE_SCOPE("Load changed asset");
+    reload.kind = file.kind;
+    reload.index = file.index;
+    if (file.kind == ASSET_SHADER)
+        return UReadTextFile(file.path, reload.text);
+    if (file.kind == ASSET_MESH)
+        return UImportMesh(file.path.c_str(), reload.mesh);
+
+    unsigned char* image = stbi_load(file.path.c_str(), &reload.width, &reload.height, &reload.channels, 0);
+    if (!image)
+    {
+        cout << "Failed to reload texture " << file.path << endl;
+        return false;
+    }
+    flipImageVertically(image, reload.width, reload.height, reload.channels);
+    reload.pixels.assign(image, image + size_t(reload.width) * reload.height * reload.channels);
+    stbi_image_free(image);
+    return true;
+}
+
+
+#ifdef __linux__
+static void UWatchAssets(UAssetWatcher* watcher)
+{
+    UNameProfileThread(gProfiler, "Asset watcher");
+    alignas(inotify_event) char buffer[4096];
+    while (!watcher->quit)
+    {
+        // Wakes up now and then to check for quit
+        pollfd descriptor = { watcher->inotify, POLLIN, 0 };
+        if (poll(&descriptor, 1, 100) <= 0)
+            continue;
+        const ssize_t length = read(watcher->inotify, buffer, sizeof(buffer));
+
+        // Saving can touch a file more than once; each file is loaded once per batch of events
+        std::vector<size_t> changed;
+        for (ssize_t offset = 0; offset < length;)
+        {
+            const inotify_event* event = (const inotify_event*)(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+            if (event->len == 0)
+                continue;
+            for (size_t i = 0; i < watcher->files.size(); ++i)
+            {
+                const UAssetFile& file = watcher->files[i];
+                if (file.watch == event->wd && file.name == event->name && std::find(changed.begin(), changed.end(), i) == changed.end())
+                    changed.push_back(i);
+            }
+        }
+
+        for (size_t i = 0; i < changed.size(); ++i)
+        {
+            UAssetReload reload;
+            if (!ULoadChangedAsset(watcher->files[changed[i]], reload))
+                continue;
+            std::lock_guard<std::mutex> lock(watcher->mutex);
+            watcher->loaded.push_back(UAssetReload());
+            std::swap(watcher->loaded.back(), reload);
+        }
+    }
+}
+#endif
+
+
+/* Watches the shader sources (with --shader-dir), the scene's textures and its mesh files. Each directory
+ * is watched rather than each file, since editors often save by writing a new file and renaming it over
+ * the old one. Does nothing on platforms without inotify.
+ */
+void UStartAssetWatcher(UAssetWatcher& watcher, const UScene& scene)
+{
+    watcher.inotify = -1;
+    watcher.quit = false;
+    watcher.files.clear();
+
+    std::vector<UAssetFile> files;
+    UAssetFile file;
+    file.watch = -1;
+    file.kind = ASSET_SHADER;
+    for (size_t i = 0; i < SHADER_SOURCE_COUNT && !gShaderDirectory.empty(); ++i)
+    {
+        file.index = i;
+        file.path = gShaderDirectory + "/" + SHADER_SOURCES[i].name + ".glsl";
+        files.push_back(file);
+    }
+    // Shared textures are listed once per entry but only need reloading once
+    file.kind = ASSET_TEXTURE;
+    for (size_t i = 0; i < scene.textures.size(); ++i)
+    {
+        if (scene.textures[i] && std::find(scene.textures.begin(), scene.textures.begin() + i, scene.textures[i]) == scene.textures.begin() + i)
+        {
+            file.index = i;
+            file.path = scene.textureFiles[i];
+            files.push_back(file);
+        }
+    }
+    file.kind = ASSET_MESH;
+    for (size_t i = 0; i < scene.meshFiles.size(); ++i)
+    {
+        if (!scene.meshFiles[i].empty())
+        {
+            file.index = i;
+            file.path = scene.meshFiles[i];
+            files.push_back(file);
+        }
+    }
+
+#ifdef __linux__
+    if (files.empty())
+        return;
+    watcher.inotify = inotify_init1(IN_CLOEXEC);
+    if (watcher.inotify < 0)
+    {
+        cout << "Failed to watch the assets for changes" << endl;
+        return;
+    }
+
+    // A directory watched under two spellings gets the same watch back, so files are matched by watch and name
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        const size_t slash = files[i].path.find_last_of('/');
+        const std::string directory = slash == std::string::npos ? "." : files[i].path.substr(0, std::max<size_t>(slash, 1));
+        files[i].name = files[i].path.substr(slash == std::string::npos ? 0 : slash + 1);
+        files[i].watch = inotify_add_watch(watcher.inotify, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (files[i].watch >= 0)
+            watcher.files.push_back(files[i]);
+    }
+    watcher.thread = std::thread(UWatchAssets, &watcher);
+    cout << "INFO: Watching " << watcher.files.size() << " asset files for changes" << endl;
+#endif
+}
+
+
+// Starts rebuilding every shader family whose sources changed, with the variants it has now
+static void UReplaceChangedShaders(UAssetWatcher& watcher)
+{
+    UShaderFamily* const families[] = { &gCubeShaders, &gGBufferShaders, &gDeferredShaders, &gLampShaders, &gShadowShaders, &gHudShaders };
+    for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); ++i)
+    {
+        UShaderFamily& family = *families[i];
+
+        // An edit made while the previous one is still compiling replaces that rebuild
+        size_t slot = 0;
+        while (slot < watcher.shaders.size() && watcher.shaders[slot].family != &family)
+            ++slot;
+        const UShaderFamily& latest = slot < watcher.shaders.size() ? watcher.shaders[slot].replacement : family;
+        if (UComposeShaderSource(family.vertexSources) == latest.vertexSource && UComposeShaderSource(family.fragmentSources) == latest.fragmentSource)
+            continue;
+
+        if (slot < watcher.shaders.size())
+            UDestroyShaderFamily(watcher.shaders[slot].replacement);
+        else
+        {
+            watcher.shaders.push_back(UShaderReplacement());
+            watcher.shaders[slot].family = &family;
+        }
+        UShaderFamily& replacement = watcher.shaders[slot].replacement;
+        UCreateShaderFamily(replacement, family.name, family.vertexSources, family.fragmentSources, family.featureMask, family.fixedFeatures);
+        for (size_t k = 1; k < family.keys.size(); ++k)
+            USubmitShaderVariant(replacement, family.keys[k]);
+    }
+}
+
+
+/* Swaps in each rebuilt family once all its programs are done. One whose fallback failed is thrown away,
+ * so a shader with a typo in it leaves the previous one drawing.
+ */
+static void UFinishShaderReplacements(UAssetWatcher& watcher)
+{
+    for (size_t i = 0; i < watcher.shaders.size();)
+    {
+        UShaderReplacement& entry = watcher.shaders[i];
+        bool isFinished = true;
+        for (size_t k = 0; k < entry.replacement.builds.size(); ++k)
+            isFinished &= UPollShaderVariant(entry.replacement, k, false) != BUILD_PENDING;
+        if (!isFinished)
+        {
+            ++i;
+            continue;
+        }
+
+        if (entry.replacement.builds[0].status == BUILD_READY)
+        {
+            std::swap(*entry.family, entry.replacement);
+            cout << "INFO: Reloaded the " << entry.family->name << " shaders" << endl;
+        }
+        else
+            cout << "Failed to reload the " << entry.family->name << " shaders, keeping the previous ones" << endl;
+        UDestroyShaderFamily(entry.replacement);
+        watcher.shaders.erase(watcher.shaders.begin() + i);
+    }
+}
+
+
+// Uploads what the watcher loaded since the last frame
+void UApplyAssetReloads(UAssetWatcher& watcher, UScene& scene)
+{
+    std::vector<UAssetReload> loaded;
+    {
+        std::lock_guard<std::mutex> lock(watcher.mutex);
+        loaded.swap(watcher.loaded);
+    }
+
+    bool isShaderChanged = false;
+    for (size_t i = 0; i < loaded.size(); ++i)
+    {
+        UPROFILE_GPU_SCOPE("Apply changed asset");
+        UAssetReload& reload = loaded[i];
+        if (reload.kind == ASSET_SHADER)
+        {
+            gShaderOverrides[reload.index].swap(reload.text);
+            isShaderChanged = true;
+        }
+        else if (reload.kind == ASSET_TEXTURE)
+        {
+            // Usually the same texture object. A new one (immutable storage of another size) replaces the old id everywhere.
+            const GLuint previous = scene.textures[reload.index];
+            GLuint textureId = previous;
+            if (USetTextureImage(textureId, reload.pixels.data(), reload.width, reload.height, reload.channels))
+                cout << "INFO: Reloaded texture " << scene.textureFiles[reload.index] << endl;
+            if (textureId != previous)
+            {
+                std::replace(scene.textures.begin(), scene.textures.end(), previous, textureId);
+                for (size_t k = 0; k < scene.materials.size(); ++k)
+                {
+                    if (scene.materials[k].texture == previous)
+                        scene.materials[k].texture = textureId;
+                }
+                if (gTissueBoxTextureId == previous)
+                    gTissueBoxTextureId = textureId;
+            }
+        }
+        else
+        {
+            // File meshes have a single level of detail, repeated in every slot
+            UUpdatePoolMesh(scene.meshes[reload.index].lods[0], reload.mesh);
+
+            // The lightmap was laid out for the old triangles, so these objects go back to the probes
+            for (size_t k = 0; k < scene.objects.size(); ++k)
+            {
+                if (scene.objects[k].mesh == reload.index)
+                    scene.objects[k].lightmapMesh = NO_MESH;
+            }
+            gShadowMap.valid = false;       // Redraws the cached shadow casters
+            gShadowMap.nextFace = 6;
+            cout << "INFO: Reloaded mesh " << scene.meshFiles[reload.index] << endl;
+        }
+    }
+
+    if (isShaderChanged)
+        UReplaceChangedShaders(watcher);
+    UFinishShaderReplacements(watcher);
+}
+
+
+void UStopAssetWatcher(UAssetWatcher& watcher)
+{
+    watcher.quit = true;
+    if (watcher.thread.joinable())
+        watcher.thread.join();
+#ifdef __linux__
+    if (watcher.inotify >= 0)
+        close(watcher.inotify);
+#endif
+    watcher.inotify = -1;
+    watcher.files.clear();
+    watcher.loaded.clear();
+    for (size_t i = 0; i < watcher.shaders.size(); ++i)
+        UDestroyShaderFamily(watcher.shaders[i].replacement);
+    watcher.shaders.clear();
+}
+
+
+/* Job system
+ * One worker per additional hardware thread. Each worker, and each outside thread the first time it submits,
+ * owns a Chase-Lev deque (Chase and Lev 2005, with the C11 memory orders of Le et al. 2013). Waiting on a
+ * counter runs queued jobs instead of blocking, so jobs may submit and wait on jobs of their own.
+ */
+
+static void UStoreJob(UJobDeque::Slot& slot, const UJob& job)
+{
+    slot.function.store(job.function, std::memory_order_relaxed);
+    slot.context.store(job.context, std::memory_order_relaxed);
+    slot.begin.store(job.begin, std::memory_order_relaxed);
+    slot.end.store(job.end, std::memory_order_relaxed);
+    slot.grain.store(job.grain, std::memory_order_relaxed);
+    slot.counter.store(job.counter, std::memory_order_relaxed);
+}
+
+
+static void ULoadJob(const UJobDeque::Slot& slot, UJob& job)
+{
+    job.function = slot.function.load(std::memory_order_relaxed);
+    job.context = slot.context.load(std::memory_order_relaxed);
+    job.begin = slot.begin.load(std::memory_order_relaxed);
+    job.end = slot.end.load(std::memory_order_relaxed);
+    job.grain = slot.grain.load(std::memory_order_relaxed);
+    job.counter = slot.counter.load(std::memory_order_relaxed);
+}
+
+
+// Owner only. Fails if the deque is full.
+static bool UPushJob(UJobDeque& deque, const UJob& job)
+{
+    const int64_t bottom = deque.bottom.load(std::memory_order_relaxed);
+    const int64_t top = deque.top.load(std::memory_order_acquire);
+    if (bottom - top >= JOB_DEQUE_SIZE)
+        return false;
+
+    UStoreJob(deque.slots[bottom & (JOB_DEQUE_SIZE - 1)], job);
+    std::atomic_thread_fence(std::memory_order_release);
+    deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+    return true;
+}
+
+
+// Owner only. Takes the newest job.
+static bool UPopJob(UJobDeque& deque, UJob& job)
+{
+    const int64_t bottom = deque.bottom.load(std::memory_order_relaxed) - 1;
+    deque.bottom.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t top = deque.top.load(std::memory_order_relaxed);
+    if (top > bottom)
+    {
+        deque.bottom.store(bottom + 1, std::memory_order_relaxed); // Empty
+        return false;
+    }
+
+    ULoadJob(deque.slots[bottom & (JOB_DEQUE_SIZE - 1)], job);
+    if (top < bottom)
+        return true;
+
+    // The last job: thieves may be after it too
+    const bool isTaken = deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    deque.bottom.store(bottom + 1, std::memory_order_relaxed);
+    return isTaken;
+}
+
+
+// Any thread. Takes the oldest job, failing if the deque is empty or another thread got there first.
+static bool UStealJob(UJobDeque& deque, UJob& job)
+{
+    int64_t top = deque.top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int64_t bottom = deque.bottom.load(std::memory_order_acquire);
+    if (top >= bottom)
+        return false;
+
+    ULoadJob(deque.slots[top & (JOB_DEQUE_SIZE - 1)], job);
+    return deque.top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+}
+
+
+static UJobDeque* UCreateJobDeque()
+{
+    UJobDeque* deque = new UJobDeque;
+    deque->top = 0;
+    deque->bottom = 0;
+    return deque;
+}
+
+
+// The calling thread's deque, registering one the first time an outside thread submits
+static int UJobThreadIndex()
+{
+    UJobSystem& jobs = gJobs;
+    const unsigned generation = jobs.generation.load();
+    if (generation == 0 || jobs.quit)
+        return -1;
+    if (gJobThread.generation != generation)
+    {
+        gJobThread.generation = generation;
+        gJobThread.index = -1;
+        const unsigned index = jobs.dequeCount.fetch_add(1);
+        if (index < MAX_JOB_THREADS)
+        {
+            jobs.deques[index].store(UCreateJobDeque(), std::memory_order_release);
+            gJobThread.index = int(index);
+        }
+    }
+    return gJobThread.index;
+}
+
+
+// Pushes a job where other threads can steal it, waking a sleeping worker
+static bool UQueueJob(int self, const UJob& job)
+{
+    UJobSystem& jobs = gJobs;
+    if (self < 0 || !UPushJob(*jobs.deques[self].load(std::memory_order_relaxed), job))
+        return false;
+
+    jobs.queued.fetch_add(1);
+    if (jobs.sleeping.load() > 0)
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.wake.notify_one();
+    }
+    return true;
+}
+
+
+// Pops the thread's own newest job, or steals the oldest job of another thread
+static bool UFindJob(int self, UJob& job)
+{
+    UJobSystem& jobs = gJobs;
+    if (self >= 0 && UPopJob(*jobs.deques[self].load(std::memory_order_relaxed), job))
+    {
+        jobs.queued.fetch_sub(1);
+        return true;
+    }
+
+    // Thieves start at a random victim so they don't all contend on the same deque
+    static thread_local uint32_t random = 0x9E3779B9u;
+    random ^= random << 13;
+    random ^= random >> 17;
+    random ^= random << 5;
+
+    const unsigned count = std::min(jobs.dequeCount.load(), MAX_JOB_THREADS);
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const unsigned victim = (random + i) % count;
+        UJobDeque* deque = jobs.deques[victim].load(std::memory_order_acquire);
+        if (int(victim) != self && deque && UStealJob(*deque, job))
+        {
+            jobs.queued.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void URunJob(int self, UJob job)
+{
+    // Hand the upper halves out while the range is larger than the grain, cutting on grain boundaries
+    while (job.end - job.begin > job.grain)
+    {
+        const size_t chunks = (job.end - job.begin + job.grain - 1) / job.grain;
+        UJob half = job;
+        half.begin = job.begin + chunks / 2 * job.grain;
+        job.counter->pending.fetch_add(1);
+        if (!UQueueJob(self, half))
+        {
+            job.counter->pending.fetch_sub(1); // No room: the rest runs here
+            break;
+        }
+        job.end = half.begin;
+    }
+
+    job.function(job.context, job.begin, job.end);
+    job.counter->pending.fetch_sub(1, std::memory_order_release);
+}
+
+
+static void UJobWorker(unsigned index, unsigned generation)
+{
+    UJobSystem& jobs = gJobs;
+    gJobThread.generation = generation;
+    gJobThread.index = int(index);
+    char name[32];
+    snprintf(name, sizeof(name), "Worker %u", index);
+    UNameProfileThread(gProfiler, name);
+
+    // Spin for a while after running out of work, since frame jobs tend to come in bursts
+    const int spinCount = 64;
+    int idle = 0;
+    while (!jobs.quit)
+    {
+        UJob job;
+        if (UFindJob(int(index), job))
+        {
+            URunJob(int(index), job);
+            idle = 0;
+            continue;
+        }
+        if (++idle < spinCount)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(jobs.mutex);
+        ++jobs.sleeping;
+        while (jobs.queued.load() <= 0 && !jobs.quit)
+            jobs.wake.wait(lock);
+        --jobs.sleeping;
+        idle = 0;
+    }
+}
+
+
+static void UStartJobThreads(unsigned workers)
+{
+    UJobSystem& jobs = gJobs;
+    workers = std::min(workers, MAX_JOB_THREADS / 2);
+    for (unsigned i = 0; i < MAX_JOB_THREADS; ++i)
+        jobs.deques[i] = i < workers ? UCreateJobDeque() : NULL;
+    jobs.dequeCount = workers;
+    jobs.queued = 0;
+    jobs.sleeping = 0;
+    jobs.quit = false;
+    const unsigned generation = jobs.generation.load() + 1;
+    jobs.generation = generation;
+    for (unsigned i = 0; i < workers; ++i)
+        jobs.threads.push_back(std::thread(UJobWorker, i, generation));
+}
+
+
+// Starts one worker per additional hardware thread
+void UStartWorkers()
+{
+    UStartJobThreads(std::max(1u, std::thread::hardware_concurrency()) - 1);
+}
+
+
+void UStopWorkers()
+{
+    UJobSystem& jobs = gJobs;
+    {
+        std::lock_guard<std::mutex> lock(jobs.mutex);
+        jobs.quit = true;
+    }
+    jobs.wake.notify_all();
+    for (size_t i = 0; i < jobs.threads.size(); ++i)
+        jobs.threads[i].join();
+    jobs.threads.clear();
+
+    // Threads that still hold a deque index register again once the generation changes
+    jobs.generation = jobs.generation.load() + 1;
+    for (unsigned i = 0; i < MAX_JOB_THREADS; ++i)
+        delete jobs.deques[i].exchange(NULL);
+    jobs.dequeCount = 0;
+}
+
+
+/* Queues function(context, begin, end) over [begin, end) as one job on 'counter'. Without workers, or with
+ * a full deque, it runs right away on the calling thread instead.
+ */
+void USubmitJob(UJobFunction function, void* context, size_t begin, size_t end, size_t grain, UJobCounter& counter)
+{
+    UJob job;
+    job.function = function;
+    job.context = context;
+    job.begin = begin;
+    job.end = end;
+    job.grain = std::max<size_t>(grain, 1);
+    job.counter = &counter;
+
+    counter.pending.fetch_add(1);
+    const int self = gJobs.threads.empty() ? -1 : UJobThreadIndex();
+    if (!UQueueJob(self, job))
+        URunJob(self, job);
+}
+
+
+// Runs queued jobs until every job on 'counter' has finished
+void UWaitForJobs(UJobCounter& counter)
+{
+    const int self = UJobThreadIndex();
+    while (counter.pending.load(std::memory_order_acquire) != 0)
+    {
+        UJob job;
+        if (UFindJob(self, job))
+            URunJob(self, job);
+        else
+            std::this_thread::yield();
+    }
+}
+
+
+// Runs body(context, begin, end) over [0, count) in chunks of at least 'grain' items, and waits for it
+void URunParallelFor(size_t count, size_t grain, UJobFunction body, void* context)
+{
+    grain = std::max<size_t>(grain, 1);
+    if (count == 0)
+        return;
+    if (gJobs.threads.empty() || count <= grain)
+    {
+        body(context, 0, count);
+        return;
+    }
+
+    // The calling thread starts on the range itself, queueing halves as it splits it
+    UJobCounter counter;
+    UJob job;
+    job.function = body;
+    job.context = context;
+    job.begin = 0;
+    job.end = count;
+    job.grain = grain;
+    job.counter = &counter;
+    counter.pending = 1;
+    URunJob(UJobThreadIndex(), job);
+    UWaitForJobs(counter);
+}
+
+
+template <typename Body>
+void UParallelFor(size_t count, size_t grain, const Body& body)
+{
+    struct Trampoline
+    {
+        static void Run(void* context, size_t begin, size_t end)
+        {
+            (*(const Body*)context)(begin, end);
+        }
+    };
+    URunParallelFor(count, grain, &Trampoline::Run, (void*)&body);
+}
+
+
+// Queues body() as a single job on 'counter'. The body must stay alive until the counter is waited on.
+template <typename Body>
+void USubmitTask(UJobCounter& counter, const Body& body)
+{
+    struct Trampoline
+    {
+        static void Run(void* context, size_t, size_t)
+        {
+            (*(const Body*)context)();
+        }
+    };
+    USubmitJob(&Trampoline::Run, (void*)&body, 0, 1, 1, counter);
+}
+
+
+static void UEmptyJob(void*, size_t, size_t)
+{
+}
+
+
+/* Scheduling overhead per job, and how a fixed amount of work scales with the number of threads (the
+ * calling thread plus workers) up to maxThreads.
+ */
+void UBenchmarkJobs(size_t count, unsigned maxThreads)
+{
+    count = std::max<size_t>(count, 1);
+    maxThreads = std::max(1u, std::min(maxThreads, MAX_JOB_THREADS / 2));
+
+    // Each item of the scaling workload costs around a microsecond
+    const size_t items = 1 << 16;
+    std::vector<float> results(items);
+    const auto work = [&](size_t begin, size_t end)
+    {
+        for (size_t i = begin; i < end; ++i)
+        {
+            float x = float(i);
+            for (int k = 0; k < 256; ++k)
+                x = sqrtf(x + float(k));
+            results[i] = x;
+        }
+    };
+
+    double baseline = 0.0;
+    for (unsigned threads = 1;; threads = std::min(threads * 2, maxThreads))
+    {
+        UStartJobThreads(threads - 1);
+
+        // Empty jobs submitted one by one, in batches that fit the deque
+        const size_t batch = size_t(JOB_DEQUE_SIZE / 2);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t submitted = 0; submitted < count;)
+        {
+            UJobCounter counter;
+            const size_t end = std::min(submitted + batch, count);
+            for (; submitted < end; ++submitted)
+                USubmitJob(UEmptyJob, NULL, 0, 1, 1, counter);
+            UWaitForJobs(counter);
+        }
+        const double submitTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        // Empty items of a parallel for, split down to single items
+        start = std::chrono::steady_clock::now();
+        URunParallelFor(count, 1, UEmptyJob, NULL);
+        const double splitTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const int repeats = 4;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; ++r)
+            UParallelFor(items, 64, work);
+        const double workTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / repeats;
+        if (threads == 1)
+            baseline = workTime;
+
+        UStopWorkers();
+
+        cout << "INFO: " << threads << " threads: " << submitTime / count * 1e9 << " ns per submitted job, "
+             << splitTime / count * 1e9 << " ns per split item, " << items << " items of work in " << workTime * 1000.0
+             << " ms (" << baseline / workTime << "x)" << endl;
+        if (threads == maxThreads)
+            break;
+    }
+}
+
+
+/* Frame arenas */
+
+// The calling thread's arena, numbered on first use
+UFrameArena& UThreadArena()
+{
+    UFrameArena& arena = gThreadArena;
+    if (arena.thread == 0)
+        arena.thread = ++gArenaThreads;
+    return arena;
+}
+
+
+// Bump allocates from the current block, moving on to the next block (or a new one) when it doesn't fit
+void* UArenaAllocate(UFrameArena& arena, size_t bytes, size_t alignment)
+{
+    for (;;)
+    {
+        if (arena.block < arena.blocks.size())
+        {
+            std::vector<unsigned char>& block = arena.blocks[arena.block];
+            const uintptr_t base = uintptr_t(block.data());
+            const size_t start = size_t(((base + arena.offset + alignment - 1) & ~uintptr_t(alignment - 1)) - base);
+            if (start + bytes <= block.size())
+            {
+                arena.used += start + bytes - arena.offset;
+                arena.offset = start + bytes;
+                arena.peak = std::max(arena.peak, arena.used);
+                return block.data() + start;
+            }
+            if (arena.block + 1 < arena.blocks.size())
+            {
+                ++arena.block;
+                arena.offset = 0;
+                continue;
+            }
+        }
+
+        // Out of room: chain a block. The next reset folds the blocks into one.
+        const size_t size = std::max(ARENA_BLOCK_SIZE, bytes + alignment);
+        arena.blocks.push_back(std::vector<unsigned char>(size, gIsArenaDebug ? ARENA_POISON : 0));
+        arena.block = arena.blocks.size() - 1;
+        arena.offset = 0;
+        if (gIsArenaDebug)
+            cout << "INFO: Frame arena " << arena.thread << " added a " << size / 1024 << " KiB block, " << arena.used / 1024 << " KiB in use" << endl;
+    }
+}
+
+
+void UResetFrameArena(UFrameArena& arena)
+{
+    // A frame that needed more than one block gets a single block as large as the peak from now on
+    if (arena.blocks.size() > 1)
+    {
+        const size_t size = (arena.peak + ARENA_BLOCK_SIZE - 1) / ARENA_BLOCK_SIZE * ARENA_BLOCK_SIZE;
+        arena.blocks.clear();
+        arena.blocks.push_back(std::vector<unsigned char>(size, gIsArenaDebug ? ARENA_POISON : 0));
+        if (gIsArenaDebug)
+            cout << "INFO: Frame arena " << arena.thread << " peaked at " << arena.peak / 1024 << " KiB, now one " << size / 1024 << " KiB block" << endl;
+    }
+    else if (gIsArenaDebug && !arena.blocks.empty())
+        memset(arena.blocks[0].data(), ARENA_POISON, arena.offset);
+
+    arena.block = 0;
+    arena.offset = 0;
+    arena.used = 0;
+    ++arena.frame;
+}
+
+
+UArenaMark UGetArenaMark(const UFrameArena& arena)
+{
+    UArenaMark mark;
+    mark.block = arena.block;
+    mark.offset = arena.offset;
+    mark.used = arena.used;
+    return mark;
+}
+
+
+// Releases everything allocated since the mark was taken
+void URewindArena(UFrameArena& arena, const UArenaMark& mark)
+{
+    if (gIsArenaDebug)
+    {
+        for (size_t b = mark.block; b <= arena.block && b < arena.blocks.size(); ++b)
+        {
+            const size_t begin = b == mark.block ? mark.offset : 0;
+            const size_t end = b == arena.block ? arena.offset : arena.blocks[b].size();
+            if (end > begin)
+                memset(arena.blocks[b].data() + begin, ARENA_POISON, end - begin);
+        }
+    }
+    arena.block = mark.block;
+    arena.offset = mark.offset;
+    arena.used = mark.used;
+}
+
+
+// With --arena-debug, stops at the first container that outlived its frame or crossed to another thread
+void UCheckArenaUse(const UFrameArena& arena, uint64_t frame)
+{
+    if (!gIsArenaDebug)
+        return;
+    if (arena.frame != frame)
+    {
+        cerr << "ERROR: Memory of frame arena " << arena.thread << " used after its frame was reset" << endl;
+        abort();
+    }
+    if (&arena != &gThreadArena)
+    {
+        cerr << "ERROR: Frame arena " << arena.thread << " used from another thread" << endl;
+        abort();
+    }
+}
+
+
+/* Profiler */
+
+// Nanoseconds on the clock every profile event is timed with
+uint64_t UProfileClock()
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+
+// Starts the trace's clock. The GPU side waits for a context, in UInitializeGpuProfiler.
+void UInitializeProfiler(UProfiler& profiler)
+{
+    profiler.epoch = UProfileClock();
+    profiler.traceFile = "trace.json";
+    profiler.isTracingAtExit = false;
+    profiler.hasGpuTimers = false;
+    profiler.firstGpuSpan = profiler.gpuSpanCount = 0;
+    UNameProfileThread(profiler, "Main");
+}
+
+
+// Timer queries are core since GL 3.3
+void UInitializeGpuProfiler(UProfiler& profiler)
+{
+    profiler.hasGpuTimers = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+    if (!profiler.hasGpuTimers)
+    {
+        cout << "INFO: Timer queries are not supported, the trace has no GPU times" << endl;
+        return;
+    }
+    for (int i = 0; i < PROFILE_GPU_SPANS; ++i)
+        glGenQueries(2, profiler.gpuSpans[i].queries);
+    profiler.lastCalibration = 0;
+}
+
+
+// The calling thread's track, numbered on first use
+int UProfileThread()
+{
+    if (gProfileThread < 0)
+        gProfileThread = gProfiler.threadCount.fetch_add(1);
+    return gProfileThread;
+}
+
+
+// Names the calling thread's track; threads past PROFILE_MAX_THREADS stay unnamed
+void UNameProfileThread(UProfiler& profiler, const char* name)
+{
+    const int thread = UProfileThread();
+    if (thread >= PROFILE_MAX_THREADS)
+        return;
+    snprintf(profiler.threadNames[thread], sizeof(profiler.threadNames[thread]), "%s", name);
+    profiler.isThreadNamed[thread].store(true, std::memory_order_release);
+}
+
+
+void URecordProfileEvent(UProfiler& profiler, const char* name, uint64_t start, uint64_t end, int track)
+{
+    const uint64_t index = profiler.next.fetch_add(1, std::memory_order_relaxed);
+    UProfileEvent& event = profiler.events[index % PROFILE_RING_SIZE];
+    event.sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.name.store(name, std::memory_order_relaxed);
+    event.start.store(start, std::memory_order_relaxed);
+    event.duration.store(end > start ? end - start : 0, std::memory_order_relaxed);
+    event.track.store(track, std::memory_order_relaxed);
+    event.sequence.store(index + 1, std::memory_order_release);
+}
+
+
+// Returns the span to end, or -1 if there's nothing to time it with
+int UBeginGpuProfileSpan(UProfiler& profiler, const char* name)
+{
+    if (!profiler.hasGpuTimers || profiler.gpuSpanCount == PROFILE_GPU_SPANS)
+        return -1;
+    const int index = (profiler.firstGpuSpan + profiler.gpuSpanCount++) % PROFILE_GPU_SPANS;
+    UGpuProfileSpan& span = profiler.gpuSpans[index];
+    span.name = name;
+    span.isEnded = false;
+    glQueryCounter(span.queries[0], GL_TIMESTAMP);
+    return index;
+}
+
+
+void UEndGpuProfileSpan(UProfiler& profiler, int span)
+{
+    if (span < 0)
+        return;
+    glQueryCounter(profiler.gpuSpans[span].queries[1], GL_TIMESTAMP);
+    profiler.gpuSpans[span].isEnded = true;
+}
+
+
+/* Moves the GPU spans the GPU has finished into the ring, oldest first, without waiting for the rest.
+ * Their times are moved onto the CPU clock by an offset measured every PROFILE_CALIBRATION_PERIOD.
+ */
+void UCollectGpuProfile(UProfiler& profiler)
+{
+    if (!profiler.hasGpuTimers)
+        return;
+    const uint64_t now = UProfileClock();
+    if (now - profiler.lastCalibration > uint64_t(PROFILE_CALIBRATION_PERIOD * 1e9))
+    {
+        GLint64 gpuTime = 0;
+        glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+        profiler.gpuClockOffset = int64_t(UProfileClock()) - int64_t(gpuTime);
+        profiler.lastCalibration = now;
+    }
+
+    while (profiler.gpuSpanCount > 0)
+    {
+        const UGpuProfileSpan& span = profiler.gpuSpans[profiler.firstGpuSpan];
+        GLint isAvailable = GL_FALSE;
+        if (span.isEnded)
+            glGetQueryObjectiv(span.queries[1], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (!isAvailable)
+            break;
+
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(span.queries[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(span.queries[1], GL_QUERY_RESULT, &end);
+        URecordProfileEvent(profiler, span.name, uint64_t(int64_t(start) + profiler.gpuClockOffset),
+            uint64_t(int64_t(end) + profiler.gpuClockOffset), PROFILE_GPU_TRACK);
+        profiler.firstGpuSpan = (profiler.firstGpuSpan + 1) % PROFILE_GPU_SPANS;
+        --profiler.gpuSpanCount;
+    }
+}
+
+
+/* Writes the events in the ring as Chrome trace event JSON. Other threads can keep recording meanwhile;
+ * events that are overwritten while being read are left out.
+ */
+bool UWriteTrace(const UProfiler& profiler, const char* filename)
+{
+    UPROFILE_SCOPE("Write trace");
+    FILE* out = fopen(filename, "w");
+    if (!out)
+    {
+        cout << "Failed to write trace " << filename << endl;
+        return false;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}}", WINDOW_TITLE);
+    const int threads = std::min(profiler.threadCount.load(), PROFILE_MAX_THREADS);
+    for (int i = 0; i < threads; ++i)
+    {
+        const bool isNamed = profiler.isThreadNamed[i].load(std::memory_order_acquire);
+        fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            i, isNamed ? profiler.threadNames[i] : "Thread");
+    }
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"GPU\"}}", PROFILE_GPU_TRACK);
+    fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"Shader compiler\"}}", PROFILE_SHADER_TRACK);
+
+    const uint64_t next = profiler.next.load(std::memory_order_acquire);
+    size_t written = 0;
+    for (uint64_t index = next > PROFILE_RING_SIZE ? next - PROFILE_RING_SIZE : 0; index < next; ++index)
+    {
+        const UProfileEvent& event = profiler.events[index % PROFILE_RING_SIZE];
+        const uint64_t sequence = event.sequence.load(std::memory_order_acquire);
+        const char* name = event.name.load(std::memory_order_relaxed);
+        const uint64_t start = event.start.load(std::memory_order_relaxed);
+        const uint64_t duration = event.duration.load(std::memory_order_relaxed);
+        const int track = event.track.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence != index + 1 || event.sequence.load(std::memory_order_relaxed) != sequence)
+            continue;
+
+        // Microseconds since the epoch
+        const double time = double(int64_t(start - profiler.epoch)) / 1000.0;
+        if (track == PROFILE_SHADER_TRACK)
+        {
+            // Programs compile side by side, so they are async events, which viewers stack instead of nesting
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"shader\",\"ph\":\"b\",\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                name, (unsigned long long)index, track, time);
+            fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"shader\",\"ph\":\"e\",\"id\":%llu,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                name, (unsigned long long)index, track, time + duration / 1000.0);
+        }
+        else
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                name, track, time, duration / 1000.0);
+        ++written;
+    }
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0)
+    {
+        cout << "Failed to write trace " << filename << endl;
+        return false;
+    }
+    cout << "INFO: Wrote " << written << " profile events to " << filename << endl;
+    return true;
+}
+
+
+void UDestroyProfiler(UProfiler& profiler)
+{
+    if (!profiler.hasGpuTimers)
+        return;
+    for (int i = 0; i < PROFILE_GPU_SPANS; ++i)
+        glDeleteQueries(2, profiler.gpuSpans[i].queries);
+    profiler.hasGpuTimers = false;
+    profiler.gpuSpanCount = 0;
+}
+
+
+/* Video memory accounting
+ * Every texture and buffer the renderer allocates is recorded with its size when it is created or resized,
+ * and dropped when it is deleted, so the totals the HUD shows are always current without asking the driver.
+ */
+
+// Bytes of a 2D image with its full mipmap chain
+GLsizeiptr UMipmappedBytes(GLsizei width, GLsizei height, GLsizeiptr texelBytes)
+{
+    GLsizeiptr bytes = 0;
+    for (;;)
+    {
+        bytes += GLsizeiptr(width) * height * texelBytes;
+        if (width <= 1 && height <= 1)
+            return bytes;
+        width = std::max(width / 2, 1);
+        height = std::max(height / 2, 1);
+    }
+}
+
+
+// Records (or updates, after a resize) the size of one GL object
+static void UTrackObject(std::unordered_map<GLuint, UVideoMemoryEntry>& objects, GLuint name, int category, GLsizeiptr bytes)
+{
+    if (!name)
+        return;
+    UVideoMemoryEntry& entry = objects[name];       // New names start out empty
+    gVideoMemory.bytes[entry.category] -= entry.bytes;
+    entry.category = category;
+    entry.bytes = bytes;
+    gVideoMemory.bytes[category] += bytes;
+}
+
+
+static void UUntrackObjects(std::unordered_map<GLuint, UVideoMemoryEntry>& objects, GLsizei count, const GLuint* names)
+{
+    for (GLsizei i = 0; i < count; ++i)
+    {
+        const std::unordered_map<GLuint, UVideoMemoryEntry>::iterator found = objects.find(names[i]);
+        if (found == objects.end())
+            continue;
+        gVideoMemory.bytes[found->second.category] -= found->second.bytes;
+        objects.erase(found);
+    }
+}
+
+
+void UTrackTexture(GLuint texture, int category, GLsizeiptr bytes)
+{
+    UTrackObject(gVideoMemory.textures, texture, category, bytes);
+}
+
 
-      //Left Face          //Negative X Normal
-      -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-      -0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-      -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-      -0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-      -0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-      -0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
+void UTrackBuffer(GLuint buffer, int category, GLsizeiptr bytes)
+{
+    UTrackObject(gVideoMemory.buffers, buffer, category, bytes);
+}
 
-      //Right Face         //Positive X Normal
-       0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-       0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-       0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-       0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-       0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-       0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
 
-     //Bottom Face        //Negative Y Normal
-      -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-       0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-       0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-       0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-      -0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-      -0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
+// glDeleteTextures, also taking the textures off the totals
+void UDeleteTextures(GLsizei count, const GLuint* textures)
+{
+    UUntrackObjects(gVideoMemory.textures, count, textures);
+    glDeleteTextures(count, textures);
+}
 
-      //Top Face           //Positive Y Normal
-      -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-       0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-       0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-      -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-      -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-    };
 
-    GLfloat planeV[] = {
-        -10.0f, -0.5f, 10.0f, 0.0f, 0.0f, -1.0f, 0.0f, 0.0f,
-         10.0f, -0.5f, 10.0f, 0.0f, 0.0f, -1.0f, 1.0f, 0.0f,
-         10.0f, -0.5f, -10.0f, 0.0f, 0.0f, -1.0f, 1.0f, 1.0f,
-         10.0f, -0.5f, -10.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f,
-        -10.0f, -0.5f, -10.0f, 0.0f, 0.0f, 1.0f, 1.0f, 0.0f,
-        -10.0f, -0.5f, 10.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f
+// glDeleteBuffers, also taking the buffers off the totals
+void UDeleteBuffers(GLsizei count, const GLuint* buffers)
+{
+    UUntrackObjects(gVideoMemory.buffers, count, buffers);
+    glDeleteBuffers(count, buffers);
+}
+
+
+/* Performance HUD */
+
+// 5x7 glyphs from FONT_FIRST on, a byte per row from the top with bit 4 as the leftmost pixel
+const unsigned char FONT_GLYPHS[FONT_COUNT * FONT_HEIGHT] =
+{
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04, 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x0A, 0x0A, 0x1F, 0x0A, 0x1F, 0x0A, 0x0A,  // space ! " #
+        0x04, 0x0F, 0x14, 0x0E, 0x05, 0x1E, 0x04, 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03, 0x0C, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0D, 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00,  // $ % & '
+        0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02, 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08, 0x00, 0x04, 0x15, 0x0E, 0x15, 0x04, 0x00, 0x00, 0x04, 0x04, 0x1F, 0x04, 0x04, 0x00,  // ( ) * +
+        0x00, 0x00, 0x00, 0x00, 0x0C, 0x04, 0x08, 0x00, 0x00, 0x00, 0x1F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00,  // , - . /
+        0x0E, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0E, 0x04, 0x0C, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x0E, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1F, 0x1F, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0E,  // 0 1 2 3
+        0x02, 0x06, 0x0A, 0x12, 0x1F, 0x02, 0x02, 0x1F, 0x10, 0x1E, 0x01, 0x01, 0x11, 0x0E, 0x06, 0x08, 0x10, 0x1E, 0x11, 0x11, 0x0E, 0x1F, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08,  // 4 5 6 7
+        0x0E, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x0E, 0x0E, 0x11, 0x11, 0x0F, 0x01, 0x02, 0x0C, 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00, 0x0C, 0x04, 0x08,  // 8 9 : ;
+        0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02, 0x00, 0x00, 0x1F, 0x00, 0x1F, 0x00, 0x00, 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08, 0x0E, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04,  // < = > ?
+        0x0E, 0x11, 0x01, 0x0D, 0x15, 0x15, 0x0E, 0x0E, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E, 0x11, 0x11, 0x1E, 0x0E, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0E,  // @ A B C
+        0x1C, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1C, 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x1F, 0x1F, 0x10, 0x10, 0x1E, 0x10, 0x10, 0x10, 0x0E, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0F,  // D E F G
+        0x11, 0x11, 0x11, 0x1F, 0x11, 0x11, 0x11, 0x0E, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0C, 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11,  // H I J K
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1F, 0x11, 0x1B, 0x15, 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E,  // L M N O
+        0x1E, 0x11, 0x11, 0x1E, 0x10, 0x10, 0x10, 0x0E, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0D, 0x1E, 0x11, 0x11, 0x1E, 0x14, 0x12, 0x11, 0x0F, 0x10, 0x10, 0x0E, 0x01, 0x01, 0x1E,  // P Q R S
+        0x1F, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0E, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0A,  // T U V W
+        0x11, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x04, 0x04, 0x04, 0x1F, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1F, 0x0E, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0E,  // X Y Z [
+        0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00, 0x0E, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0E, 0x04, 0x0A, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1F,  // backslash ] ^ _
+        0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0E, 0x01, 0x0F, 0x11, 0x0F, 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1E, 0x00, 0x00, 0x0E, 0x10, 0x10, 0x11, 0x0E,  // ` a b c
+        0x01, 0x01, 0x0D, 0x13, 0x11, 0x11, 0x0F, 0x00, 0x00, 0x0E, 0x11, 0x1F, 0x10, 0x0E, 0x06, 0x09, 0x08, 0x1C, 0x08, 0x08, 0x08, 0x00, 0x0F, 0x11, 0x11, 0x0F, 0x01, 0x0E,  // d e f g
+        0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11, 0x04, 0x00, 0x0C, 0x04, 0x04, 0x04, 0x0E, 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0C, 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12,  // h i j k
+        0x0C, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0E, 0x00, 0x00, 0x1A, 0x15, 0x15, 0x11, 0x11, 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11, 0x00, 0x00, 0x0E, 0x11, 0x11, 0x11, 0x0E,  // l m n o
+        0x00, 0x00, 0x1E, 0x11, 0x1E, 0x10, 0x10, 0x00, 0x00, 0x0D, 0x13, 0x0F, 0x01, 0x01, 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10, 0x00, 0x00, 0x0E, 0x10, 0x0E, 0x01, 0x1E,  // p q r s
+        0x08, 0x08, 0x1C, 0x08, 0x08, 0x09, 0x06, 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0D, 0x00, 0x00, 0x11, 0x11, 0x11, 0x0A, 0x04, 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0A,  // t u v w
+        0x00, 0x00, 0x11, 0x0A, 0x04, 0x0A, 0x11, 0x00, 0x00, 0x11, 0x11, 0x0F, 0x01, 0x0E, 0x00, 0x00, 0x1F, 0x02, 0x04, 0x08, 0x1F, 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02,  // x y z {
+        0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08, 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00   // | } ~
+};
+
+
+static GLuint UHudColor(GLuint red, GLuint green, GLuint blue, GLuint alpha)
+{
+    return red | (green << 8) | (blue << 16) | (alpha << 24);
+}
+
+
+/* Builds the font atlas, one cell per glyph and FONT_SOLID last, and the vertex array of the overlay. There
+ * are no vertices: each quad is an instance, with its rectangle, atlas cell and color as attributes.
+ */
+void UCreateHud(UHud& hud)
+{
+    const int atlasWidth = (FONT_COUNT + 1) * FONT_WIDTH;
+    std::vector<unsigned char> pixels(atlasWidth * FONT_HEIGHT, 0);
+    for (int glyph = 0; glyph <= FONT_COUNT; ++glyph)
+    {
+        for (int row = 0; row < FONT_HEIGHT; ++row)
+        {
+            const unsigned bits = glyph == FONT_SOLID ? 0x1Fu : FONT_GLYPHS[glyph * FONT_HEIGHT + row];
+            for (int column = 0; column < FONT_WIDTH; ++column)
+            {
+                if (bits & (0x10u >> column))
+                    pixels[row * atlasWidth + glyph * FONT_WIDTH + column] = 255;
+            }
+        }
+    }
+    glGenTextures(1, &hud.atlas);
+    glBindTexture(GL_TEXTURE_2D, hud.atlas);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlasWidth, FONT_HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, pixels.data());
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   // No mipmaps; the shader uses texelFetch
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    UTrackTexture(hud.atlas, VRAM_TEXTURES, GLsizeiptr(pixels.size()));
+
+    glGenVertexArrays(1, &hud.vao);
+    glGenBuffers(1, &hud.instanceBuffer);
+    glBindVertexArray(hud.vao);
+    glBindBuffer(GL_ARRAY_BUFFER, hud.instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, HUD_MAX_QUADS * sizeof(UHudQuad), NULL, GL_STREAM_DRAW);
+    UTrackBuffer(hud.instanceBuffer, VRAM_BUFFERS, HUD_MAX_QUADS * sizeof(UHudQuad));
+    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, sizeof(UHudQuad), 0);
+    glVertexAttribIPointer(1, 1, GL_UNSIGNED_INT, sizeof(UHudQuad), (void*)(sizeof(float) * 4));
+    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(UHudQuad), (void*)(sizeof(float) * 4 + sizeof(GLuint)));
+    for (GLuint attribute = 0; attribute < 3; ++attribute)
+    {
+        glVertexAttribDivisor(attribute, 1);
+        glEnableVertexAttribArray(attribute);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // Reserved once; the quads are rebuilt in place every frame
+    hud.quads.reserve(HUD_MAX_QUADS);
+    hud.textQuads = 0;
+    hud.isVisible = false;
+    hud.firstGpuFrame = hud.gpuFrameCount = 0;
+    hud.isTimingGpu = false;
+    if (gProfiler.hasGpuTimers)
+        glGenQueries(2 * HUD_GPU_FRAMES, hud.gpuQueries[0]);
+}
+
+
+// Showing the HUD starts its graph and averages over
+void USetHudVisible(UHud& hud, bool isVisible)
+{
+    hud.isVisible = isVisible;
+    if (!isVisible)
+        return;
+
+    std::fill(hud.frameTimes, hud.frameTimes + HUD_HISTORY, 0.0f);
+    hud.nextFrameTime = 0;
+    hud.textQuads = 0;
+    hud.lastFrame = -1.0;                                   // The first frame only starts the clock
+    hud.lastText = -HUD_TEXT_PERIOD;                        // Due once a frame time is known
+    hud.frameSum = hud.cpuSum = hud.gpuSum = 0.0;
+    hud.frameCount = hud.cpuCount = hud.gpuCount = 0;
+    hud.firstGpuFrame = hud.gpuFrameCount = 0;              // Queries left from before it was hidden are dropped
+}
+
+
+/* Marks the start of the frame's CPU and GPU work, and adds up the GPU times of earlier frames the GPU has
+ * finished, without waiting for the others. A frame goes untimed on the GPU if HUD_GPU_FRAMES are pending.
+ */
+void UBeginHudFrame(UHud& hud)
+{
+    if (!hud.isVisible)
+        return;
+    hud.frameStart = UProfileClock();
+
+    while (hud.gpuFrameCount > 0)
+    {
+        const GLuint* queries = hud.gpuQueries[hud.firstGpuFrame];
+        GLint isAvailable = GL_FALSE;
+        glGetQueryObjectiv(queries[1], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (!isAvailable)
+            break;
+
+        GLuint64 start = 0, end = 0;
+        glGetQueryObjectui64v(queries[0], GL_QUERY_RESULT, &start);
+        glGetQueryObjectui64v(queries[1], GL_QUERY_RESULT, &end);
+        hud.gpuSum += double(end - start) / 1e6;
+        ++hud.gpuCount;
+        hud.firstGpuFrame = (hud.firstGpuFrame + 1) % HUD_GPU_FRAMES;
+        --hud.gpuFrameCount;
+    }
+
+    hud.isTimingGpu = gProfiler.hasGpuTimers && hud.gpuFrameCount < HUD_GPU_FRAMES;
+    if (hud.isTimingGpu)
+        glQueryCounter(hud.gpuQueries[(hud.firstGpuFrame + hud.gpuFrameCount) % HUD_GPU_FRAMES][0], GL_TIMESTAMP);
+}
 
+
+// Appends one quad per character that has a glyph and returns the text's width in pixels
+static float UHudText(UHud& hud, float x, float y, const char* text, GLuint color)
+{
+    const float advance = float((FONT_WIDTH + 1) * HUD_SCALE);
+    const float start = x;
+    for (; *text; ++text, x += advance)
+    {
+        const int glyph = int((unsigned char)*text) - FONT_FIRST;
+        if (glyph <= 0 || glyph >= FONT_COUNT || hud.quads.size() == HUD_MAX_QUADS)
+            continue;   // Spaces, and characters the font doesn't have, leave a gap
+        const UHudQuad quad = { x, y, float(FONT_WIDTH * HUD_SCALE), float(FONT_HEIGHT * HUD_SCALE), GLuint(glyph), color };
+        hud.quads.push_back(quad);
+    }
+    return x - start;
+}
+
+
+/* Lays out the panel and its text from the averages of the period that just ended, and starts the next
+ * period. A gap is left below the timings for the graph, which is laid out every frame.
+ */
+static void ULayoutHudText(UHud& hud, const UFrameStats& stats)
+{
+    const GLuint textColor = UHudColor(235, 235, 235, 255);
+    const GLuint dimColor = UHudColor(160, 160, 160, 255);
+    const float margin = float(4 * HUD_SCALE);
+    const float lineHeight = float((FONT_HEIGHT + 3) * HUD_SCALE);
+    const float left = 2.0f * margin;
+    float y = 2.0f * margin;
+    float width = float(HUD_HISTORY * HUD_SCALE);
+    char text[64];
+
+    // The panel comes first so everything else is drawn over it; it's sized at the end
+    hud.quads.clear();
+    const UHudQuad panel = { margin, margin, 0.0f, 0.0f, GLuint(FONT_SOLID), UHudColor(0, 0, 0, 160) };
+    hud.quads.push_back(panel);
+
+    const double frameTime = hud.frameCount > 0 ? hud.frameSum / hud.frameCount : 0.0;
+    snprintf(text, sizeof(text), "%5.1f FPS %6.2f ms", frameTime > 0.0 ? 1000.0 / frameTime : 0.0, frameTime);
+    width = std::max(width, UHudText(hud, left, y, text, textColor));
+    y += lineHeight;
+
+    const double cpuTime = hud.cpuCount > 0 ? hud.cpuSum / hud.cpuCount : 0.0;
+    if (hud.gpuCount > 0)
+        snprintf(text, sizeof(text), "CPU %6.2f ms  GPU %6.2f ms", cpuTime, hud.gpuSum / hud.gpuCount);
+    else
+        snprintf(text, sizeof(text), "CPU %6.2f ms  GPU      - ms", cpuTime);
+    width = std::max(width, UHudText(hud, left, y, text, textColor));
+    y += lineHeight;
+
+    hud.graphTop = y;
+    y += float(HUD_GRAPH_HEIGHT * HUD_SCALE) + lineHeight - float(FONT_HEIGHT * HUD_SCALE);
+
+    // Counters of the last frame, the HUD's own draw not included
+    const struct
+    {
+        const char* label;
+        GLuint value;
+    } counters[] =
+    {
+        { "Draw calls", stats.draws },
+        { "Triangles", stats.triangles },
+        { "Texture binds", stats.textureBinds },
+        { "Program binds", stats.programBinds },
+        { "Uniform uploads", stats.uniformUploads },
+        { "Objects", stats.objects },
+        { "Culled", stats.objects - stats.visibleObjects },
     };
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+    {
+        snprintf(text, sizeof(text), "%-15s %9u", counters[i].label, counters[i].value);
+        width = std::max(width, UHudText(hud, left, y, text, textColor));
+        y += lineHeight;
+    }
 
-    GLfloat tissueV[] = {
-        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Front triangle
-       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
-        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
+    static const char* const categories[VRAM_CATEGORIES] = { "Textures", "Meshes", "Render targets", "Lighting", "Buffers" };
+    GLsizeiptr totalMemory = 0;
+    for (int i = 0; i < VRAM_CATEGORIES; ++i)
+        totalMemory += gVideoMemory.bytes[i];
+    snprintf(text, sizeof(text), "%-15s %9.1f MiB", "VRAM", totalMemory / 1048576.0);
+    width = std::max(width, UHudText(hud, left, y, text, textColor));
+    y += lineHeight;
+    for (int i = 0; i < VRAM_CATEGORIES; ++i)
+    {
+        snprintf(text, sizeof(text), "  %-13s %9.1f", categories[i], gVideoMemory.bytes[i] / 1048576.0);
+        width = std::max(width, UHudText(hud, left, y, text, dimColor));
+        y += lineHeight;
+    }
 
-        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,     // Left triangle
-       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,
-       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
+    hud.quads[0].width = width + 2.0f * margin;
+    hud.quads[0].height = y - lineHeight + float(FONT_HEIGHT * HUD_SCALE) + margin;
+    hud.textQuads = hud.quads.size();
 
-        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Back triangle
-       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
-        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
+    hud.frameSum = hud.cpuSum = hud.gpuSum = 0.0;
+    hud.frameCount = hud.cpuCount = hud.gpuCount = 0;
+}
 
-        0.0f,  1.0f,  0.0f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,     // Right triangle
-        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
-        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,
 
-       -0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,     // Base of pyramid left
-       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f,
-        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 1.0f,
+/* Draws the HUD over the frame with one instanced draw: the panel and text, laid out every HUD_TEXT_PERIOD,
+ * then a bar per frame time, oldest on the left, green up to 60 Hz, yellow up to 30 Hz and red beyond.
+ * The frame's CPU and GPU times end here, before the HUD's own work.
+ */
+void UDrawHud(UHud& hud, const UFrameStats& stats)
+{
+    if (!hud.isVisible)
+        return;
+    UPROFILE_GPU_SCOPE("HUD");
 
-        0.5f,  0.0f,  0.5f,    0.0f, 0.0f, -1.0f,       0.0f, 0.0f,     // Base of pyramid right
-       -0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 0.0f,
-        0.5f,  0.0f, -0.5f,    0.0f, 0.0f, -1.0f,       1.0f, 1.0f
+    if (hud.isTimingGpu)
+    {
+        glQueryCounter(hud.gpuQueries[(hud.firstGpuFrame + hud.gpuFrameCount) % HUD_GPU_FRAMES][1], GL_TIMESTAMP);
+        ++hud.gpuFrameCount;
+    }
+    hud.cpuSum += double(UProfileClock() - hud.frameStart) / 1e6;
+    ++hud.cpuCount;
+
+    const double now = glfwGetTime();
+    if (hud.lastFrame >= 0.0)
+    {
+        const float frameTime = float((now - hud.lastFrame) * 1000.0);
+        hud.frameTimes[hud.nextFrameTime] = frameTime;
+        hud.nextFrameTime = (hud.nextFrameTime + 1) % HUD_HISTORY;
+        hud.frameSum += frameTime;
+        ++hud.frameCount;
+    }
+    hud.lastFrame = now;
+
+    glActiveTexture(GL_TEXTURE0);
+    if (hud.frameCount > 0 && now - hud.lastText >= HUD_TEXT_PERIOD)
+    {
+        ULayoutHudText(hud, stats);
+        hud.lastText = now;
+    }
+    if (hud.textQuads == 0)
+        return;
+
+    // Graph, with a line at 60 Hz
+    hud.quads.resize(hud.textQuads);
+    const float left = float(8 * HUD_SCALE);
+    const float graphHeight = float(HUD_GRAPH_HEIGHT * HUD_SCALE);
+    const float graphBottom = hud.graphTop + graphHeight;
+    const UHudQuad line = { left, graphBottom - graphHeight * (1000.0f / 60.0f) / HUD_GRAPH_MS, float(HUD_HISTORY * HUD_SCALE), 1.0f,
+        GLuint(FONT_SOLID), UHudColor(255, 255, 255, 96) };
+    hud.quads.push_back(line);
+    for (int i = 0; i < HUD_HISTORY && hud.quads.size() < HUD_MAX_QUADS; ++i)
+    {
+        const float time = hud.frameTimes[(hud.nextFrameTime + i) % HUD_HISTORY];
+        if (time <= 0.0f)
+            continue;
+        const float height = std::max(1.0f, std::min(time / HUD_GRAPH_MS, 1.0f) * graphHeight);
+        const GLuint color = time <= 1000.0f / 59.0f ? UHudColor(64, 220, 64, 255)
+            : time <= 1000.0f / 29.0f ? UHudColor(240, 200, 40, 255) : UHudColor(240, 60, 40, 255);
+        const UHudQuad bar = { left + float(i * HUD_SCALE), graphBottom - height, float(HUD_SCALE), height, GLuint(FONT_SOLID), color };
+        hud.quads.push_back(bar);
+    }
 
+    // The buffer is orphaned, so the upload doesn't wait for the GPU to finish drawing last frame's quads
+    glBindBuffer(GL_ARRAY_BUFFER, hud.instanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, HUD_MAX_QUADS * sizeof(UHudQuad), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, hud.quads.size() * sizeof(UHudQuad), hud.quads.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    int width, height;
+    glfwGetFramebufferSize(gWindow, &width, &height);
+    const GLuint programId = UGetShaderVariant(gHudShaders, 0);
+    glUseProgram(programId);
+    glUniform2f(glGetUniformLocation(programId, "viewportSize"), float(width), float(height));
+    glUniform2f(glGetUniformLocation(programId, "glyphSize"), float(FONT_WIDTH), float(FONT_HEIGHT));
+    glBindTexture(GL_TEXTURE_2D, hud.atlas);
+
+    // Quads blend over the frame in order, so the panel lies under the text and the graph
+    glDisable(GL_DEPTH_TEST);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glBindVertexArray(hud.vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(hud.quads.size()));
+    glBindVertexArray(0);
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glUseProgram(0);
+}
+
+
+void UDestroyHud(UHud& hud)
+{
+    glDeleteVertexArrays(1, &hud.vao);
+    UDeleteBuffers(1, &hud.instanceBuffer);
+    UDeleteTextures(1, &hud.atlas);
+    if (gProfiler.hasGpuTimers)
+        glDeleteQueries(2 * HUD_GPU_FRAMES, hud.gpuQueries[0]);
+    hud.vao = hud.instanceBuffer = hud.atlas = 0;
+    hud.isVisible = false;
+}
+
+
+/* Entity transforms */
+
+/* Appends an entity. Depth-first order is kept by only accepting a parent whose subtree currently ends at the
+ * end of the store, i.e. the last entity created or one of its ancestors. Returns NO_PARENT otherwise.
+ */
+GLuint UCreateEntity(UTransformStore& store, GLuint parent, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    const GLuint entity = GLuint(store.position.size());
+    if (parent != NO_PARENT && (parent >= entity || store.subtreeEnd[parent] != entity))
+        return NO_PARENT;
+
+    store.position.push_back(position);
+    store.rotation.push_back(rotation);
+    store.scale.push_back(scale);
+    store.world.push_back(glm::mat4(1.0f));
+    store.parent.push_back(parent);
+    store.subtreeEnd.push_back(entity + 1);
+    store.dirty.push_back(entity);
+    ++store.version;
+    if (parent == NO_PARENT)
+        store.roots.push_back(entity);
+
+    // Grow the subtree of every ancestor to include the new entity
+    for (GLuint ancestor = parent; ancestor != NO_PARENT; ancestor = store.parent[ancestor])
+        store.subtreeEnd[ancestor] = entity + 1;
+    return entity;
+}
+
+
+// Changes an entity's local transform; its whole subtree is marked dirty since their world matrices depend on it
+void USetEntityTransform(UTransformStore& store, GLuint entity, const glm::vec3& position, const glm::quat& rotation, const glm::vec3& scale)
+{
+    store.position[entity] = position;
+    store.rotation[entity] = rotation;
+    store.scale[entity] = scale;
+    store.dirty.push_back(entity);
+    ++store.version;
+}
+
+
+/* Rebuilds the world matrices of the dirty subtrees, so the cost follows what moved rather than the scene
+ * size. Subtrees nested inside another dirty one are dropped, the rest are disjoint ranges spread over the
+ * workers; within a range one linear pass suffices because parents precede their children. The local matrix
+ * is composed directly from the rotation matrix columns instead of multiplying three 4x4 matrices:
+ * translate * scale * rotate (the order the renderer has always used) only scales the rows of the rotation
+ * and sets the last column.
+ */
+void UUpdateTransforms(UTransformStore& store)
+{
+    UPROFILE_SCOPE("Update transforms");
+    std::vector<GLuint>& dirty = store.dirty;
+    if (dirty.empty())
+        return;
+    std::sort(dirty.begin(), dirty.end());
+    size_t ranges = 0;
+    for (size_t i = 0; i < dirty.size(); ++i)
+    {
+        if (ranges == 0 || dirty[i] >= store.subtreeEnd[dirty[ranges - 1]])
+            dirty[ranges++] = dirty[i];
+    }
+    dirty.resize(ranges);
+
+    const glm::vec3* position = store.position.data();
+    const glm::quat* rotation = store.rotation.data();
+    const glm::vec3* scale = store.scale.data();
+    const GLuint* parent = store.parent.data();
+    const GLuint* subtreeEnd = store.subtreeEnd.data();
+    const GLuint* first = dirty.data();
+    glm::mat4* world = store.world.data();
+
+    UParallelFor(dirty.size(), 1024, [=](size_t begin, size_t end)
+    {
+        for (size_t r = begin; r < end; ++r)
+        {
+            for (GLuint i = first[r]; i < subtreeEnd[first[r]]; ++i)
+            {
+                const glm::mat3 m = glm::mat3_cast(rotation[i]);
+                glm::mat4 local;
+                local[0] = glm::vec4(m[0] * scale[i], 0.0f);
+                local[1] = glm::vec4(m[1] * scale[i], 0.0f);
+                local[2] = glm::vec4(m[2] * scale[i], 0.0f);
+                local[3] = glm::vec4(position[i], 1.0f);
+                world[i] = parent[i] == NO_PARENT ? local : world[parent[i]] * local;
+            }
+        }
+    });
+    dirty.clear();
+}
+
+
+// Times full updates (every subtree dirty) and moving a single subtree for 'count' entities
+void UBenchmarkTransforms(size_t count)
+{
+    UTransformStore store;
+    count = std::max<size_t>(count, 1);
+    for (size_t i = 0; i < count; ++i)
+    {
+        const float f = float(i);
+        const GLuint parent = i % 4 ? GLuint(i - 1) : NO_PARENT;     // Chains of four, like a small rig
+        UCreateEntity(store, parent, glm::vec3(f, 0.5f * f, -f), glm::angleAxis(f, glm::normalize(glm::vec3(1.0f, f, 2.0f))), glm::vec3(1.0f + f * 1e-6f));
+    }
+
+    const int frames = 20;
+    double full = 0.0, single = 0.0;
+    for (int frame = 0; frame < frames; ++frame)
+    {
+        store.dirty = store.roots;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        UUpdateTransforms(store);
+        full += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        const GLuint root = store.roots[frame % store.roots.size()];
+        start = std::chrono::steady_clock::now();
+        USetEntityTransform(store, root, store.position[root], store.rotation[root], store.scale[root]);
+        UUpdateTransforms(store);
+        single += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Check against the straightforward matrix product
+    const size_t probe = count / 2;
+    glm::mat4 reference(1.0f);
+    for (GLuint i = GLuint(probe); i != NO_PARENT; i = store.parent[i])
+        reference = glm::translate(store.position[i]) * glm::scale(store.scale[i]) * glm::mat4_cast(store.rotation[i]) * reference;
+    float error = 0.0f;
+    for (int c = 0; c < 4; ++c)
+        error = std::max(error, glm::length(reference[c] - store.world[probe][c]));
+
+    cout << "INFO: " << count << " transforms on " << gJobs.threads.size() + 1 << " threads: "
+         << full / frames * 1000.0 << " ms all dirty, " << single / frames * 1000.0 << " ms one subtree moved (max error " << error << ")" << endl;
+}
+
+
+/* Clustered lighting */
+
+void UCreateClusteredLights(UClusteredLights& clustered)
+{
+    glGenBuffers(1, &clustered.lightBuffer);
+    glGenBuffers(1, &clustered.clusterBuffer);
+    glGenBuffers(1, &clustered.indexBuffer);
+    clustered.lightBytes = clustered.indexBytes = 0;
+
+    // The grid itself never changes size
+    clustered.clusters.assign(2 * CLUSTER_X * CLUSTER_Y * CLUSTER_Z, 0);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustered.clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, clustered.clusters.size() * sizeof(GLuint), NULL, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    UTrackBuffer(clustered.clusterBuffer, VRAM_LIGHTING, GLsizeiptr(clustered.clusters.size() * sizeof(GLuint)));
+    UTrackBuffer(clustered.lightBuffer, VRAM_LIGHTING, 0);      // Sized by the first upload
+    UTrackBuffer(clustered.indexBuffer, VRAM_LIGHTING, 0);
+}
+
+
+void UDestroyClusteredLights(UClusteredLights& clustered)
+{
+    UDeleteBuffers(1, &clustered.lightBuffer);
+    UDeleteBuffers(1, &clustered.clusterBuffer);
+    UDeleteBuffers(1, &clustered.indexBuffer);
+}
+
+
+// Tile range [first, last] covered by the projected interval [low, high] in normalized device coordinates
+static bool UTileRange(float low, float high, GLuint tiles, GLuint& first, GLuint& last)
+{
+    if (high < -1.0f || low > 1.0f)
+        return false;
+    first = GLuint(glm::clamp((low + 1.0f) * 0.5f * tiles, 0.0f, tiles - 1.0f));
+    last = GLuint(glm::clamp((high + 1.0f) * 0.5f * tiles, 0.0f, tiles - 1.0f));
+    return true;
+}
+
+
+/* Builds the per cluster light lists on the CPU. Depth slices are independent, so each one is a parallel
+ * job: it finds the lights whose view space bounds overlap the slice, takes the screen rectangle of the
+ * light's bounding box over the slice's depth range (a conservative fit), and counts then fills its clusters.
+ * Unbounded lights go into every cluster.
+ */
+void UAssignLights(UClusteredLights& clustered, const std::vector<USceneLight>& lights, const glm::mat4& view, const glm::mat4& projection, float nearPlane, float farPlane)
+{
+    UPROFILE_SCOPE("Assign lights");
+    const size_t count = lights.size();
+    UArenaScope scope(UThreadArena());
+    UArenaVector<glm::vec4> viewSpheres(count, glm::vec4(0.0f), UArenaAllocator<glm::vec4>(scope.arena));  // View space center and radius, radius < 0 if unbounded
+    clustered.lights.resize(2 * count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        clustered.lights[2 * i] = glm::vec4(lights[i].position, std::max(lights[i].radius, 0.0f));
+        clustered.lights[2 * i + 1] = glm::vec4(lights[i].color, 1.0f);
+        viewSpheres[i] = glm::vec4(glm::vec3(view * glm::vec4(lights[i].position, 1.0f)), lights[i].radius > 0.0f ? lights[i].radius : -1.0f);
+    }
+    clustered.sliceLists.resize(CLUSTER_Z);
+
+    const glm::vec4* spheres = viewSpheres.data();
+    std::vector<GLuint>* sliceLists = clustered.sliceLists.data();
+    GLuint* clusters = clustered.clusters.data();
+    const float scaleX = projection[0][0];
+    const float scaleY = projection[1][1];
+    const float depthRatio = farPlane / nearPlane;
+
+    UParallelFor(CLUSTER_Z, 1, [=](size_t begin, size_t end)
+    {
+        for (size_t z = begin; z < end; ++z)
+        {
+            const float sliceNear = nearPlane * std::pow(depthRatio, float(z) / CLUSTER_Z);
+            const float sliceFar = nearPlane * std::pow(depthRatio, float(z + 1) / CLUSTER_Z);
+
+            // Light, x0, x1, y0, y1 per light touching the slice, in the arena of the thread running the job
+            UArenaScope sliceScope(UThreadArena());
+            UArenaVector<GLuint> rects((UArenaAllocator<GLuint>(sliceScope.arena)));
+            for (size_t i = 0; i < count; ++i)
+            {
+                const glm::vec4& sphere = spheres[i];
+                GLuint x0 = 0, x1 = CLUSTER_X - 1, y0 = 0, y1 = CLUSTER_Y - 1;
+                if (sphere.w > 0.0f)
+                {
+                    // View space looks down -Z, so depth is -z
+                    const float nearDepth = std::max(sliceNear, -sphere.z - sphere.w);
+                    const float farDepth = std::min(sliceFar, -sphere.z + sphere.w);
+                    if (nearDepth > farDepth)
+                        continue;
+
+                    // The box edges project furthest out at whichever end of the depth range is closer
+                    const float left = sphere.x - sphere.w, right = sphere.x + sphere.w;
+                    const float bottom = sphere.y - sphere.w, top = sphere.y + sphere.w;
+                    if (!UTileRange(std::min(left / nearDepth, left / farDepth) * scaleX, std::max(right / nearDepth, right / farDepth) * scaleX, CLUSTER_X, x0, x1)
+                        || !UTileRange(std::min(bottom / nearDepth, bottom / farDepth) * scaleY, std::max(top / nearDepth, top / farDepth) * scaleY, CLUSTER_Y, y0, y1))
+                        continue;
+                }
+                rects.push_back(GLuint(i));
+                rects.push_back(x0);
+                rects.push_back(x1);
+                rects.push_back(y0);
+                rects.push_back(y1);
+            }
+
+            // Count the lights of each cluster, turn the counts into offsets, then fill the slice's list
+            GLuint* grid = clusters + 2 * z * CLUSTER_X * CLUSTER_Y;
+            for (GLuint c = 0; c < CLUSTER_X * CLUSTER_Y; ++c)
+                grid[2 * c + 1] = 0;
+            for (size_t r = 0; r < rects.size(); r += 5)
+            {
+                for (GLuint y = rects[r + 3]; y <= rects[r + 4]; ++y)
+                    for (GLuint x = rects[r + 1]; x <= rects[r + 2]; ++x)
+                        ++grid[2 * (y * CLUSTER_X + x) + 1];
+            }
+            GLuint total = 0;
+            for (GLuint c = 0; c < CLUSTER_X * CLUSTER_Y; ++c)
+            {
+                grid[2 * c] = total;
+                total += grid[2 * c + 1];
+                grid[2 * c + 1] = 0;
+            }
+
+            std::vector<GLuint>& list = sliceLists[z];
+            list.resize(total);
+            for (size_t r = 0; r < rects.size(); r += 5)
+            {
+                for (GLuint y = rects[r + 3]; y <= rects[r + 4]; ++y)
+                {
+                    for (GLuint x = rects[r + 1]; x <= rects[r + 2]; ++x)
+                    {
+                        GLuint* cluster = grid + 2 * (y * CLUSTER_X + x);
+                        list[cluster[0] + cluster[1]++] = rects[r];
+                    }
+                }
+            }
+        }
+    });
+
+    // Join the slice lists into one index list, moving each slice's offsets along with it
+    clustered.indices.clear();
+    for (GLuint z = 0; z < CLUSTER_Z; ++z)
+    {
+        const GLuint base = GLuint(clustered.indices.size());
+        GLuint* grid = clusters + 2 * z * CLUSTER_X * CLUSTER_Y;
+        for (GLuint c = 0; c < CLUSTER_X * CLUSTER_Y; ++c)
+            grid[2 * c] += base;
+        clustered.indices.insert(clustered.indices.end(), sliceLists[z].begin(), sliceLists[z].end());
+    }
+}
+
+
+// Copies one frame's light data into a storage buffer, growing it when needed, and binds it to its index
+static void UUploadStorage(GLuint buffer, GLuint binding, const void* data, GLsizeiptr bytes, GLsizeiptr& capacity)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+    if (bytes > capacity)
+    {
+        capacity = std::max(bytes, 2 * capacity);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, capacity, NULL, GL_DYNAMIC_DRAW);
+        UTrackBuffer(buffer, VRAM_LIGHTING, capacity);
+    }
+    if (bytes > 0)
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, bytes, data);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, buffer);
+}
+
+
+void UUploadClusteredLights(UClusteredLights& clustered, const UClusteredLights& assigned)
+{
+    GLsizeiptr clusterBytes = assigned.clusters.size() * sizeof(GLuint);
+    UUploadStorage(clustered.lightBuffer, 0, assigned.lights.data(), assigned.lights.size() * sizeof(glm::vec4), clustered.lightBytes);
+    UUploadStorage(clustered.clusterBuffer, 1, assigned.clusters.data(), clusterBytes, clusterBytes);
+    UUploadStorage(clustered.indexBuffer, 2, assigned.indices.data(), assigned.indices.size() * sizeof(GLuint), clustered.indexBytes);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+// Times the light assignment for 'count' bounded lights scattered around the desk, as seen by the default camera
+void UBenchmarkLights(size_t count)
+{
+    std::vector<USceneLight> lights(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        // A deterministic scatter over a 20 x 4 x 20 volume
+        const float f = float(i);
+        lights[i].position = glm::vec3(std::fmod(f * 7.31f, 20.0f) - 10.0f, std::fmod(f * 3.17f, 4.0f) - 2.0f, std::fmod(f * 5.53f, 20.0f) - 10.0f);
+        lights[i].color = glm::vec3(1.0f);
+        lights[i].scale = 0.0f;
+        lights[i].orbit = false;
+        lights[i].radius = 1.5f;
+        lights[i].shadow = false;
+    }
+
+    UClusteredLights clustered;
+    clustered.clusters.assign(2 * CLUSTER_X * CLUSTER_Y * CLUSTER_Z, 0);
+    const glm::mat4 view = glm::lookAt(glm::vec3(1.0f, 1.0f, 8.0f), glm::vec3(1.0f, 1.0f, 7.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+    const glm::mat4 projection = glm::perspective(glm::radians(45.0f), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+
+    const int frames = 50;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; ++frame)
+        UAssignLights(clustered, lights, view, projection, 0.1f, 100.0f);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    GLuint busiest = 0, occupied = 0;
+    for (size_t c = 1; c < clustered.clusters.size(); c += 2)
+    {
+        busiest = std::max(busiest, clustered.clusters[c]);
+        occupied += clustered.clusters[c] ? 1 : 0;
+    }
+    cout << "INFO: " << count << " lights assigned to " << CLUSTER_X * CLUSTER_Y * CLUSTER_Z << " clusters in " << seconds / frames * 1000.0
+         << " ms; " << clustered.indices.size() << " entries, " << occupied << " clusters lit, at most " << busiest << " lights per cluster" << endl;
+}
+
+
+/* Deferred renderer */
+
+// (Re)creates the G-buffer at the given size
+bool UCreateGBuffer(UGBuffer& gbuffer, int width, int height)
+{
+    if (!gbuffer.framebuffer)
+    {
+        glGenFramebuffers(1, &gbuffer.framebuffer);
+        glGenBuffers(1, &gbuffer.materialBuffer);
+        UTrackBuffer(gbuffer.materialBuffer, VRAM_BUFFERS, 0);     // Sized on first use
+        glGenVertexArrays(1, &gbuffer.emptyVao);
+    }
+    UDeleteTextures(1, &gbuffer.albedo);
+    UDeleteTextures(1, &gbuffer.normal);
+    UDeleteTextures(1, &gbuffer.ambient);
+    UDeleteTextures(1, &gbuffer.depth);
+    gbuffer.width = width;
+    gbuffer.height = height;
+
+    struct Target
+    {
+        GLuint* texture;
+        GLint internalFormat;
+        GLenum format, type, attachment;
+    };
+    const Target targets[] =
+    {
+        { &gbuffer.albedo, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE, GL_COLOR_ATTACHMENT0 },
+        { &gbuffer.normal, GL_RG16_SNORM, GL_RG, GL_SHORT, GL_COLOR_ATTACHMENT1 },
+        { &gbuffer.ambient, GL_R11F_G11F_B10F, GL_RGB, GL_FLOAT, GL_COLOR_ATTACHMENT2 },
+        { &gbuffer.depth, GL_DEPTH_COMPONENT32F, GL_DEPTH_COMPONENT, GL_FLOAT, GL_DEPTH_ATTACHMENT },
     };
 
-    GLfloat wristPadV[] = {
-       // Bottom square
-      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
-       4.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 1
-       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
-       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
-      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
-      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.framebuffer);
+    for (int i = 0; i < 4; ++i)
+    {
+        glGenTextures(1, targets[i].texture);
+        glBindTexture(GL_TEXTURE_2D, *targets[i].texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, targets[i].internalFormat, width, height, 0, targets[i].format, targets[i].type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, targets[i].attachment, GL_TEXTURE_2D, *targets[i].texture, 0);
+        UTrackTexture(*targets[i].texture, VRAM_RENDER_TARGETS, GLsizeiptr(width) * height * 4);   // Every format is 32 bits per texel
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+    glDrawBuffers(3, drawBuffers);
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (!complete)
+        cout << "Failed to create the " << width << "x" << height << " G-buffer, using the forward renderer" << endl;
+    return complete;
+}
+
+
+void UDestroyGBuffer(UGBuffer& gbuffer)
+{
+    UDeleteTextures(1, &gbuffer.albedo);
+    UDeleteTextures(1, &gbuffer.normal);
+    UDeleteTextures(1, &gbuffer.ambient);
+    UDeleteTextures(1, &gbuffer.depth);
+    UDeleteBuffers(1, &gbuffer.materialBuffer);
+    glDeleteFramebuffers(1, &gbuffer.framebuffer);
+    glDeleteVertexArrays(1, &gbuffer.emptyVao);
+    memset(&gbuffer, 0, sizeof(gbuffer));
+}
+
+
+/* Renders a synthetic scene with both renderers: 'overdraw' screen filling slabs drawn back to front, lit by
+ * a number of small lights in front of them. Forward shading pays for every light on every covered layer,
+ * deferred pays a fixed G-buffer cost plus the lights once per pixel; the table shows where they cross.
+ */
+void UBenchmarkRenderers()
+{
+    const int lightCounts[] = { 1, 8, 32, 128, 512, 2048 };
+    const int overdraws[] = { 1, 4, 16 };
+    const int warmupFrames = 5;
+    const int frames = 30;
+
+    // Swap the desk scene out and the benchmark scene in; they share the materials
+    UScene bench;
+    USceneMesh slab;
+    slab.lods[0] = slab.lods[1] = slab.lods[2] = gMesh.tissueBox;
+    bench.meshes.push_back(slab);
+    bench.materials = gScene.materials;
+    bench.ambientStrength = gScene.ambientStrength;
+    std::swap(gScene, bench);
+
+    const glm::vec3 savedCamera = gCamera.Position;
+    const bool savedDeferred = gIsDeferred;
+    gCamera.Position = glm::vec3(1.0f, 1.0f, 8.0f);
+    glfwSwapInterval(0);
+
+    // Runs before the simulation thread starts, so each frame simulates and renders in turn
+    UFramePacket packet;
+    packet.clusters.clusters.assign(2 * CLUSTER_X * CLUSTER_Y * CLUSTER_Z, 0);
+
+    cout << "INFO: Renderer benchmark, milliseconds per frame" << endl;
+    cout << "INFO: lights\toverdraw\tforward\tdeferred" << endl;
+    for (int o = 0; o < 3; ++o)
+    {
+        // Slabs 2 units in front of the camera cover the whole view; the farthest is drawn first
+        gScene.objects.clear();
+        gScene.transforms = UTransformStore();
+        for (int layer = 0; layer < overdraws[o]; ++layer)
+        {
+            USceneObject object;
+            object.mesh = 0;
+            object.material = 0;
+            object.lightmapMesh = NO_MESH;
+            object.entity = UCreateEntity(gScene.transforms, NO_PARENT, glm::vec3(1.0f, 1.0f, 6.0f - 0.1f * (overdraws[o] - 1 - layer)),
+                glm::quat(1.0f, 0.0f, 0.0f, 0.0f), glm::vec3(8.0f, 6.0f, 0.01f));
+            gScene.objects.push_back(object);
+        }
+
+        int crossover = -1;
+        for (int l = 0; l < 6; ++l)
+        {
+            gScene.lights.resize(lightCounts[l]);
+            for (int i = 0; i < lightCounts[l]; ++i)
+            {
+                // A deterministic scatter just in front of the slabs
+                const float f = float(i);
+                USceneLight& light = gScene.lights[i];
+                light.position = glm::vec3(std::fmod(f * 0.731f, 4.0f) - 1.0f, std::fmod(f * 0.317f, 3.0f) - 0.5f, 6.2f + std::fmod(f * 0.553f, 0.8f));
+                light.color = glm::vec3(0.2f);
+                light.scale = 0.0f;
+                light.orbit = false;
+                light.radius = 0.75f;
+                light.shadow = false;
+            }
+
+            double milliseconds[2];
+            for (int mode = 0; mode < 2; ++mode)
+            {
+                gIsDeferred = mode == 1;
+                for (int frame = 0; frame < warmupFrames; ++frame)
+                {
+                    UResetFrameArena(UThreadArena());
+                    USimulate(packet, 0.0);
+                    URender(packet);
+                }
+                glFinish();
+
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                for (int frame = 0; frame < frames; ++frame)
+                {
+                    UResetFrameArena(UThreadArena());
+                    USimulate(packet, 0.0);
+                    URender(packet);
+                    glfwPollEvents();
+                }
+                glFinish();
+                milliseconds[mode] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000.0 / frames;
+            }
+            if (crossover < 0 && milliseconds[1] < milliseconds[0])
+                crossover = lightCounts[l];
+
+            cout << "INFO: " << lightCounts[l] << "\t" << overdraws[o] << "\t" << milliseconds[0] << "\t" << milliseconds[1] << endl;
+        }
+        if (crossover < 0)
+            cout << "INFO: Overdraw " << overdraws[o] << ": forward is faster at every light count" << endl;
+        else
+            cout << "INFO: Overdraw " << overdraws[o] << ": deferred is faster from " << crossover << " lights" << endl;
+    }
 
-       // Top sqaure
-      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 0.0f, // index 4
-       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 0.0f, // index 5
-       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 1.0f, // index 6
-       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  1.0f, 1.0f, // index 6
-      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 1.0f, // index 7
-      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, 0.0f,  0.0f, 0.0f, // index 4
+    std::swap(gScene, bench);
+    gCamera.Position = savedCamera;
+    gIsDeferred = savedDeferred;
+}
 
-       // Left square
-      -2.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 0
-      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 3
-      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 4
-      -2.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 4
-      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
-      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 7
 
-       // Right sqaure
-       4.0f,  0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 1
-       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 2
-       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 5
-       4.0f,  0.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 5
-       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 2
-       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 6
+/* Point light shadows */
 
-       // Back square
-      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 3
-       4.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f, // index 2
-       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 6
-       4.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f, // index 6
-      -2.0f,  0.0f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f, // index 3
-      -2.0f,  0.5f, -1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f, // index 7
+void UCreateShadowMap(UShadowMap& shadow)
+{
+    glGenFramebuffers(1, &shadow.framebuffer);
+    glGenTextures(2, shadow.cubes);
+    for (int i = 0; i < 2; ++i)
+    {
+        glBindTexture(GL_TEXTURE_CUBE_MAP, shadow.cubes[i]);
+        for (int face = 0; face < 6; ++face)
+            glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+
+        // Linear filtering with depth comparison gives a 2x2 percentage closer filter per lookup
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        UTrackTexture(shadow.cubes[i], VRAM_RENDER_TARGETS, 6 * GLsizeiptr(SHADOW_MAP_SIZE) * SHADOW_MAP_SIZE * sizeof(GLfloat));
+    }
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+    // Depth only: no color buffer is read or written
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow.framebuffer);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    shadow.front = 0;
+    shadow.valid = false;
+    shadow.frontPosition = shadow.backPosition = glm::vec3(0.0f);
+    shadow.nextFace = 6;
+    shadow.transformVersion = 0;
+    shadow.light = -1;
+    shadow.pcf = 1;
+}
 
-       // Front sqaure
-      -2.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 0.0f, // index 0
-       4.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 0.0f, // index 1
-       4.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 1.0f, // index 5
-       4.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  1.0f, 1.0f, // index 5
-      -2.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 1.0f, // index 0
-      -2.0f,  0.5f,  1.0f,  0.0f,  1.0f, 0.0f,  0.0f, 0.0f // index 4
-    };
 
-    GLfloat chargerProngV[] = {
-      // Front face
-     -0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,  // index 0
-      0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,  // index 1
-     -0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,  // index 2
-     -0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,  // index 2
-      0.1f, 0.0f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,  // index 3
-      0.1f, 1.5f,  1.0f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,  // index 1
+void UDestroyShadowMap(UShadowMap& shadow)
+{
+    glDeleteFramebuffers(1, &shadow.framebuffer);
+    UDeleteTextures(2, shadow.cubes);
+}
 
-      //Back Face         //Positive Z Normal
-     -0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,  // index 4
-      0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,  // index 5
-     -0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,  // index 6
-     -0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,  // index 6
-      0.1f, 0.0f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,  // index 7
-      0.1f, 1.5f, -1.0f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,  // index 5
 
-     //Left Face          //Negative X Normal
-     -0.1f, 1.5f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 0
-     -0.1f, 0.0f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  // index 2
-     -0.1f, 0.0f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 6
-     -0.1f, 0.0f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 6
-     -0.1f, 1.5f, -1.0f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  // index 4
-     -0.1f, 1.5f,  1.0f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 0
+// Renders one face of the back cube from shadow.backPosition, skipping objects outside the face's frustum
+static void URenderShadowFace(UShadowMap& shadow, const UScene& scene, const UFramePacket& packet, GLuint programId, int face)
+{
+    // Look direction and up vector of each cube map face, in GL_TEXTURE_CUBE_MAP_POSITIVE_X + face order
+    static const glm::vec3 directions[6] = { glm::vec3(1, 0, 0), glm::vec3(-1, 0, 0), glm::vec3(0, 1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1) };
+    static const glm::vec3 ups[6] = { glm::vec3(0, -1, 0), glm::vec3(0, -1, 0), glm::vec3(0, 0, 1), glm::vec3(0, 0, -1), glm::vec3(0, -1, 0), glm::vec3(0, -1, 0) };
+
+    const glm::vec3 direction = directions[face];
+    const glm::vec3 up = ups[face];
+    const glm::vec3 side = glm::cross(direction, up);
+    const glm::mat4 viewProjection = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR_PLANE, SHADOW_FAR_PLANE)
+        * glm::lookAt(shadow.backPosition, shadow.backPosition + direction, up);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, shadow.cubes[1 - shadow.front], 0);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    glUniformMatrix4fv(glGetUniformLocation(programId, "faceViewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+    ++gFrameStats.uniformUploads;
+
+    // The four side planes of a 90 degree frustum bisect the face direction and the side axes
+    const glm::vec3 planes[4] = { glm::normalize(direction + side), glm::normalize(direction - side), glm::normalize(direction + up), glm::normalize(direction - up) };
+
+    const GLint modelLoc = glGetUniformLocation(programId, "model");
+    GLuint boundVao = 0;
+    for (size_t i = 0; i < packet.draws.size(); ++i)
+    {
+        const USceneObject& object = scene.objects[packet.draws[i].object];
+        const glm::mat4& model = packet.draws[i].model;
+        const GLIndexedMesh& mesh = gMeshPool[scene.meshes[object.mesh].lods[0]];
+
+        // Bounding sphere of the mesh in world space
+        const glm::vec3 center = glm::vec3(model * glm::vec4((mesh.boundsMin + mesh.boundsMax) * 0.5f, 1.0f)) - shadow.backPosition;
+        const float scale = std::max(glm::length(glm::vec3(model[0])), std::max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+        const float radius = glm::length(mesh.boundsMax - mesh.boundsMin) * 0.5f * scale;
+        bool visible = glm::length(center) - radius < SHADOW_FAR_PLANE;
+        for (int p = 0; p < 4 && visible; ++p)
+            visible = glm::dot(center, planes[p]) > -radius;
+        if (!visible)
+            continue;
+
+        glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
+        if (mesh.vao != boundVao)
+        {
+            glBindVertexArray(mesh.vao);
+            boundVao = mesh.vao;
+        }
+        glDrawElements(GL_TRIANGLES, mesh.indices, GL_UNSIGNED_INT, NULL);
+        ++gFrameStats.uniformUploads;
+        ++gFrameStats.draws;
+        gFrameStats.triangles += GLuint(mesh.indices / 3);
+    }
+}
 
-     //Right Face         //Positive X Normal
-      0.1f, 1.5f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 1
-      0.1f, 0.0f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,  // index 3
-      0.1f, 0.0f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 7
-      0.1f, 0.0f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,  // index 7
-      0.1f, 1.5f, -1.0f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,  // index 5
-      0.1f, 1.5f,  1.0f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,  // index 1
 
-      //Bottom Face        //Negative Y Normal
-     -0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,  // index 2
-      0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,  // index 3
-      0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,  // index 7
-      0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,  // index 7
-     -0.1f, 0.0f, -1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,  // index 6
-     -0.1f, 0.0f,  1.0f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,  // index 2
+/* Keeps the shadow map of the first shadow casting light current. Nothing is rendered while the light stays
+ * within SHADOW_MOVE_THRESHOLD of the position the cube was made from and no object moved; otherwise the
+ * back cube is refreshed SHADOW_FACES_PER_FRAME faces at a time. Only the very first map is rendered whole.
+ * Leaves the viewport at the shadow map size.
+ */
+void UUpdateShadowMap(UShadowMap& shadow, const UScene& scene, const UFramePacket& packet)
+{
+    UPROFILE_GPU_SCOPE("Shadow map");
+    int light = -1;
+    for (size_t i = 0; i < packet.lights.size() && light < 0; ++i)
+    {
+        if (packet.lights[i].shadow)
+            light = int(i);
+    }
+    if (light != shadow.light)
+    {
+        shadow.light = light;
+        shadow.valid = false;
+        shadow.nextFace = 6;
+    }
+    if (light < 0)
+        return;
 
-       //Top Face           //Positive Y Normal
-     -0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,  // index 0
-      0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,  // index 1
-      0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  // index 5
-      0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,  // index 5
-     -0.1f, 1.5f, -1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,  // index 4
-     -0.1f, 1.5f,  1.0f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f   // index 0
-    };
+    const glm::vec3 position = packet.lights[light].position;
+    if (shadow.nextFace == 6 && (!shadow.valid || packet.transformVersion != shadow.transformVersion
+        || glm::length(position - shadow.frontPosition) > SHADOW_MOVE_THRESHOLD))
+    {
+        shadow.backPosition = position;
+        shadow.transformVersion = packet.transformVersion;
+        shadow.nextFace = 0;
+    }
+    if (shadow.nextFace == 6)
+        return;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow.framebuffer);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    const GLuint programId = UGetShaderVariant(gShadowShaders, 0);
+    glUseProgram(programId);
+    glUniform3fv(glGetUniformLocation(programId, "lightPosition"), 1, glm::value_ptr(shadow.backPosition));
+    glUniform1f(glGetUniformLocation(programId, "shadowFar"), SHADOW_FAR_PLANE);
+    ++gFrameStats.programBinds;
+    gFrameStats.uniformUploads += 2;
+
+    const int lastFace = shadow.valid ? std::min(6, shadow.nextFace + SHADOW_FACES_PER_FRAME) : 6;
+    for (; shadow.nextFace < lastFace; ++shadow.nextFace)
+        URenderShadowFace(shadow, scene, packet, programId, shadow.nextFace);
 
+    glBindVertexArray(0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
+    // A finished back cube becomes the one that is sampled
+    if (shadow.nextFace == 6)
+    {
+        shadow.front = 1 - shadow.front;
+        shadow.frontPosition = shadow.backPosition;
+        shadow.valid = true;
+    }
+}
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+// Binds the front shadow cube and passes its parameters to a program that includes clusteredLightingSource
+void USetShadowUniforms(GLuint programId, const UShadowMap& shadow)
+{
+    static const int samples[SHADOW_PCF_LEVELS] = { 1, 8, 20 };
 
-    mesh.tissueBoxVertices = sizeof(tissueBoxV) / (sizeof(tissueBoxV[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.planeVertices = sizeof(planeV) / (sizeof(planeV[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.tissueVertices = sizeof(tissueV) / (sizeof(tissueV[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.wristPadVertices = sizeof(wristPadV) / (sizeof(wristPadV[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-    mesh.chargerProngVertices = sizeof(chargerProngV) / (sizeof(chargerProngV[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, shadow.cubes[shadow.front]);
+    glActiveTexture(GL_TEXTURE0);
 
-    /* Plane */
-    glGenVertexArrays(1, &mesh.planeVAO);
-    glBindVertexArray(mesh.planeVAO);
+    glUniform1i(glGetUniformLocation(programId, "shadowLight"), shadow.valid ? shadow.light : -1);
+    glUniform3fv(glGetUniformLocation(programId, "shadowPosition"), 1, glm::value_ptr(shadow.frontPosition));
+    glUniform1f(glGetUniformLocation(programId, "shadowFar"), SHADOW_FAR_PLANE);
+    glUniform1i(glGetUniformLocation(programId, "shadowSamples"), samples[shadow.pcf]);
+    ++gFrameStats.textureBinds;
+    gFrameStats.uniformUploads += 4;
+}
 
 
-    glGenBuffers(1, &mesh.planeVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.planeVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(planeV), planeV, GL_STATIC_DRAW);
+/* Lightmap baking */
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+// Median split bounding volume hierarchy with up to four triangles per leaf. 'order' is permuted so each
+// leaf's triangles are contiguous.
+static void UBuildBvhNode(const std::vector<UBakeTriangle>& triangles, const std::vector<glm::vec3>& centroids, std::vector<GLuint>& order,
+    std::vector<UBvhNode>& nodes, GLuint nodeIndex, GLuint first, GLuint count)
+{
+    glm::vec3 boundsMin(FLT_MAX), boundsMax(-FLT_MAX), centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (GLuint i = first; i < first + count; ++i)
+    {
+        const UBakeTriangle& t = triangles[order[i]];
+        const glm::vec3 corners[3] = { t.v0, t.v0 + t.edge1, t.v0 + t.edge2 };
+        for (int c = 0; c < 3; ++c)
+        {
+            boundsMin = glm::min(boundsMin, corners[c]);
+            boundsMax = glm::max(boundsMax, corners[c]);
+        }
+        centroidMin = glm::min(centroidMin, centroids[order[i]]);
+        centroidMax = glm::max(centroidMax, centroids[order[i]]);
+    }
+    nodes[nodeIndex].boundsMin = boundsMin;
+    nodes[nodeIndex].boundsMax = boundsMax;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    if (count <= 4)
+    {
+        nodes[nodeIndex].first = first;
+        nodes[nodeIndex].count = count;
+        return;
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    // Split at the median centroid along the widest axis
+    const glm::vec3 extent = centroidMax - centroidMin;
+    const int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    const GLuint half = count / 2;
+    std::nth_element(order.begin() + first, order.begin() + first + half, order.begin() + first + count,
+        [&](GLuint a, GLuint b) { return centroids[a][axis] < centroids[b][axis]; });
+
+    const GLuint left = GLuint(nodes.size());
+    nodes.resize(nodes.size() + 2);
+    nodes[nodeIndex].first = left;
+    nodes[nodeIndex].count = 0;
+    UBuildBvhNode(triangles, centroids, order, nodes, left, first, half);
+    UBuildBvhNode(triangles, centroids, order, nodes, left + 1, first + half, count - half);
+}
 
-    /* Tissue Box */
-    glGenVertexArrays(1, &mesh.tissueBoxVAO); 
-    glBindVertexArray(mesh.tissueBoxVAO);
 
-    glGenBuffers(1, &mesh.tissueBoxVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.tissueBoxVBO); 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(tissueBoxV), tissueBoxV, GL_STATIC_DRAW);
+void UBuildBvh(const std::vector<UBakeTriangle>& triangles, std::vector<GLuint>& order, std::vector<UBvhNode>& nodes)
+{
+    std::vector<glm::vec3> centroids(triangles.size());
+    order.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i)
+    {
+        centroids[i] = triangles[i].v0 + (triangles[i].edge1 + triangles[i].edge2) / 3.0f;
+        order[i] = GLuint(i);
+    }
+    nodes.assign(1, UBvhNode());
+    if (triangles.empty())
+    {
+        nodes[0].boundsMin = nodes[0].boundsMax = glm::vec3(0.0f);
+        nodes[0].first = nodes[0].count = 0;
+        return;
+    }
+    UBuildBvhNode(triangles, centroids, order, nodes, 0, 0, GLuint(triangles.size()));
+}
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Ray against box slab test; returns the entry distance, or FLT_MAX on a miss
+static float UIntersectBounds(const UBvhNode& node, const glm::vec3& origin, const glm::vec3& inverseDirection, float maxDistance)
+{
+    const glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+    const glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+    const glm::vec3 near = glm::min(t0, t1), far = glm::max(t0, t1);
+    const float enter = std::max(std::max(near.x, near.y), std::max(near.z, 0.0f));
+    const float exit = std::min(std::min(far.x, far.y), std::min(far.z, maxDistance));
+    return enter <= exit ? enter : FLT_MAX;
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
-    /* Tissue */
-    glGenVertexArrays(1, &mesh.tissueVAO);
-    glBindVertexArray(mesh.tissueVAO);
+// Closest hit along a ray (Moller-Trumbore triangle test), visiting the nearer child first
+bool UTraceRay(const ULightmap& lightmap, const glm::vec3& origin, const glm::vec3& direction, GLuint& triangle, float& distance)
+{
+    const glm::vec3 inverseDirection = 1.0f / direction;
+    distance = FLT_MAX;
+    GLuint stack[64];
+    int top = 0;
+    if (UIntersectBounds(lightmap.nodes[0], origin, inverseDirection, distance) == FLT_MAX)
+        return false;
+    stack[top++] = 0;
 
-    glGenBuffers(1, &mesh.tissueVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.tissueVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(tissueV), tissueV, GL_STATIC_DRAW);
+    while (top > 0)
+    {
+        const UBvhNode& node = lightmap.nodes[stack[--top]];
+        if (node.count > 0)
+        {
+            for (GLuint i = node.first; i < node.first + node.count; ++i)
+            {
+                const UBakeTriangle& t = lightmap.triangles[i];
+                const glm::vec3 p = glm::cross(direction, t.edge2);
+                const float determinant = glm::dot(t.edge1, p);
+                if (std::fabs(determinant) < 1e-9f)
+                    continue;
+                const float inverse = 1.0f / determinant;
+                const glm::vec3 s = origin - t.v0;
+                const float u = glm::dot(s, p) * inverse;
+                if (u < 0.0f || u > 1.0f)
+                    continue;
+                const glm::vec3 q = glm::cross(s, t.edge1);
+                const float v = glm::dot(direction, q) * inverse;
+                if (v < 0.0f || u + v > 1.0f)
+                    continue;
+                const float hit = glm::dot(t.edge2, q) * inverse;
+                if (hit > 0.0f && hit < distance)
+                {
+                    distance = hit;
+                    triangle = i;
+                }
+            }
+            continue;
+        }
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+        const float nearHit = UIntersectBounds(lightmap.nodes[node.first], origin, inverseDirection, distance);
+        const float farHit = UIntersectBounds(lightmap.nodes[node.first + 1], origin, inverseDirection, distance);
+        const GLuint nearChild = nearHit <= farHit ? node.first : node.first + 1;
+        const float second = std::max(nearHit, farHit);
+        if (second != FLT_MAX && top < 64)
+            stack[top++] = node.first + node.first + 1 - nearChild;
+        if (std::min(nearHit, farHit) != FLT_MAX && top < 64)
+            stack[top++] = nearChild;
+    }
+    return distance != FLT_MAX;
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+static float URandom(uint32_t& state)
+{
+    // xorshift32
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return (state >> 8) * (1.0f / 16777216.0f);
+}
 
-    /* Wrist Pad */
-    glGenVertexArrays(1, &mesh.wristPadVAO);
-    glBindVertexArray(mesh.wristPadVAO);
 
-    glGenBuffers(1, &mesh.wristPadVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.wristPadVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(wristPadV), wristPadV, GL_STATIC_DRAW);
+// One path from a surface point: the ambient sky (radiance 1) reached after up to LIGHTMAP_BOUNCES diffuse bounces
+static glm::vec3 UTraceAmbientPath(const ULightmap& lightmap, glm::vec3 origin, glm::vec3 normal, uint32_t& random)
+{
+    glm::vec3 throughput(1.0f);
+    for (int bounce = 0; bounce <= LIGHTMAP_BOUNCES; ++bounce)
+    {
+        // Cosine weighted direction around the normal, in an orthonormal basis built from it
+        const float sign = normal.z >= 0.0f ? 1.0f : -1.0f;
+        const float a = -1.0f / (sign + normal.z);
+        const float b = normal.x * normal.y * a;
+        const glm::vec3 tangent(1.0f + sign * normal.x * normal.x * a, sign * b, -sign * normal.x);
+        const glm::vec3 bitangent(b, sign + normal.y * normal.y * a, -normal.y);
+        const float angle = 6.2831853f * URandom(random);
+        const float radius2 = URandom(random);
+        const float radius = std::sqrt(radius2);
+        const glm::vec3 direction = tangent * (radius * std::cos(angle)) + bitangent * (radius * std::sin(angle)) + normal * std::sqrt(1.0f - radius2);
+
+        GLuint hit = 0;
+        float distance;
+        if (!UTraceRay(lightmap, origin, direction, hit, distance))
+            return throughput;
+        if (bounce == LIGHTMAP_BOUNCES)
+            break;
+
+        // Continue from the hit, on the side of the surface the ray arrived from
+        const UBakeTriangle& t = lightmap.triangles[hit];
+        normal = t.normal;
+        if (glm::dot(normal, direction) > 0.0f)
+            normal = -normal;
+        throughput *= lightmap.albedo[t.material];
+        origin += direction * distance + normal * 1e-3f;
+    }
+    return glm::vec3(0.0f);
+}
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+static bool UWriteLightmap(const ULightmap& lightmap, int samples)
+{
+    ULightmapFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "ULMP", 4);
+    header.version = LIGHTMAP_FILE_VERSION;
+    header.layoutHash = lightmap.layoutHash;
+    header.width = uint32_t(lightmap.width);
+    header.height = uint32_t(lightmap.height);
+    header.samples = uint32_t(samples);
+
+    // Written to a temporary name first so a cancelled bake never leaves a truncated lightmap behind
+    const std::string temporary = lightmap.file + ".tmp";
+    FILE* out = fopen(temporary.c_str(), "wb");
+    if (!out)
+        return false;
+    std::vector<glm::vec3> average(lightmap.accumulated.size());
+    for (size_t i = 0; i < average.size(); ++i)
+        average[i] = lightmap.accumulated[i] / float(samples);
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(average.data(), sizeof(glm::vec3), average.size(), out);
+    const bool ok = !ferror(out);
+    fclose(out);
+    remove(lightmap.file.c_str());
+    return ok && rename(temporary.c_str(), lightmap.file.c_str()) == 0;
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
-    /* Charger Prong */
-    glGenVertexArrays(1, &mesh.chargerProngVAO);
-    glBindVertexArray(mesh.chargerProngVAO);
+// Bake thread: adds LIGHTMAP_SAMPLES_PER_PASS paths to every texel per pass, publishing the average after each
+static void UBakeLightmap(ULightmap* lightmapPointer)
+{
+    ULightmap& lightmap = *lightmapPointer;
+    UNameProfileThread(gProfiler, "Lightmap baker");
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const unsigned workers = std::max(1u, std::thread::hardware_concurrency());
+    int samples = 0;
 
-    glGenBuffers(1, &mesh.chargerProngVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.chargerProngVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(chargerProngV), chargerProngV, GL_STATIC_DRAW);
+    while (samples < lightmap.targetSamples && !lightmap.quit)
+    {
+        UPROFILE_SCOPE("Lightmap pass");
 
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+        // Rows are handed out one at a time, so busy and idle threads balance themselves
+        std::atomic<GLsizei> nextRow(0);
+        const int pass = samples / LIGHTMAP_SAMPLES_PER_PASS;
+        struct Worker
+        {
+            static void Run(ULightmap* lightmap, std::atomic<GLsizei>* nextRow, int pass)
+            {
+                for (GLsizei y = (*nextRow)++; y < lightmap->height && !lightmap->quit; y = (*nextRow)++)
+                {
+                    for (GLsizei x = 0; x < lightmap->width; ++x)
+                    {
+                        const size_t index = size_t(y) * lightmap->width + x;
+                        const ULightmapTexel& texel = lightmap->texels[index];
+                        if (texel.normal == glm::vec3(0.0f))
+                            continue;
+                        uint32_t random = uint32_t(index * 9781u + pass * 6271u) | 1u;
+                        glm::vec3 sum(0.0f);
+                        for (int i = 0; i < LIGHTMAP_SAMPLES_PER_PASS; ++i)
+                            sum += UTraceAmbientPath(*lightmap, texel.position + texel.normal * 1e-3f, texel.normal, random);
+                        lightmap->accumulated[index] += sum;
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < workers; ++i)
+            threads.push_back(std::thread(&Worker::Run, &lightmap, &nextRow, pass));
+        for (size_t i = 0; i < threads.size(); ++i)
+            threads[i].join();
+        if (lightmap.quit)
+            break;
+        samples += LIGHTMAP_SAMPLES_PER_PASS;
+
+        std::lock_guard<std::mutex> lock(lightmap.displayMutex);
+        lightmap.display.resize(lightmap.accumulated.size());
+        for (size_t i = 0; i < lightmap.accumulated.size(); ++i)
+            lightmap.display[i] = glm::vec4(lightmap.accumulated[i] / float(samples), 1.0f);
+        lightmap.isDisplayReady = true;
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    if (!lightmap.quit)
+    {
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (UWriteLightmap(lightmap, samples))
+            cout << "INFO: Baked " << lightmap.file << " (" << lightmap.width << "x" << lightmap.height << ", " << samples << " samples) in " << seconds << " s" << endl;
+        else
+            cout << "Failed to write lightmap " << lightmap.file << endl;
+    }
+    lightmap.baking = false;
+}
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float)* (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
 
-   
+// Reads a lightmap baked for this layout, as the RGBA pixels of the atlas texture
+static bool ULoadLightmap(const ULightmap& lightmap, std::vector<glm::vec4>& pixels)
+{
+    UMappedFile file;
+    if (!UMapFile(lightmap.file.c_str(), file))
+        return false;
+    const ULightmapFileHeader* header = (const ULightmapFileHeader*)file.data;
+    const size_t count = size_t(lightmap.width) * lightmap.height;
+    const bool ok = file.size >= sizeof(ULightmapFileHeader) && memcmp(header->magic, "ULMP", 4) == 0
+        && header->version == LIGHTMAP_FILE_VERSION && header->layoutHash == lightmap.layoutHash
+        && header->width == uint32_t(lightmap.width) && header->height == uint32_t(lightmap.height)
+        && file.size >= sizeof(ULightmapFileHeader) + count * sizeof(glm::vec3);
+    if (ok)
+    {
+        const glm::vec3* texels = (const glm::vec3*)(file.data + sizeof(ULightmapFileHeader));
+        pixels.resize(count);
+        for (size_t i = 0; i < count; ++i)
+            pixels[i] = glm::vec4(texels[i], 1.0f);
+    }
+    else
+        cout << "INFO: Lightmap " << lightmap.file << " is out of date, ignoring it" << endl;
+    UUnmapFile(file);
+    return ok;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Snapshots what the ray tracer needs besides the triangles: the material colors and the hierarchy
+static void UBuildBakeScene(const UScene& scene, ULightmap& lightmap)
 {
-    glDeleteVertexArrays(1, &mesh.tissueBoxVAO);
-    glDeleteBuffers(1, &mesh.tissueBoxVBO);
+    // The smallest mip level of each texture is its average color
+    lightmap.albedo.resize(scene.materials.size());
+    for (size_t i = 0; i < scene.materials.size(); ++i)
+    {
+        glm::vec3 color(0.5f);
+        if (scene.materials[i].texture)
+        {
+            GLint width = 1, height = 1;
+            glBindTexture(GL_TEXTURE_2D, scene.materials[i].texture);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+            const GLint level = GLint(std::floor(std::log2(float(std::max(std::max(width, height), 1)))));
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_WIDTH, &width);
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, level, GL_TEXTURE_HEIGHT, &height);
+            std::vector<glm::vec3> pixels(size_t(std::max(width, 1)) * std::max(height, 1));
+            glGetTexImage(GL_TEXTURE_2D, level, GL_RGB, GL_FLOAT, pixels.data());
+            color = pixels[0];
+        }
+        lightmap.albedo[i] = glm::min(color, glm::vec3(0.9f));      // Keep every bounce losing energy
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // The triangles are reordered into BVH leaf order
+    std::vector<GLuint> order;
+    UBuildBvh(lightmap.triangles, order, lightmap.nodes);
+    std::vector<UBakeTriangle> sorted(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        sorted[i] = lightmap.triangles[order[i]];
+    lightmap.triangles.swap(sorted);
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+/* Lays out the lightmap atlas for the scene objects and creates their lightmapped meshes: one vertex per
+ * triangle corner, with the lightmap coordinates in a second buffer on attribute 3. The lightmap file
+ * (next to the scene file) is used if it was baked for the same layout; with bakeSamples > 0 a new bake
+ * is started instead. Objects keep their plain meshes when there is neither.
+ */
+bool UPrepareLightmap(UScene& scene, const char* sceneFile, ULightmap& lightmap, int bakeSamples)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    UPROFILE_SCOPE("Prepare lightmap");
+    lightmap.texture = 0;
+    lightmap.file = std::string(sceneFile) + ".lightmap";
+    lightmap.baking = false;
+    lightmap.quit = false;
+    lightmap.isDisplayReady = false;
+
+    struct Cell
     {
-        flipImageVertically(image, width, height, channels);
+        GLuint object, triangle;        // Object and index of the triangle's first index
+        GLsizei size, x, y;
+    };
+    std::vector<Cell> cells;
+    std::vector<std::vector<GLfloat> > objectVertices(scene.objects.size());
+    std::vector<std::vector<GLuint> > objectIndices(scene.objects.size());
+    UUpdateTransforms(scene.transforms);
+
+    // Copy each object's mesh back from the GPU and give every triangle a cell sized by its world space area
+    for (size_t o = 0; o < scene.objects.size(); ++o)
+    {
+        const GLIndexedMesh& mesh = gMeshPool[scene.meshes[scene.objects[o].mesh].lods[0]];
+        GLint vertexBytes = 0;
+        glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+        glGetBufferParameteriv(GL_ARRAY_BUFFER, GL_BUFFER_SIZE, &vertexBytes);
+        objectVertices[o].resize(vertexBytes / sizeof(GLfloat));
+        glGetBufferSubData(GL_ARRAY_BUFFER, 0, objectVertices[o].size() * sizeof(GLfloat), objectVertices[o].data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        objectIndices[o].resize(mesh.indices);
+        glBindVertexArray(mesh.vao);
+        glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, mesh.indices * sizeof(GLuint), objectIndices[o].data());
+        glBindVertexArray(0);
+
+        const glm::mat4& model = scene.transforms.world[scene.objects[o].entity];
+        for (GLuint t = 0; t + 2 < GLuint(mesh.indices); t += 3)
+        {
+            glm::vec3 corners[3];
+            for (int c = 0; c < 3; ++c)
+                corners[c] = glm::vec3(model * glm::vec4(glm::make_vec3(&objectVertices[o][objectIndices[o][t + c] * FLOATS_PER_VERTEX]), 1.0f));
+            const float area = 0.5f * glm::length(glm::cross(corners[1] - corners[0], corners[2] - corners[0]));
+            Cell cell;
+            cell.object = GLuint(o);
+            cell.triangle = t;
+            cell.size = glm::clamp(GLsizei(std::sqrt(2.0f * area) * LIGHTMAP_TEXELS_PER_UNIT), LIGHTMAP_MIN_CELL, LIGHTMAP_MAX_CELL);
+            cells.push_back(cell);
+        }
+    }
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    // Shelf packing, largest cells first
+    std::vector<GLuint> order(cells.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = GLuint(i);
+    std::stable_sort(order.begin(), order.end(), [&](GLuint a, GLuint b) { return cells[a].size > cells[b].size; });
+    GLsizei x = 0, y = 0, shelf = 0;
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        Cell& cell = cells[order[i]];
+        if (x + cell.size > LIGHTMAP_WIDTH)
+        {
+            x = 0;
+            y += shelf;
+            shelf = 0;
+        }
+        cell.x = x;
+        cell.y = y;
+        x += cell.size;
+        shelf = std::max(shelf, cell.size);
+    }
+    lightmap.width = LIGHTMAP_WIDTH;
+    lightmap.height = std::max<GLsizei>(y + shelf, 1);
+    lightmap.texels.assign(size_t(lightmap.width) * lightmap.height, ULightmapTexel());
+    for (size_t i = 0; i < lightmap.texels.size(); ++i)
+        lightmap.texels[i].position = lightmap.texels[i].normal = glm::vec3(0.0f);
+
+    // Fill in the texels and build the lightmapped vertex data
+    std::vector<std::vector<GLfloat> > bakedVertices(scene.objects.size());
+    std::vector<std::vector<GLfloat> > bakedCoordinates(scene.objects.size());
+    lightmap.triangles.clear();
+    for (size_t i = 0; i < cells.size(); ++i)
+    {
+        const Cell& cell = cells[i];
+        const USceneObject& object = scene.objects[cell.object];
+        const glm::mat4& model = scene.transforms.world[object.entity];
+        const glm::mat3 normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glm::vec3 corners[3], normals[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            const GLfloat* vertex = &objectVertices[cell.object][objectIndices[cell.object][cell.triangle + c] * FLOATS_PER_VERTEX];
+            corners[c] = glm::vec3(model * glm::vec4(glm::make_vec3(vertex), 1.0f));
+            normals[c] = normalMatrix * glm::make_vec3(vertex + 3);
+            bakedVertices[cell.object].insert(bakedVertices[cell.object].end(), vertex, vertex + FLOATS_PER_VERTEX);
+        }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
+        UBakeTriangle triangle;
+        triangle.v0 = corners[0];
+        triangle.edge1 = corners[1] - corners[0];
+        triangle.edge2 = corners[2] - corners[0];
+        triangle.material = object.material;
+
+        // The winding gives the facing; the vertex normals only flip it when they clearly disagree
+        triangle.normal = glm::cross(triangle.edge1, triangle.edge2);
+        const bool isDegenerate = glm::length(triangle.normal) < 1e-12f;
+        if (isDegenerate)
+            triangle.normal = glm::vec3(0.0f);
         else
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            triangle.normal = glm::normalize(triangle.normal);
+            if (glm::dot(triangle.normal, normals[0] + normals[1] + normals[2]) < -0.5f)
+                triangle.normal = -triangle.normal;
         }
+        lightmap.triangles.push_back(triangle);
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+        // Corners sit half a texel inside the cell's lower left half
+        const float inner = float(cell.size) - 2.0f;
+        const glm::vec2 origin(cell.x + 1.0f, cell.y + 1.0f);
+        const glm::vec2 mapped[3] = { origin, origin + glm::vec2(inner, 0.0f), origin + glm::vec2(0.0f, inner) };
+        for (int c = 0; c < 3; ++c)
+        {
+            bakedCoordinates[cell.object].push_back(mapped[c].x / lightmap.width);
+            bakedCoordinates[cell.object].push_back(mapped[c].y / lightmap.height);
+        }
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+        if (isDegenerate)
+            continue;
 
-        return true;
+        for (GLsizei ty = 0; ty < cell.size; ++ty)
+        {
+            for (GLsizei tx = 0; tx < cell.size; ++tx)
+            {
+                // Barycentric coordinates of the texel center, clamped onto the triangle
+                float u = (tx + 0.5f - 1.0f) / inner;
+                float v = (ty + 0.5f - 1.0f) / inner;
+                u = glm::clamp(u, 0.0f, 1.0f);
+                v = glm::clamp(v, 0.0f, 1.0f);
+                if (u + v > 1.0f)
+                {
+                    const float excess = (u + v - 1.0f) * 0.5f;
+                    u = glm::clamp(u - excess, 0.0f, 1.0f);
+                    v = 1.0f - u;
+                }
+                ULightmapTexel& texel = lightmap.texels[size_t(cell.y + ty) * lightmap.width + cell.x + tx];
+                texel.position = triangle.v0 + triangle.edge1 * u + triangle.edge2 * v;
+                texel.normal = triangle.normal;
+            }
+        }
     }
 
-    // Error loading the image
-    return false;
+    // A lightmap only matches the exact texel layout it was baked for
+    lightmap.layoutHash = UHashBytes((const unsigned char*)lightmap.texels.data(), lightmap.texels.size() * sizeof(ULightmapTexel));
+
+    // The traced scene stays around for the probe grid even when the lightmap is loaded or missing
+    UBuildBakeScene(scene, lightmap);
+    std::vector<glm::vec4> pixels;
+    if (bakeSamples <= 0 && !ULoadLightmap(lightmap, pixels))
+    {
+        lightmap.texels.clear();
+        return false;
+    }
+    if (bakeSamples > 0)
+        pixels.assign(lightmap.texels.size(), glm::vec4(1.0f));     // Unoccluded until the first pass lands
+
+    glGenTextures(1, &lightmap.texture);
+    glBindTexture(GL_TEXTURE_2D, lightmap.texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, lightmap.width, lightmap.height, 0, GL_RGBA, GL_FLOAT, pixels.data());
+    UTrackTexture(lightmap.texture, VRAM_LIGHTING, GLsizeiptr(lightmap.width) * lightmap.height * 4 * sizeof(GLushort));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    for (size_t o = 0; o < scene.objects.size(); ++o)
+    {
+        const GLuint meshId = UCreatePoolMesh();
+        const GLsizei vertexCount = GLsizei(bakedVertices[o].size() / FLOATS_PER_VERTEX);
+        std::vector<GLuint> indices(vertexCount);
+        for (GLsizei i = 0; i < vertexCount; ++i)
+            indices[i] = GLuint(i);
+        const GLIndexedMesh& source = gMeshPool[scene.meshes[scene.objects[o].mesh].lods[0]];
+        UUploadPoolMesh(meshId, bakedVertices[o].data(), vertexCount, indices.data(), indices.size(), source.boundsMin, source.boundsMax);
+
+        GLIndexedMesh& mesh = gMeshPool[meshId];
+        const GLsizeiptr coordinateBytes = GLsizeiptr(bakedCoordinates[o].size() * sizeof(GLfloat));
+        if (gHasDirectStateAccess)
+        {
+            // Lightmap coordinates come from their own buffer, on binding 1
+            mesh.lightmapVbo = UCreateStaticBuffer(coordinateBytes, bakedCoordinates[o].data());
+            glEnableVertexArrayAttrib(mesh.vao, 3);
+            glVertexArrayAttribFormat(mesh.vao, 3, 2, GL_FLOAT, GL_FALSE, 0);
+            glVertexArrayAttribBinding(mesh.vao, 3, 1);
+            glVertexArrayVertexBuffer(mesh.vao, 1, mesh.lightmapVbo, 0, 2 * sizeof(GLfloat));
+        }
+        else
+        {
+            glBindVertexArray(mesh.vao);
+            glGenBuffers(1, &mesh.lightmapVbo);
+            glBindBuffer(GL_ARRAY_BUFFER, mesh.lightmapVbo);
+            glBufferData(GL_ARRAY_BUFFER, coordinateBytes, bakedCoordinates[o].data(), GL_STATIC_DRAW);
+            glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, 2 * sizeof(GLfloat), 0);
+            glEnableVertexAttribArray(3);
+            glBindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        UTrackBuffer(mesh.lightmapVbo, VRAM_MESHES, coordinateBytes);
+
+        scene.objects[o].lightmapMesh = meshId;
+    }
+
+    if (bakeSamples > 0)
+        UStartLightmapBake(lightmap, bakeSamples);
+    else
+    {
+        cout << "INFO: Loaded lightmap " << lightmap.file << endl;
+        lightmap.texels.clear();
+    }
+    return true;
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Starts the background bake of the prepared atlas
+void UStartLightmapBake(ULightmap& lightmap, int samples)
 {
-    glGenTextures(1, &textureId);
+    lightmap.accumulated.assign(lightmap.texels.size(), glm::vec3(0.0f));
+    lightmap.targetSamples = samples;
+    lightmap.quit = false;
+    lightmap.baking = true;
+    cout << "INFO: Baking " << lightmap.file << " (" << lightmap.triangles.size() << " triangles, " << samples << " samples) in the background" << endl;
+    lightmap.thread = std::thread(UBakeLightmap, &lightmap);
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Uploads the bake's latest progressive result, if there is a new one
+void UUpdateLightmap(ULightmap& lightmap)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    if (!lightmap.texture)
+        return;
+    std::unique_lock<std::mutex> lock(lightmap.displayMutex, std::try_to_lock);
+    if (!lock.owns_lock() || !lightmap.isDisplayReady)
+        return;
+    glBindTexture(GL_TEXTURE_2D, lightmap.texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, lightmap.width, lightmap.height, GL_RGBA, GL_FLOAT, lightmap.display.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
+    lightmap.isDisplayReady = false;
+}
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+void UDestroyLightmap(ULightmap& lightmap)
+{
+    lightmap.quit = true;
+    if (lightmap.thread.joinable())
+        lightmap.thread.join();
+    UDeleteTextures(1, &lightmap.texture);
+    lightmap.texture = 0;
+}
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+/* Irradiance probes */
 
+/* Bakes the probe grid over the bounds of the traced scene. Each probe projects PROBE_RAYS samples of the
+ * incoming ambient light onto the L2 spherical harmonics basis: the sky where a ray escapes, and the light
+ * bounced off a surface (one path traced from the hit) where it doesn't. Probes run in parallel.
+ */
+bool UBakeProbes(const ULightmap& scene, UProbeGrid& probes)
+{
+    UPROFILE_SCOPE("Bake probes");
+    probes.texture = 0;
+    if (scene.triangles.empty())
         return false;
-    }
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+    // One probe at the center of each grid cell, so none sits exactly on the outer surfaces
+    const glm::vec3 extent = glm::max(scene.nodes[0].boundsMax - scene.nodes[0].boundsMin, glm::vec3(1e-3f));
+    for (int axis = 0; axis < 3; ++axis)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
-
-        return false;
+        probes.counts[axis] = glm::clamp(int(std::ceil(extent[axis] / PROBE_SPACING)), 1, PROBE_MAX_COUNT);
+        probes.spacing[axis] = extent[axis] / probes.counts[axis];
     }
+    probes.origin = scene.nodes[0].boundsMin + probes.spacing * 0.5f;
+    const size_t count = size_t(probes.counts.x) * probes.counts.y * probes.counts.z;
+    probes.coefficients.assign(count * 9, glm::vec3(0.0f));
+    std::vector<unsigned char> isValid(count);
+
+    UProbeGrid* grid = &probes;
+    const ULightmap* traced = &scene;
+    unsigned char* valid = isValid.data();
+    UParallelFor(count, 1, [=](size_t begin, size_t end)
+    {
+        for (size_t p = begin; p < end; ++p)
+        {
+            const glm::ivec3 cell(int(p % grid->counts.x), int(p / grid->counts.x % grid->counts.y), int(p / (size_t(grid->counts.x) * grid->counts.y)));
+            const glm::vec3 position = grid->origin + glm::vec3(cell) * grid->spacing;
+            uint32_t random = uint32_t(p * 2654435761u) | 1u;
+            glm::vec3 sh[9];
+            int backFaces = 0;
+            for (int i = 0; i < 9; ++i)
+                sh[i] = glm::vec3(0.0f);
+
+            for (int ray = 0; ray < PROBE_RAYS; ++ray)
+            {
+                // Uniform direction on the sphere
+                const float z = 1.0f - 2.0f * URandom(random);
+                const float radius = std::sqrt(std::max(0.0f, 1.0f - z * z));
+                const float angle = 6.2831853f * URandom(random);
+                const glm::vec3 direction(radius * std::cos(angle), radius * std::sin(angle), z);
+
+                glm::vec3 radiance(1.0f);
+                GLuint hit = 0;
+                float distance;
+                if (UTraceRay(*traced, position, direction, hit, distance))
+                {
+                    const UBakeTriangle& t = traced->triangles[hit];
+                    if (glm::dot(t.normal, direction) > 0.0f)
+                    {
+                        ++backFaces;
+                        radiance = glm::vec3(0.0f);
+                    }
+                    else
+                        radiance = traced->albedo[t.material] * UTraceAmbientPath(*traced, position + direction * distance + t.normal * 1e-3f, t.normal, random);
+                }
+
+                const glm::vec3& d = direction;
+                sh[0] += radiance * 0.282095f;
+                sh[1] += radiance * (0.488603f * d.y);
+                sh[2] += radiance * (0.488603f * d.z);
+                sh[3] += radiance * (0.488603f * d.x);
+                sh[4] += radiance * (1.092548f * d.x * d.y);
+                sh[5] += radiance * (1.092548f * d.y * d.z);
+                sh[6] += radiance * (0.315392f * (3.0f * d.z * d.z - 1.0f));
+                sh[7] += radiance * (1.092548f * d.x * d.z);
+                sh[8] += radiance * (0.546274f * (d.x * d.x - d.y * d.y));
+            }
+
+            // Monte Carlo weight 4 pi / N, then the cosine lobe per band (pi, 2 pi / 3, pi / 4) over pi
+            const float band[9] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+            for (int i = 0; i < 9; ++i)
+                grid->coefficients[p * 9 + i] = sh[i] * (band[i] * 4.0f * 3.14159265f / PROBE_RAYS);
+
+            // A probe inside an object mostly sees back faces
+            valid[p] = backFaces * 4 < PROBE_RAYS;
+        }
+    });
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
-
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+    // Probes inside objects take the average of their valid neighbours, spreading inwards one step per pass
+    const int steps[3] = { 1, probes.counts.x, probes.counts.x * probes.counts.y };
+    for (bool isFilling = true; isFilling;)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        isFilling = false;
+        std::vector<unsigned char> filled = isValid;
+        for (size_t p = 0; p < count; ++p)
+        {
+            if (isValid[p])
+                continue;
+            const glm::ivec3 cell(int(p % probes.counts.x), int(p / probes.counts.x % probes.counts.y), int(p / steps[2]));
+            glm::vec3 sum[9];
+            int neighbours = 0;
+            for (int i = 0; i < 9; ++i)
+                sum[i] = glm::vec3(0.0f);
+            for (int axis = 0; axis < 3; ++axis)
+            {
+                for (int side = -1; side <= 1; side += 2)
+                {
+                    const int coordinate = cell[axis] + side;
+                    const size_t neighbour = p + side * steps[axis];
+                    if (coordinate < 0 || coordinate >= probes.counts[axis] || !isValid[neighbour])
+                        continue;
+                    for (int i = 0; i < 9; ++i)
+                        sum[i] += probes.coefficients[neighbour * 9 + i];
+                    ++neighbours;
+                }
+            }
+            if (neighbours == 0)
+                continue;
+            for (int i = 0; i < 9; ++i)
+                probes.coefficients[p * 9 + i] = sum[i] / float(neighbours);
+            filled[p] = true;
+            isFilling = true;
+        }
+        isValid.swap(filled);
+    }
 
-        return false;
+    // Slab k holds floats 4k to 4k + 3 of every probe's coefficients
+    std::vector<glm::vec4> texels(count * PROBE_SLABS, glm::vec4(0.0f));
+    for (size_t p = 0; p < count; ++p)
+    {
+        const float* floats = glm::value_ptr(probes.coefficients[p * 9]);
+        for (int f = 0; f < 27; ++f)
+            texels[(f / 4) * count + p][f % 4] = floats[f];
     }
+    glGenTextures(1, &probes.texture);
+    glBindTexture(GL_TEXTURE_3D, probes.texture);
+    glTexImage3D(GL_TEXTURE_3D, 0, GL_RGBA16F, probes.counts.x, probes.counts.y, probes.counts.z * PROBE_SLABS, 0, GL_RGBA, GL_FLOAT, texels.data());
+    UTrackTexture(probes.texture, VRAM_LIGHTING, GLsizeiptr(texels.size()) * 4 * sizeof(GLushort));
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_3D, 0);
+
+    const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    cout << "INFO: Baked " << count << " irradiance probes (" << probes.counts.x << "x" << probes.counts.y << "x" << probes.counts.z
+        << ") in " << milliseconds << " ms" << endl;
+    return true;
+}
 
-    glUseProgram(programId);    // Uses the shader program
 
-    return true;
+// The grid is static, so this runs once per program variant; it also binds the grid's texture unit
+void USetProbeUniforms(GLuint programId, const UProbeGrid& probes)
+{
+    glActiveTexture(GL_TEXTURE0 + PROBE_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_3D, probes.texture);
+    glActiveTexture(GL_TEXTURE0);
+
+    glUseProgram(programId);
+    glUniform1i(glGetUniformLocation(programId, "uProbes"), PROBE_TEXTURE_UNIT);
+    glUniform3fv(glGetUniformLocation(programId, "probeOrigin"), 1, glm::value_ptr(probes.origin));
+    glUniform3fv(glGetUniformLocation(programId, "probeSpacing"), 1, glm::value_ptr(probes.spacing));
+    glUniform3iv(glGetUniformLocation(programId, "probeCounts"), 1, glm::value_ptr(probes.counts));
+    glUseProgram(0);
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+void UDestroyProbes(UProbeGrid& probes)
 {
-    glDeleteProgram(programId);
+    UDeleteTextures(1, &probes.texture);
+    probes.texture = 0;
 }